@@ -0,0 +1,140 @@
+// Host benchmark of the sigrok_pico sample encoders.
+//
+// Runs every encoder over every synthetic corpus in continuous mode and
+// reports the input (DMA) and output (USB) byte rates, the compression ratio
+// and the time spent per sample. With -m <MHz> it also reports an estimate of
+// the CPU cycles per sample at that clock.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "corpus.h"
+#include "sr_encoder.h"
+
+// Samples in each segment, and segments of distinct data per corpus
+#define SAMPLES_PER_SEG 32768
+#define SEGS 8
+
+typedef struct bench_mode {
+  const char *name;
+  uint8_t d_dma_bps;
+  uint8_t pack_bits;
+  uint8_t channels;
+} bench_mode_t;
+
+static const bench_mode_t modes[] = {
+    {"D4", 0, 0, 4},
+    {"P6", 4, 6, 6},
+    {"1B", 1, 0, 8},
+    {"P10", 4, 10, 10},
+    {"2B", 2, 0, 16},
+    {"4B", 4, 0, 21},
+};
+
+// The encoded bytes are only counted, so a single block is reused
+static uint8_t tx_block[TX_BUFFER_SIZE];
+
+static uint8_t *count_get(void *ctx) {
+  (void)ctx;
+  return tx_block;
+}
+
+static void count_put(void *ctx, uint8_t *buf, uint32_t len) {
+  (void)buf;
+  *(uint64_t *)ctx += len;
+}
+
+static double now_s(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv) {
+  double min_time = 0.25;
+  double mhz = 0;
+  int csv = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "t:m:c")) != -1) {
+    switch (opt) {
+    case 't':
+      min_time = atof(optarg);
+      break;
+    case 'm':
+      mhz = atof(optarg);
+      break;
+    case 'c':
+      csv = 1;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-t seconds per case] [-m cpu MHz] [-c]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  uint32_t *samples = malloc(SAMPLES_PER_SEG * SEGS * sizeof(uint32_t));
+  uint8_t *dbuf = malloc(SAMPLES_PER_SEG * SEGS * 4);
+  static sr_encoder_t enc;
+  uint64_t out_bytes;
+
+  if (csv) {
+    printf("mode,corpus,bytes_in,bytes_out,ratio,mb_in_s,mb_out_s,msamples_s,ns_sample,cycles_sample\n");
+  } else {
+    printf("%-4s %-7s %10s %10s %7s %9s %9s %9s %9s %9s\n", "mode", "corpus", "in/seg", "out/seg", "ratio",
+           "MB/s in", "MB/s out", "MSa/s", "ns/samp", "cyc/samp");
+  }
+
+  for (unsigned m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+    // Segments hold whole words of packed samples
+    uint32_t sps = modes[m].pack_bits ? SAMPLES_PER_SEG / (32 / modes[m].pack_bits) * (32 / modes[m].pack_bits) : SAMPLES_PER_SEG;
+    for (int c = 0; c < corpus_count; c++) {
+      corpora[c].gen(samples, sps * SEGS, modes[m].channels, 0xC0FFEE + c);
+      uint32_t in_bytes = corpus_pack(dbuf, samples, sps * SEGS, modes[m].d_dma_bps, modes[m].pack_bits, 0xBEEF) / SEGS;
+
+      memset(&enc, 0, sizeof(enc));
+      enc.d_mask = (1u << modes[m].channels) - 1;
+      enc.samples_per_seg = sps;
+      enc.num_samples = sps * SEGS;
+      enc.continuous = true;
+      enc.d_dma_bps = modes[m].d_dma_bps;
+      enc.d_pack_bits = modes[m].pack_bits;
+      enc.d_tx_bps = (modes[m].channels + 6) / 7;
+      enc.tx_get = count_get;
+      enc.tx_put = count_put;
+      enc.tx_ctx = &out_bytes;
+      sr_encoder_reset(&enc);
+
+      out_bytes = 0;
+      uint64_t segs = 0;
+      double start = now_s(), elapsed;
+      do {
+        for (int h = 0; h < SEGS; h++) {
+          sr_send_slices(&enc, dbuf + h * in_bytes, NULL);
+        }
+        segs += SEGS;
+        elapsed = now_s() - start;
+      } while (elapsed < min_time);
+
+      double nsamples = (double)segs * sps;
+      double out_seg = (double)out_bytes / segs;
+      double ns_sample = elapsed * 1e9 / nsamples;
+      double cyc_sample = mhz * ns_sample / 1e3;
+      if (csv) {
+        printf("%s,%s,%u,%.1f,%.4f,%.2f,%.2f,%.2f,%.3f,%.2f\n", modes[m].name, corpora[c].name, in_bytes, out_seg,
+               out_seg / in_bytes, segs * in_bytes / elapsed / 1e6, out_bytes / elapsed / 1e6, nsamples / elapsed / 1e6,
+               ns_sample, cyc_sample);
+      } else {
+        printf("%-4s %-7s %10u %10.1f %7.4f %9.2f %9.2f %9.2f %9.3f %9.2f\n", modes[m].name, corpora[c].name, in_bytes,
+               out_seg, out_seg / in_bytes, segs * in_bytes / elapsed / 1e6, out_bytes / elapsed / 1e6,
+               nsamples / elapsed / 1e6, ns_sample, cyc_sample);
+      }
+    }
+  }
+
+  free(samples);
+  free(dbuf);
+  return 0;
+}
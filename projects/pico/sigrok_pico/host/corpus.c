@@ -0,0 +1,148 @@
+#include <string.h>
+
+#include "corpus.h"
+
+uint32_t corpus_rand(uint32_t *state) {
+  uint32_t x = *state ? *state : 0x12345678;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *state = x;
+  return x;
+}
+
+static uint32_t chan_mask(uint8_t channels) {
+  return (channels >= 32) ? 0xFFFFFFFF : ((1u << channels) - 1);
+}
+
+// A quiet bus, every channel holds its value for the whole capture
+static void gen_idle(uint32_t *samples, uint32_t count, uint8_t channels, uint32_t seed) {
+  (void)seed;
+  for (uint32_t i = 0; i < count; i++) {
+    samples[i] = 0x5A5A5A5A & chan_mask(channels);
+  }
+}
+
+// Two independent 8N1 UART lines on channels 0 (TX) and 1 (RX) at 16 samples
+// per bit, with random bytes separated by random idle gaps.
+static void gen_uart_line(uint32_t *samples, uint32_t count, uint8_t bit, uint32_t *state) {
+  uint32_t i = corpus_rand(state) % 64;
+  for (uint32_t j = 0; j < i && j < count; j++) {
+    samples[j] |= 1u << bit;
+  }
+  while (i < count) {
+    uint32_t frame = ((corpus_rand(state) & 0xFF) << 1) | 0x200; // start, 8 data, stop
+    for (int b = 0; b < 10; b++) {
+      for (int k = 0; k < 16 && i < count; k++, i++) {
+        samples[i] |= ((frame >> b) & 1) << bit;
+      }
+    }
+    uint32_t gap = corpus_rand(state) % 200;
+    for (uint32_t k = 0; k < gap && i < count; k++, i++) {
+      samples[i] |= 1u << bit;
+    }
+  }
+}
+
+static void gen_uart(uint32_t *samples, uint32_t count, uint8_t channels, uint32_t seed) {
+  uint32_t state = seed;
+  memset(samples, 0, count * sizeof(uint32_t));
+  gen_uart_line(samples, count, 0, &state);
+  if (channels > 1) {
+    gen_uart_line(samples, count, 1, &state);
+  }
+}
+
+// SPI bursts: channel 0 is CS (active low), 1 is SCK, 2 MOSI and 3 MISO with 4
+// samples per clock period. Bursts of 4..35 bytes are separated by long idle
+// stretches.
+static void gen_spi(uint32_t *samples, uint32_t count, uint8_t channels, uint32_t seed) {
+  uint32_t state = seed;
+  uint32_t i = 0;
+  (void)channels;
+  while (i < count) {
+    uint32_t gap = 2000 + corpus_rand(&state) % 4000;
+    for (uint32_t k = 0; k < gap && i < count; k++, i++) {
+      samples[i] = 0x1;
+    }
+    uint32_t nbytes = 4 + corpus_rand(&state) % 32;
+    for (uint32_t n = 0; n < nbytes; n++) {
+      uint32_t mosi = corpus_rand(&state), miso = corpus_rand(&state);
+      for (int b = 7; b >= 0; b--) {
+        uint32_t data = (((mosi >> b) & 1) << 2) | (((miso >> b) & 1) << 3);
+        for (int k = 0; k < 4 && i < count; k++, i++) {
+          samples[i] = data | ((k >= 2) ? 0x2 : 0x0);
+        }
+      }
+    }
+  }
+}
+
+// A free running clock on channel 0 toggling every 5 samples
+static void gen_clock(uint32_t *samples, uint32_t count, uint8_t channels, uint32_t seed) {
+  (void)seed;
+  uint32_t rest = 0x5A5A5A5A & chan_mask(channels) & ~1u;
+  for (uint32_t i = 0; i < count; i++) {
+    samples[i] = rest | ((i / 5) & 1);
+  }
+}
+
+// Every channel random on every sample, the worst case for RLE
+static void gen_random(uint32_t *samples, uint32_t count, uint8_t channels, uint32_t seed) {
+  uint32_t state = seed;
+  for (uint32_t i = 0; i < count; i++) {
+    samples[i] = corpus_rand(&state) & chan_mask(channels);
+  }
+}
+
+const corpus_t corpora[] = {
+    {"idle", gen_idle},
+    {"uart", gen_uart},
+    {"spi", gen_spi},
+    {"clock", gen_clock},
+    {"random", gen_random},
+};
+
+const int corpus_count = sizeof(corpora) / sizeof(corpora[0]);
+
+uint32_t corpus_pack(uint8_t *dbuf, const uint32_t *samples, uint32_t count, uint8_t d_dma_bps, uint8_t pack_bits,
+                     uint32_t seed) {
+  uint32_t state = seed;
+  if (pack_bits) {
+    // The ISR shifts right, so the samples of a word end up in its top bits, first sample lowest
+    uint32_t *wbuf = (uint32_t *)dbuf;
+    uint32_t spw = 32 / pack_bits;
+    uint32_t shift = 32 - spw * pack_bits;
+    for (uint32_t i = 0; i < count; i++) {
+      if ((i % spw) == 0) {
+        wbuf[i / spw] = 0;
+      }
+      wbuf[i / spw] |= (samples[i] & ((1u << pack_bits) - 1)) << (shift + (i % spw) * pack_bits);
+    }
+    return ((count + spw - 1) / spw) * 4;
+  } else if (d_dma_bps == 0) {
+    uint32_t *wbuf = (uint32_t *)dbuf;
+    for (uint32_t i = 0; i < count; i++) {
+      if ((i & 7) == 0) {
+        wbuf[i >> 3] = 0;
+      }
+      wbuf[i >> 3] |= (samples[i] & 0xF) << ((i & 7) * 4);
+    }
+    return ((count + 7) >> 3) * 4;
+  } else if (d_dma_bps == 1) {
+    for (uint32_t i = 0; i < count; i++) {
+      dbuf[i] = samples[i];
+    }
+  } else if (d_dma_bps == 2) {
+    uint16_t *hbuf = (uint16_t *)dbuf;
+    for (uint32_t i = 0; i < count; i++) {
+      hbuf[i] = samples[i];
+    }
+  } else {
+    uint32_t *wbuf = (uint32_t *)dbuf;
+    for (uint32_t i = 0; i < count; i++) {
+      wbuf[i] = (samples[i] & 0x1FFFFF) | (corpus_rand(&state) & 0xFFE00000);
+    }
+  }
+  return count * d_dma_bps;
+}
@@ -0,0 +1,32 @@
+#ifndef _CORPUS_H_
+#define _CORPUS_H_
+
+#include <stdint.h>
+
+// ------------------------------------
+// Synthetic signal corpora used to exercise the encoders on the host. Each
+// generator fills one sample value per entry, with channel 0 in bit 0.
+// ------------------------------------
+
+typedef void (*corpus_gen_t)(uint32_t *samples, uint32_t count, uint8_t channels, uint32_t seed);
+
+typedef struct corpus {
+  const char *name; // Short name used in reports
+  corpus_gen_t gen; // Sample generator
+} corpus_t;
+
+extern const corpus_t corpora[];
+extern const int corpus_count;
+
+// Small xorshift PRNG so that the corpora are the same on every host
+uint32_t corpus_rand(uint32_t *state);
+
+// Pack sample values into a DMA buffer the way the PIO/DMA stores them for the
+// given d_dma_bps (0 for D4, 1, 2 or 4), or with pack_bits 32/pack_bits samples
+// to a word. In 4B mode the unused upper bits are filled with junk from seed, as
+// the PIO captures GPIOs above the digital channels too. Returns the number of
+// bytes written.
+uint32_t corpus_pack(uint8_t *dbuf, const uint32_t *samples, uint32_t count, uint8_t d_dma_bps, uint8_t pack_bits,
+                     uint32_t seed);
+
+#endif // _CORPUS_H_
@@ -0,0 +1,14 @@
+#ifndef _USBD_PVT_H_
+#define _USBD_PVT_H_
+
+// Host stand in for the TinyUSB device endpoint API that sr_usb.c uses, see usb_test.c
+
+#include <stdbool.h>
+#include <stdint.h>
+
+bool usbd_edpt_claim(uint8_t rhport, uint8_t ep_addr);
+bool usbd_edpt_release(uint8_t rhport, uint8_t ep_addr);
+bool usbd_edpt_xfer(uint8_t rhport, uint8_t ep_addr, uint8_t *buffer, uint16_t total_bytes);
+bool usbd_edpt_busy(uint8_t rhport, uint8_t ep_addr);
+
+#endif // _USBD_PVT_H_
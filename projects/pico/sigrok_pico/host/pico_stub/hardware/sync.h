@@ -0,0 +1,10 @@
+#ifndef _HARDWARE_SYNC_H
+#define _HARDWARE_SYNC_H
+
+// Host stand in for the pico-sdk barriers and events, the test runs on one thread
+
+static inline void __sev(void) {}
+static inline void __wfe(void) {}
+static inline void __dmb(void) {}
+
+#endif // _HARDWARE_SYNC_H
@@ -0,0 +1,13 @@
+#ifndef _PICO_STDLIB_H
+#define _PICO_STDLIB_H
+
+// Host stand in for the pico-sdk timer, whose time usb_test.c sets
+
+#include <stdint.h>
+
+#define PICO_STDIO_USB_STDOUT_TIMEOUT_US 500000
+
+uint64_t time_us_64(void);
+uint32_t time_us_32(void);
+
+#endif // _PICO_STDLIB_H
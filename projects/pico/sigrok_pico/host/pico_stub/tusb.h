@@ -0,0 +1,12 @@
+#ifndef _TUSB_H_
+#define _TUSB_H_
+
+// Host stand in for the TinyUSB device state that sr_usb.c uses, see usb_test.c
+
+#include <stdbool.h>
+
+void tud_task(void);
+bool tud_mounted(void);
+bool tud_cdc_connected(void);
+
+#endif // _TUSB_H_
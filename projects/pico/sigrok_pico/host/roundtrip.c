@@ -0,0 +1,837 @@
+// Round trip property test of the sigrok_pico wire formats.
+//
+// Feeds random and adversarial sample buffers through the encoders segment by
+// segment, the same way check_segment does, decodes the stream with sr_decoder and
+// checks that:
+// * every sample (masked to the enabled channels) comes back unchanged,
+// * fixed mode sends exactly num_samples and continuous mode every sample,
+// * sent_cnt matches the samples sent and ccnt the bytes on the wire,
+// * the stream does not depend on how the capture is split into segments, as
+//   runs are carried from one segment to the next.
+// * without analog channels, sending the same samples as runs with sr_send_run,
+//   as the transition capture does, gives the same stream.
+// * oversampled analog values are averaged by sr_decimate before encoding.
+// * with segments dropped or cut short, the gap markers put the samples that
+//   are left back at their place in the capture.
+// * a random UART, SPI or I2C bus, given to sr_protocol_edge as the changes the
+//   transition capture reads and with noise on the other channels, comes back
+//   from sr_decode_frames as the frames that were sent on it.
+//
+// usage: sr_roundtrip [iterations] [seed]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "corpus.h"
+#include "sr_config.h"
+#include "sr_decimate.h"
+#include "sr_decoder.h"
+#include "sr_encoder.h"
+#include "sr_protocol.h"
+
+#define MAX_SEGS 6
+#define MAX_SAMPLES_PER_SEG 4096
+#define MAX_SAMPLES ((MAX_SEGS + 2) * MAX_SAMPLES_PER_SEG)
+// About the size of a ring segment on the device, where the capture buffer takes most of the RAM.
+// Digital captures are also run at that size, two segments of up to 8 packed samples a byte.
+#define RING_SEG_BYTES (28 * 1024)
+#define MAX_RING_SAMPLES (2 * RING_SEG_BYTES * 8)
+
+typedef struct rt_case {
+  uint8_t d_chan_cnt;
+  uint8_t d_low; // Lowest enabled channel, the others follow it
+  uint8_t a_chan_cnt;
+  uint8_t a_bps; // 1 for 8 bit analog samples sent as 7 bits, 2 for 12 bit ones
+  bool a_delta;  // Analog delta format
+  bool a_walk;   // Slowly varying analog values rather than random ones
+  uint8_t a_ratio; // ADC conversions averaged into each analog value
+  bool continuous;
+  uint32_t samples_per_seg;
+  uint32_t num_samples;
+  uint32_t segs;
+  int corpus; // Index in corpora, -1 for the adversarial run generator or -2 for an idle bus
+  uint32_t seed;
+} rt_case_t;
+
+static uint32_t samples[MAX_RING_SAMPLES];
+static uint16_t analog[MAX_SAMPLES * 3];
+static uint8_t abuf[MAX_SAMPLES * 3 * 2 * SR_DECIMATE_MAX];
+static uint8_t aseg[MAX_SAMPLES * 3 * 2 * SR_DECIMATE_MAX];
+static uint32_t junk[MAX_RING_SAMPLES];
+static uint32_t decoded[MAX_RING_SAMPLES];
+static uint16_t decoded_analog[MAX_SAMPLES * 3];
+static uint8_t dbuf[MAX_RING_SAMPLES * 4];
+
+// Transport that decodes the stream and keeps a hash of it. The block has
+// spare room so that an encoder overrunning it is reported rather than
+// corrupting memory. Like the device waiting too long for the host, it can
+// drop the blocks of a segment after the first keep.
+typedef struct rt_sink {
+  sr_decoder_t *dec;
+  uint32_t hash;
+  bool overrun;
+  int32_t keep;  // Blocks still to pass before dropping the rest, -1 to pass all
+  uint32_t lost; // Bytes dropped
+  // Where the decoded samples continue in the capture after each gap marker
+  uint32_t gaps;
+  uint32_t gap_at[MAX_SEGS + 2];   // decoded samples before the marker
+  uint64_t gap_next[MAX_SEGS + 2]; // the sample that follows it
+  uint8_t block[2 * TX_BUFFER_SIZE];
+} rt_sink_t;
+
+static uint8_t *rt_get(void *ctx) {
+  return ((rt_sink_t *)ctx)->block;
+}
+
+static void rt_put(void *ctx, uint8_t *buf, uint32_t len) {
+  rt_sink_t *s = (rt_sink_t *)ctx;
+  if (len > TX_BUFFER_SIZE) {
+    s->overrun = true;
+  }
+  if (s->keep == 0) {
+    s->lost += len;
+    return;
+  } else if (s->keep > 0) {
+    s->keep--;
+  }
+  for (uint32_t i = 0; i < len; i++) {
+    s->hash = (s->hash ^ buf[i]) * 16777619; // FNV-1a
+  }
+  sr_decode(s->dec, buf, len);
+  // A gap marker ends the block it is in
+  if ((s->dec->gaps != s->gaps) && (s->gaps < MAX_SEGS + 2)) {
+    s->gap_at[s->gaps] = s->dec->count;
+    s->gap_next[s->gaps++] = s->dec->count + s->dec->dropped;
+  }
+}
+
+// Run lengths around every boundary of the two RLE formats
+static const uint32_t run_lengths[] = {1, 2, 3, 7, 8, 9, 15, 16, 17, 31, 32, 33, 63, 64, 65, 639, 640, 641, 647, 648, 1567, 1568, 1569, 3136, 3137};
+
+static void gen_adversarial(uint32_t *out, uint32_t count, uint32_t mask, uint32_t *state) {
+  uint32_t val = corpus_rand(state) & mask;
+  for (uint32_t i = 0; i < count;) {
+    uint32_t r = corpus_rand(state);
+    uint32_t len = (r & 3) ? run_lengths[(r >> 2) % (sizeof(run_lengths) / sizeof(run_lengths[0]))] : 1 + (r >> 2) % 5000;
+    for (uint32_t k = 0; k < len && i < count; k++, i++) {
+      out[i] = val;
+    }
+    // Mostly change value, but sometimes keep it so that runs merge
+    if (corpus_rand(state) & 7) {
+      val = (val + 1 + (corpus_rand(state) & mask)) & mask;
+    }
+  }
+}
+
+// A mostly idle bus, with steady values that last for up to a whole ring segment between bursts of
+// changes. The bursts leave the output block at any fill level when the long runs end.
+static void gen_idle(uint32_t *out, uint32_t count, uint32_t mask, uint32_t *state) {
+  uint32_t val = corpus_rand(state) & mask;
+  uint32_t burst = 0;
+  for (uint32_t i = 0; i < count;) {
+    uint32_t r = corpus_rand(state);
+    uint32_t len = 1 + (r >> 1) % 3;
+    if (burst == 0) {
+      len = 100000 + (r >> 1) % 150000;
+      burst = 1 + corpus_rand(state) % 1000;
+    }
+    burst--;
+    for (uint32_t k = 0; k < len && i < count; k++, i++) {
+      out[i] = val;
+    }
+    val = (val + 1 + (corpus_rand(state) & mask)) & mask;
+  }
+}
+
+// Same choice of packed storage as tx_init
+static uint8_t pack_bits(const rt_case_t *c) {
+  uint8_t n = c->d_low + c->d_chan_cnt;
+  if ((c->a_chan_cnt == 0) && (c->d_low > 0)) {
+    return c->d_chan_cnt;
+  }
+  return ((c->a_chan_cnt == 0) && ((n == 5) || (n == 6) || (n == 9) || (n == 10))) ? n : 0;
+}
+
+static uint32_t chan_mask(const rt_case_t *c) {
+  return ((c->d_chan_cnt >= 32) ? 0xFFFFFFFF : ((1u << c->d_chan_cnt) - 1)) << c->d_low;
+}
+
+static void describe(const rt_case_t *c) {
+  fprintf(stderr, "  d_chan %u from %u a_chan %u x%u/%u%s%s %s sph %u num_samples %u segs %u corpus %s seed 0x%08X\n", c->d_chan_cnt, c->d_low,
+          c->a_chan_cnt, c->a_bps, c->a_ratio, c->a_delta ? " delta" : "", c->a_walk ? " walk" : "", c->continuous ? "continuous" : "fixed", c->samples_per_seg, c->num_samples, c->segs,
+          (c->corpus == -2) ? "idle" : (c->corpus < 0) ? "adversarial" : corpora[c->corpus].name, c->seed);
+}
+
+// Transport of encode, whose gap markers the gap test follows
+static rt_sink_t sink;
+
+// Encode the samples of case c split into segments of sph samples and decode
+// them into decoded/decoded_analog. The segments set in drop are left out and
+// those in cut lose their blocks after a random few, and gaps are sent in their
+// place, as a continuous capture does when it falls behind. Returns the hash of
+// the stream, or 0 if a block was overrun.
+static uint32_t encode(const rt_case_t *c, sr_encoder_t *enc, sr_decoder_t *dec, uint32_t sph, uint32_t drop,
+                       uint32_t cut, uint32_t *state) {
+  memset(&sink, 0, sizeof(sink));
+  sink.dec = dec;
+  sink.hash = 2166136261u;
+  sink.keep = -1;
+  uint32_t mask = chan_mask(c);
+  uint8_t top = c->d_low + c->d_chan_cnt;
+  uint32_t segs = c->segs * c->samples_per_seg / sph;
+
+  // Same channel to storage mapping as main
+  uint8_t pin_count = 0;
+  if (c->d_chan_cnt) {
+    pin_count = (top <= 4) ? 4 : (top <= 8) ? 8 : (top <= 16) ? 16 : 32;
+    if ((pin_count == 4) && c->a_chan_cnt) {
+      pin_count = 8;
+    }
+    if (pack_bits(c)) {
+      pin_count = pack_bits(c);
+    }
+  }
+
+  memset(enc, 0, sizeof(*enc));
+  enc->d_mask = mask;
+  enc->num_samples = c->num_samples;
+  enc->samples_per_seg = sph;
+  enc->continuous = c->continuous;
+  enc->a_chan_cnt = c->a_chan_cnt;
+  enc->a_bps = c->a_bps;
+  enc->a_delta = c->a_delta;
+  enc->d_dma_bps = pack_bits(c) ? 4 : pin_count >> 3;
+  enc->d_pack_bits = pack_bits(c);
+  enc->d_shift = pack_bits(c) ? top - pack_bits(c) : 0;
+  enc->d_tx_bps = (top + 6) / 7;
+  enc->tx_get = rt_get;
+  enc->tx_put = rt_put;
+  enc->tx_ctx = &sink;
+  sr_encoder_reset(enc);
+
+  memset(dec, 0, sizeof(*dec));
+  dec->d4 = (c->a_chan_cnt == 0) && (enc->d_dma_bps == 0);
+  dec->d_tx_bps = enc->d_tx_bps;
+  dec->a_chan_cnt = c->a_chan_cnt;
+  dec->a_bps = c->a_bps;
+  dec->a_delta = c->a_delta;
+  dec->samples = decoded;
+  dec->analog = decoded_analog;
+  dec->capacity = MAX_RING_SAMPLES;
+  sr_decoder_reset(dec);
+
+  // Junk in the stored bits of the other channels, as the PIO captures whole
+  // groups of pins. These are sent as is, so they are the same for every split
+  // of the capture. Packed samples start at the lowest channel.
+  uint32_t stored_mask = ((pin_count >= 32) ? 0xFFFFFFFF : ((1u << pin_count) - 1)) << enc->d_shift;
+  uint32_t *stored = malloc(sph * sizeof(uint32_t));
+  bool gap = false;
+
+  for (uint32_t h = 0; h < segs; h++) {
+    if (!c->continuous && (enc->sent_cnt >= c->num_samples)) {
+      break;
+    }
+    if ((drop >> h) & 1) {
+      gap = true;
+      continue;
+    } else if (gap) {
+      sr_send_gap(enc, (uint64_t)h * sph);
+      gap = false;
+    }
+    if ((cut >> h) & 1) {
+      sink.keep = corpus_rand(state) % 3;
+      sink.lost = 0;
+    }
+    for (uint32_t i = 0; i < sph; i++) {
+      stored[i] = (samples[h * sph + i] | (junk[h * sph + i] & stored_mask & ~mask)) >> enc->d_shift;
+    }
+    corpus_pack(dbuf, stored, sph, enc->d_dma_bps, enc->d_pack_bits, corpus_rand(state));
+    if (c->a_ratio > 1) {
+      // The ring segment holds every conversion and is averaged in place
+      uint32_t raw_bytes = sph * c->a_chan_cnt * 2 * c->a_ratio;
+      memcpy(aseg, &abuf[h * raw_bytes], raw_bytes);
+      sr_decimate(aseg, sph, c->a_chan_cnt, c->a_ratio, c->a_bps);
+      sr_send_slices(enc, dbuf, aseg);
+    } else {
+      sr_send_slices(enc, dbuf, &abuf[h * sph * c->a_chan_cnt * c->a_bps]);
+    }
+    if ((cut >> h) & 1) {
+      sr_encoder_cut(enc, sink.lost);
+      sink.keep = -1;
+      gap = true;
+    }
+  }
+  if (gap) {
+    sr_send_gap(enc, (uint64_t)segs * sph);
+  }
+  sr_encoder_flush(enc);
+  free(stored);
+  if (sink.overrun) {
+    fprintf(stderr, "FAIL: output block overrun\n");
+    return 0;
+  }
+  return sink.hash;
+}
+
+// Encode the samples of case c as runs, split at random points as the transition capture does at
+// its repeated pushes, and with blocks handed over part way. Returns the hash of the stream, or 0 if
+// a block was overrun. The encoder configuration is left from the last encode.
+static uint32_t encode_runs(const rt_case_t *c, sr_encoder_t *enc, sr_decoder_t *dec, uint32_t *state) {
+  static rt_sink_t sink;
+  sink.dec = dec;
+  sink.hash = 2166136261u;
+  sink.overrun = false;
+  sink.keep = -1;
+  uint32_t total = c->segs * c->samples_per_seg;
+
+  enc->tx_ctx = &sink;
+  sr_encoder_reset(enc);
+  sr_decoder_reset(dec);
+  uint32_t start = 0;
+  for (uint32_t i = 1; i <= total; i++) {
+    if ((i == total) || (samples[i] != samples[start]) || ((corpus_rand(state) & 1023) == 0)) {
+      sr_send_run(enc, samples[start], i - start);
+      start = i;
+      if ((corpus_rand(state) & 15) == 0) {
+        sr_encoder_send_block(enc);
+      }
+    }
+  }
+  sr_encoder_flush(enc);
+  if (sink.overrun) {
+    fprintf(stderr, "FAIL: output block overrun\n");
+    return 0;
+  }
+  return sink.hash;
+}
+
+static int run_case(const rt_case_t *c) {
+  static sr_encoder_t enc;
+  static sr_decoder_t dec;
+  uint32_t state = c->seed;
+  uint32_t mask = chan_mask(c);
+
+  uint32_t total = c->segs * c->samples_per_seg;
+  if (c->corpus == -2) {
+    gen_idle(samples, total, mask >> c->d_low, &state);
+  } else if (c->corpus < 0) {
+    gen_adversarial(samples, total, mask >> c->d_low, &state);
+  } else {
+    corpora[c->corpus].gen(samples, total, c->d_chan_cnt, c->seed);
+  }
+  for (uint32_t i = 0; i < total; i++) {
+    samples[i] = (samples[i] << c->d_low) & mask;
+  }
+  // As the ADC FIFO holds them, either shifted to a byte or whole 12 bit values
+  uint32_t amax = (c->a_bps == 2) ? 0xFFF : 0xFF;
+  uint32_t hold = 0;
+  for (uint32_t i = 0; i < total * c->a_chan_cnt; i++) {
+    analog[i] = corpus_rand(&state) & amax;
+    if (c->a_walk && (i >= c->a_chan_cnt)) {
+      // Small steps from the previous slice with the odd jump, or steady for a run of slices
+      uint32_t r = corpus_rand(&state);
+      if ((hold == 0) && ((r & 15) == 0)) {
+        hold = c->a_chan_cnt * run_lengths[(r >> 4) % (sizeof(run_lengths) / sizeof(run_lengths[0]))];
+      }
+      int32_t step = hold ? 0 : ((r & 0xF0) == 0) ? (int32_t)(r >> 8) : (int32_t)((r >> 8) % 80) - 40;
+      analog[i] = (uint16_t)(analog[i - c->a_chan_cnt] + step) & amax;
+      hold -= (hold != 0);
+    }
+    if (c->a_ratio > 1) {
+      // 12 bit conversions around the value, whose average is the value sent
+      uint32_t sum = 0;
+      uint32_t slice = i / c->a_chan_cnt, chan = i % c->a_chan_cnt;
+      for (uint32_t k = 0; k < c->a_ratio; k++) {
+        uint16_t conv = corpus_rand(&state) & 0xFFF;
+        if (c->a_walk) {
+          int32_t v = ((c->a_bps == 2) ? analog[i] : (analog[i] << 4)) + (int32_t)(corpus_rand(&state) % 9) - 4;
+          conv = (v < 0) ? 0 : (v > 0xFFF) ? 0xFFF : v;
+        }
+        memcpy(&abuf[((slice * c->a_ratio + k) * c->a_chan_cnt + chan) * 2], &conv, 2);
+        sum += conv;
+      }
+      uint32_t shift = __builtin_ctz(c->a_ratio);
+      analog[i] = (c->a_bps == 2) ? ((sum + (c->a_ratio >> 1)) >> shift) : (sum >> (shift + 4));
+      continue;
+    }
+    if (c->a_bps == 2) {
+      memcpy(&abuf[i * 2], &analog[i], 2);
+    } else {
+      abuf[i] = analog[i];
+    }
+  }
+  for (uint32_t i = 0; i < total; i++) {
+    junk[i] = corpus_rand(&state);
+  }
+
+  // The whole capture in a single segment gives the reference stream
+  uint32_t single = encode(c, &enc, &dec, total, 0, 0, &state);
+  uint32_t split = encode(c, &enc, &dec, c->samples_per_seg, 0, 0, &state);
+  if (!single || !split) {
+    return 1;
+  } else if (single != split) {
+    fprintf(stderr, "FAIL: stream differs from the one of a single segment\n");
+    return 1;
+  }
+
+  uint32_t expected = c->continuous ? total : c->num_samples;
+  if (dec.error != SR_DECODER_OK) {
+    fprintf(stderr, "FAIL: decoder error %d after %u samples, byte %llu\n", dec.error, dec.count,
+            (unsigned long long)dec.bytes);
+    return 1;
+  }
+  if (dec.count != expected) {
+    fprintf(stderr, "FAIL: decoded %u samples, expected %u\n", dec.count, expected);
+    return 1;
+  }
+  if (enc.sent_cnt != expected) {
+    fprintf(stderr, "FAIL: sent_cnt %u, expected %u\n", enc.sent_cnt, expected);
+    return 1;
+  }
+  if (enc.ccnt != dec.bytes) {
+    fprintf(stderr, "FAIL: ccnt %u, bytes on the wire %llu\n", enc.ccnt, (unsigned long long)dec.bytes);
+    return 1;
+  }
+  for (uint32_t i = 0; i < expected; i++) {
+    if ((decoded[i] & mask) != (samples[i] & mask)) {
+      fprintf(stderr, "FAIL: sample %u decoded 0x%X expected 0x%X\n", i, decoded[i] & mask, samples[i] & mask);
+      return 1;
+    }
+  }
+  for (uint32_t i = 0; i < expected * c->a_chan_cnt; i++) {
+    uint16_t aval = (c->a_bps == 2) ? analog[i] : (analog[i] >> 1);
+    if (decoded_analog[i] != aval) {
+      fprintf(stderr, "FAIL: analog value %u decoded 0x%X expected 0x%X\n", i, decoded_analog[i], aval);
+      return 1;
+    }
+  }
+
+  // A continuous capture that falls behind drops whole segments, or cuts one short when the host stops
+  // taking its blocks. What is left must decode as is, however the runs and deltas stood before the
+  // gap, and each gap marker must say where in the capture the samples after it belong.
+  if (c->continuous && (c->segs > 1)) {
+    uint32_t drop = corpus_rand(&state) & ((1u << c->segs) - 1);
+    uint32_t cut = corpus_rand(&state) & ((1u << c->segs) - 1) & ~drop;
+    uint32_t gaps = 0;
+    if (!encode(c, &enc, &dec, c->samples_per_seg, drop, cut, &state)) {
+      return 1;
+    }
+    for (uint32_t h = 0; h < c->segs; h++) {
+      // A marker goes before each segment sent after a missing part, and at the end
+      bool missing = ((drop | cut) >> h) & 1;
+      bool sent_next = (h + 1 < c->segs) && !((drop >> (h + 1)) & 1);
+      gaps += missing && (sent_next || (h + 1 == c->segs));
+    }
+    uint64_t pos = 0;
+    uint32_t g = 0;
+    for (uint32_t k = 0; k < dec.count; k++, pos++) {
+      while ((g < sink.gaps) && (sink.gap_at[g] == k)) {
+        pos = sink.gap_next[g++];
+      }
+      bool same = (dec.error == SR_DECODER_OK) && (pos < total) && ((decoded[k] & mask) == (samples[pos] & mask));
+      for (uint32_t a = 0; same && (a < c->a_chan_cnt); a++) {
+        uint16_t aval = (c->a_bps == 2) ? analog[pos * c->a_chan_cnt + a] : (analog[pos * c->a_chan_cnt + a] >> 1);
+        same = decoded_analog[k * c->a_chan_cnt + a] == aval;
+      }
+      if (!same) {
+        fprintf(stderr, "FAIL: with gaps 0x%X cut 0x%X decoder error %d, sample %llu of %u decoded wrong\n", drop, cut,
+                dec.error, (unsigned long long)pos, total);
+        return 1;
+      }
+    }
+    if ((dec.error != SR_DECODER_OK) || (dec.count + dec.dropped != total) || (dec.gaps != gaps) || (enc.ccnt != dec.bytes)) {
+      fprintf(stderr, "FAIL: with gaps 0x%X cut 0x%X decoder error %d, decoded %u samples and %u gaps of %llu, expected %u in total and %u gaps\n",
+              drop, cut, dec.error, dec.count, dec.gaps, (unsigned long long)dec.dropped, total, gaps);
+      return 1;
+    }
+  }
+
+  // Runs only carry the enabled channels, so compare them with samples without junk
+  if ((c->a_chan_cnt == 0) && c->d_chan_cnt) {
+    memset(junk, 0, total * sizeof(uint32_t));
+    uint32_t clean = encode(c, &enc, &dec, total, 0, 0, &state);
+    uint32_t runs = encode_runs(c, &enc, &dec, &state);
+    if (!clean || !runs) {
+      return 1;
+    } else if (clean != runs) {
+      fprintf(stderr, "FAIL: run stream differs from the one of the samples\n");
+      return 1;
+    }
+    if ((dec.count != expected) || (enc.sent_cnt != expected) || (enc.ccnt != dec.bytes)) {
+      fprintf(stderr, "FAIL: runs decoded %u samples, sent_cnt %u, expected %u\n", dec.count, enc.sent_cnt, expected);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Protocol decoding
+#define MAX_EVENTS 65536
+#define MAX_FRAMES 1024
+
+static uint32_t ev_sample[MAX_EVENTS];
+static uint32_t ev_value[MAX_EVENTS];
+static sr_frame_t sent_frames[MAX_FRAMES];
+static sr_frame_t got_frames[MAX_FRAMES];
+static uint8_t frame_buf[MAX_EVENTS * SR_PROTOCOL_MAX_OUT];
+
+typedef struct pt_bus {
+  uint32_t events; // Events so far
+  uint32_t frames; // Frames sent so far
+  uint32_t t;      // Sample of the next change
+  uint32_t value;  // Value of the channels from the last event
+  uint32_t noise;  // Channels the bus doesn't use, which change at random
+  uint32_t *state;
+} pt_bus_t;
+
+// Set channel ch to level from sample t on. Before it there may be a change of another channel or
+// a repeated value, as the transition capture pushes. Changes on the same sample are one event.
+static void pt_set(pt_bus_t *b, uint32_t t, uint32_t ch, uint32_t level) {
+  uint32_t last = ev_sample[b->events - 1];
+  if ((t > last + 1) && ((corpus_rand(b->state) & 3) == 0)) {
+    ev_sample[b->events] = last + 1 + corpus_rand(b->state) % (t - last - 1);
+    b->value ^= b->noise & (1u << (corpus_rand(b->state) % 22));
+    ev_value[b->events++] = b->value;
+  }
+  b->value = (b->value & ~(1u << ch)) | (level << ch);
+  if (ev_sample[b->events - 1] != t) {
+    ev_sample[b->events++] = t;
+  }
+  ev_value[b->events - 1] = b->value;
+}
+
+static void pt_frame(pt_bus_t *b, uint8_t kind, uint32_t time, uint32_t data) {
+  sent_frames[b->frames].kind = kind;
+  sent_frames[b->frames].time = time;
+  sent_frames[b->frames].data = data;
+  b->frames++;
+}
+
+// Idle time between frames, mostly short but sometimes long enough to need time frames
+static uint32_t pt_gap(pt_bus_t *b) {
+  uint32_t r = corpus_rand(b->state);
+  return ((r & 0xFF) == 0) ? (r >> 3) : ((r & 0xF) == 0) ? (r >> 12) : (r >> 26);
+}
+
+static void gen_uart(sr_protocol_t *p, pt_bus_t *b) {
+  uint32_t rx = p->ch[SR_PROTOCOL_UART_RX];
+  uint32_t bit_fp = p->bit_fp;
+  pt_set(b, 0, rx, 1);
+  b->t = 1;
+  bool low = false;
+  while ((b->frames < MAX_FRAMES) && (b->events < MAX_EVENTS - 64) && (b->t < (1u << 31))) {
+    // After a low stop bit the line has to go high before the next start bit
+    uint32_t t0 = b->t + pt_gap(b) + low;
+    uint32_t r = corpus_rand(b->state);
+    uint32_t byte = r & 0xFF;
+    low = ((r >> 8) & 15) == 0;
+    uint32_t bits = (byte << 1) | (low ? 0 : 0x200);
+    for (uint32_t i = 0; i < 10; i++) {
+      pt_set(b, t0 + ((i * bit_fp) >> 8), rx, (bits >> i) & 1);
+    }
+    b->t = t0 + ((10 * bit_fp) >> 8);
+    pt_set(b, b->t, rx, 1);
+    pt_frame(b, SR_FRAME_UART, t0, byte | (low << 8));
+  }
+}
+
+static void gen_spi(sr_protocol_t *p, pt_bus_t *b) {
+  uint32_t cpol = p->spi_mode >> 1, cpha = p->spi_mode & 1;
+  uint32_t clk = p->ch[SR_PROTOCOL_SPI_CLK], mosi = p->ch[SR_PROTOCOL_SPI_MOSI];
+  uint32_t miso = p->ch[SR_PROTOCOL_SPI_MISO], cs = p->ch[SR_PROTOCOL_SPI_CS];
+  uint32_t h = 1 + corpus_rand(b->state) % 8;
+  pt_set(b, 0, clk, cpol);
+  if (cs != SR_PROTOCOL_NO_CH) {
+    pt_set(b, 0, cs, 1);
+  }
+  b->t = 1;
+  while ((b->frames < MAX_FRAMES - 4) && (b->events < MAX_EVENTS - 256) && (b->t < (1u << 31))) {
+    b->t += pt_gap(b);
+    if (cs != SR_PROTOCOL_NO_CH) {
+      pt_set(b, b->t, cs, 0);
+      b->t += h;
+    }
+    uint32_t words = 1 + corpus_rand(b->state) % 4;
+    // With CS a word can be cut short, which drops it
+    bool cut = (cs != SR_PROTOCOL_NO_CH) && ((corpus_rand(b->state) & 7) == 0);
+    for (uint32_t w = 0; w < words; w++) {
+      uint32_t out = corpus_rand(b->state) & 0xFF, in = corpus_rand(b->state) & 0xFF;
+      uint32_t start = 0;
+      uint32_t nbits = (cut && (w == words - 1)) ? 1 + corpus_rand(b->state) % 7 : 8;
+      for (uint32_t i = 0; i < nbits; i++) {
+        // The data changes on the edge before the sampling one
+        if (cpha) {
+          pt_set(b, b->t, clk, cpol ^ 1);
+        }
+        pt_set(b, b->t, mosi, (out >> (7 - i)) & 1);
+        if (miso != SR_PROTOCOL_NO_CH) {
+          pt_set(b, b->t, miso, (in >> (7 - i)) & 1);
+        }
+        b->t += h;
+        pt_set(b, b->t, clk, cpha ? cpol : (cpol ^ 1));
+        start = i ? start : b->t;
+        if (!cpha) {
+          pt_set(b, b->t + h, clk, cpol);
+        }
+        b->t += h;
+      }
+      if (nbits == 8) {
+        pt_frame(b, SR_FRAME_SPI, start, out | ((miso != SR_PROTOCOL_NO_CH) ? in << 12 : 0));
+      }
+    }
+    if (cs != SR_PROTOCOL_NO_CH) {
+      pt_set(b, b->t, cs, 1);
+      b->t += h;
+    }
+  }
+}
+
+static void gen_i2c(sr_protocol_t *p, pt_bus_t *b) {
+  uint32_t scl = p->ch[SR_PROTOCOL_I2C_SCL], sda = p->ch[SR_PROTOCOL_I2C_SDA];
+  uint32_t h = 2 + corpus_rand(b->state) % 8;
+  pt_set(b, 0, scl, 1);
+  pt_set(b, 0, sda, 1);
+  b->t = 1;
+  // Clocks before the first start aren't decoded
+  for (uint32_t i = corpus_rand(b->state) % 4; i; i--) {
+    pt_set(b, b->t, scl, 0);
+    pt_set(b, b->t + 1, sda, i > 1 ? corpus_rand(b->state) & 1 : 1);
+    pt_set(b, b->t + h, scl, 1);
+    b->t += 2 * h;
+  }
+  while ((b->frames < MAX_FRAMES - 8) && (b->events < MAX_EVENTS - 256) && (b->t < (1u << 31))) {
+    b->t += 1 + pt_gap(b);
+    pt_set(b, b->t, sda, 0);
+    pt_frame(b, SR_FRAME_I2C_START, b->t, 0);
+    for (uint32_t bytes = 1 + corpus_rand(b->state) % 4; bytes; bytes--) {
+      uint32_t r = corpus_rand(b->state);
+      uint32_t v = ((r & 0xFF) << 1) | ((r >> 8) & 1);
+      uint32_t start = 0;
+      for (uint32_t i = 0; i < 9; i++) {
+        b->t += h;
+        pt_set(b, b->t, scl, 0);
+        pt_set(b, b->t + 1, sda, (v >> (8 - i)) & 1);
+        b->t += h;
+        pt_set(b, b->t, scl, 1);
+        start = i ? start : b->t;
+      }
+      pt_frame(b, SR_FRAME_I2C_BYTE, start, v >> 1 | ((v & 1) << 8));
+    }
+    // A stop, or a repeated start which only sends the start
+    bool stop = corpus_rand(b->state) & 1;
+    b->t += h;
+    pt_set(b, b->t, scl, 0);
+    pt_set(b, b->t + 1, sda, !stop);
+    b->t += h;
+    pt_set(b, b->t, scl, 1);
+    b->t += h;
+    if (stop) {
+      pt_set(b, b->t, sda, 1);
+      pt_frame(b, SR_FRAME_I2C_STOP, b->t, 0);
+    }
+  }
+}
+
+static int run_protocol_case(uint32_t seed) {
+  static sr_protocol_t p;
+  uint32_t state = seed;
+  pt_bus_t b = {.events = 1, .state = &state};
+  uint32_t rate = 1000000 + corpus_rand(&state) % 100000000;
+
+  // Distinct channels for the roles, and the others are noise
+  uint8_t ch[22];
+  for (uint32_t i = 0; i < 22; i++) {
+    ch[i] = i;
+  }
+  for (uint32_t i = 0; i < 4; i++) {
+    uint32_t j = i + corpus_rand(&state) % (22 - i);
+    uint8_t tmp = ch[i];
+    ch[i] = ch[j];
+    ch[j] = tmp;
+  }
+  p.kind = SR_PROTOCOL_UART + corpus_rand(&state) % 3;
+  memcpy(p.ch, ch, 4);
+  p.spi_mode = corpus_rand(&state) & 3;
+  p.baud = rate / (4 + corpus_rand(&state) % 200);
+  if (p.kind == SR_PROTOCOL_SPI) {
+    p.ch[SR_PROTOCOL_SPI_MISO] = (corpus_rand(&state) & 3) ? p.ch[SR_PROTOCOL_SPI_MISO] : SR_PROTOCOL_NO_CH;
+    p.ch[SR_PROTOCOL_SPI_CS] = (corpus_rand(&state) & 1) ? p.ch[SR_PROTOCOL_SPI_CS] : SR_PROTOCOL_NO_CH;
+  }
+  if (!sr_protocol_reset(&p, rate)) {
+    fprintf(stderr, "FAIL: protocol configuration refused\n");
+    return 1;
+  }
+  b.noise = 0x3FFFFF & ~sr_protocol_mask(&p);
+  b.value = corpus_rand(&state) & b.noise;
+  ev_sample[0] = 0;
+  ev_value[0] = b.value;
+  if (p.kind == SR_PROTOCOL_UART) {
+    gen_uart(&p, &b);
+  } else if (p.kind == SR_PROTOCOL_SPI) {
+    gen_spi(&p, &b);
+  } else {
+    gen_i2c(&p, &b);
+  }
+  // A repeated value well after the end completes the last frame
+  ev_sample[b.events] = b.t + 1024 + (p.bit_fp >> 4);
+  ev_value[b.events++] = b.value;
+
+  uint32_t len = 0;
+  for (uint32_t i = 0; i < b.events; i++) {
+    uint32_t n = sr_protocol_edge(&p, &frame_buf[len], ev_sample[i], ev_value[i]);
+    if (n > SR_PROTOCOL_MAX_OUT) {
+      fprintf(stderr, "FAIL: %u protocol bytes for one change\n", n);
+      return 1;
+    }
+    len += n;
+  }
+  int got = sr_decode_frames(frame_buf, len, got_frames, MAX_FRAMES);
+  if (got < 0) {
+    fprintf(stderr, "FAIL: bad protocol frame in %u bytes\n", len);
+    return 1;
+  }
+  for (uint32_t i = 0; (i < b.frames) && (i < (uint32_t)got); i++) {
+    if ((got_frames[i].kind != sent_frames[i].kind) || (got_frames[i].time != sent_frames[i].time) ||
+        (got_frames[i].data != sent_frames[i].data)) {
+      fprintf(stderr, "FAIL: frame %u decoded kind %u at %llu data 0x%X, expected kind %u at %llu data 0x%X\n", i,
+              got_frames[i].kind, (unsigned long long)got_frames[i].time, got_frames[i].data, sent_frames[i].kind,
+              (unsigned long long)sent_frames[i].time, sent_frames[i].data);
+      return 1;
+    }
+  }
+  if (got != (int)b.frames) {
+    fprintf(stderr, "FAIL: decoded %d frames, expected %u\n", got, b.frames);
+    return 1;
+  }
+  return 0;
+}
+
+// A continuous digital capture of an idle bus at the ring segment size of the device, where the runs
+// are the longest. one_bit forces a single channel above D0, which is packed 1 bit a sample.
+static int run_ring_case(uint32_t seed, bool one_bit) {
+  uint32_t state = seed;
+  rt_case_t c;
+  memset(&c, 0, sizeof(c));
+  c.d_chan_cnt = one_bit ? 1 : 1 + corpus_rand(&state) % 21;
+  c.d_low = ((c.d_chan_cnt < 21) && (one_bit || (corpus_rand(&state) & 1))) ? 1 + corpus_rand(&state) % (21 - c.d_chan_cnt) : 0;
+  c.a_bps = 1;
+  c.a_ratio = 1;
+  c.continuous = true;
+  c.segs = 2;
+  c.corpus = -2;
+  c.seed = corpus_rand(&state);
+  // The samples of a segment of RING_SEG_BYTES as tx_init stores them
+  uint8_t top = c.d_low + c.d_chan_cnt;
+  if (pack_bits(&c)) {
+    c.samples_per_seg = RING_SEG_BYTES / 4 * (32 / pack_bits(&c));
+  } else {
+    c.samples_per_seg = (top <= 4) ? RING_SEG_BYTES * 2 : (top <= 8) ? RING_SEG_BYTES : (top <= 16) ? RING_SEG_BYTES / 2 : RING_SEG_BYTES / 4;
+  }
+  c.num_samples = c.segs * c.samples_per_seg;
+  if (run_case(&c)) {
+    describe(&c);
+    return 1;
+  }
+  return 0;
+}
+
+// Binary configuration: every field must come back, and no byte may be one that the command parser
+// or the main loop acts on by itself
+static int run_config_case(uint32_t seed) {
+  uint32_t state = seed;
+  sr_config_t c, got;
+  uint32_t *values[] = {&c.d_mask, &c.sample_rate, &c.num_samples, &c.pretrig_cnt, &c.lvl0mask,
+                        &c.lvl1mask, &c.risemask, &c.fallmask, &c.chgmask};
+  uint32_t *got_values[] = {&got.d_mask, &got.sample_rate, &got.num_samples, &got.pretrig_cnt, &got.lvl0mask,
+                            &got.lvl1mask, &got.risemask, &got.fallmask, &got.chgmask};
+  uint8_t buf[SR_CONFIG_LEN + 1];
+  for (uint32_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+    // Edge values as well as random ones
+    uint32_t r = corpus_rand(&state);
+    *values[i] = (r & 3) ? corpus_rand(&state) : (r & 4) ? 0xFFFFFFFF : 0;
+  }
+  c.a_mask = corpus_rand(&state) & 0x7F;
+  c.flags = corpus_rand(&state) & 0x7F;
+  uint32_t len = sr_config_pack(&c, buf);
+  if (len != SR_CONFIG_LEN) {
+    fprintf(stderr, "FAIL: config packed in %u bytes\n", len);
+    return 1;
+  }
+  for (uint32_t i = 0; i < len; i++) {
+    if (!(buf[i] & 0x80)) {
+      fprintf(stderr, "FAIL: config byte %u is 0x%02X\n", i, buf[i]);
+      return 1;
+    }
+  }
+  if (!sr_config_unpack(&got, buf, len) || (got.a_mask != c.a_mask) || (got.flags != c.flags)) {
+    fprintf(stderr, "FAIL: config not unpacked\n");
+    return 1;
+  }
+  for (uint32_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+    if (*got_values[i] != *values[i]) {
+      fprintf(stderr, "FAIL: config value %u unpacked 0x%X expected 0x%X\n", i, *got_values[i], *values[i]);
+      return 1;
+    }
+  }
+  // A short line or one with a stray ASCII byte is rejected
+  buf[corpus_rand(&state) % len] &= 0x7F;
+  if (sr_config_unpack(&got, buf, len) || sr_config_unpack(&got, buf + 1, len - 1)) {
+    fprintf(stderr, "FAIL: bad config unpacked\n");
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  uint32_t iterations = (argc > 1) ? strtoul(argv[1], NULL, 0) : 3000;
+  uint32_t state = (argc > 2) ? strtoul(argv[2], NULL, 0) : 0x5EED;
+  uint32_t failures = 0;
+
+  for (uint32_t it = 0; it < iterations; it++) {
+    rt_case_t c;
+    c.d_chan_cnt = corpus_rand(&state) % 22;
+    c.a_chan_cnt = corpus_rand(&state) % 4;
+    c.a_bps = 1 + (corpus_rand(&state) & 1);
+    c.a_delta = corpus_rand(&state) & 1;
+    c.a_walk = corpus_rand(&state) & 1;
+    c.a_ratio = (corpus_rand(&state) & 1) ? 1 : 1u << (corpus_rand(&state) % 5);
+    if ((c.d_chan_cnt == 0) && (c.a_chan_cnt == 0)) {
+      c.d_chan_cnt = 1 + corpus_rand(&state) % 21;
+    }
+    // Sometimes the channels don't start at D0
+    c.d_low = ((corpus_rand(&state) & 3) || !c.d_chan_cnt) ? 0 : corpus_rand(&state) % (22 - c.d_chan_cnt);
+    // Sizes are always whole D4 or packed words, as main computes them in chunks
+    uint32_t spw = pack_bits(&c) ? 8 * (32 / pack_bits(&c)) : 8;
+    c.samples_per_seg = spw * (1 + corpus_rand(&state) % (MAX_SAMPLES_PER_SEG / spw));
+    c.segs = 1 + corpus_rand(&state) % MAX_SEGS;
+    c.continuous = corpus_rand(&state) & 1;
+    // main forces at least 16 samples and a multiple of 4
+    c.num_samples = (16 + corpus_rand(&state) % (c.segs * c.samples_per_seg)) & ~3u;
+    while (c.num_samples > c.segs * c.samples_per_seg) {
+      c.segs++;
+    }
+    c.corpus = (int)(corpus_rand(&state) % (corpus_count + 1)) - 1;
+    c.seed = corpus_rand(&state);
+    if (run_case(&c)) {
+      describe(&c);
+      failures++;
+    }
+    uint32_t pseed = corpus_rand(&state);
+    if (run_protocol_case(pseed)) {
+      fprintf(stderr, "  protocol seed 0x%08X\n", pseed);
+      failures++;
+    }
+    if ((it % 16) == 0) {
+      uint32_t rseed = corpus_rand(&state);
+      failures += run_ring_case(rseed, (it == 0) || (rseed & 1));
+    }
+    uint32_t cseed = corpus_rand(&state);
+    if (run_config_case(cseed)) {
+      fprintf(stderr, "  config seed 0x%08X\n", cseed);
+      failures++;
+    }
+  }
+  printf("%u/%u round trips passed\n", iterations - failures, iterations);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,254 @@
+#include <string.h>
+
+#include "sr_decoder.h"
+#include "sr_protocol.h"
+
+void sr_decoder_reset(sr_decoder_t *d) {
+  d->count = 0;
+  d->bytes = 0;
+  d->gaps = 0;
+  d->dropped = 0;
+  d->error = SR_DECODER_OK;
+  d->have_last = false;
+  d->cval = 0;
+  d->cbyte = 0;
+  memset(d->a_last, 0, sizeof(d->a_last));
+  d->achan = 0;
+  d->ahalf = false;
+  d->in_gap = false;
+  d->gap_next = 0;
+}
+
+static bool push_slice(sr_decoder_t *d, uint32_t dval, const uint16_t *aval) {
+  if (d->count >= d->capacity) {
+    d->error = SR_DECODER_OVERFLOW;
+    return false;
+  }
+  d->samples[d->count] = dval;
+  if (d->a_chan_cnt && aval) {
+    memcpy(&d->analog[d->count * d->a_chan_cnt], aval, d->a_chan_cnt * sizeof(uint16_t));
+  }
+  d->count++;
+  d->have_last = true;
+  return true;
+}
+
+// Repeat the previous slice rle times
+static bool repeat_last(sr_decoder_t *d, uint32_t rle) {
+  if (rle == 0) {
+    return true;
+  } else if (!d->have_last) {
+    d->error = SR_DECODER_NO_PREVIOUS;
+    return false;
+  }
+  if (d->count + rle > d->capacity) {
+    d->error = SR_DECODER_OVERFLOW;
+    return false;
+  }
+  uint32_t last = d->samples[d->count - 1];
+  for (uint32_t i = 0; i < rle; i++) {
+    if (d->a_chan_cnt && d->analog) {
+      memcpy(&d->analog[d->count * d->a_chan_cnt], &d->analog[(d->count - 1) * d->a_chan_cnt], d->a_chan_cnt * sizeof(uint16_t));
+    }
+    d->samples[d->count++] = last;
+  }
+  return true;
+}
+
+// D4 format:
+//   0x80-0xFF: bits 6:4 repeat the previous value, bits 3:0 are a new value
+//   48-127: repeat the previous value (N-47)*8 times
+static bool decode_d4(sr_decoder_t *d, uint8_t b) {
+  if (b & 0x80) {
+    return repeat_last(d, (b >> 4) & 0x7) && push_slice(d, b & 0xF, NULL);
+  } else if (b >= 48) {
+    return repeat_last(d, (b - 47) * 8);
+  }
+  d->error = SR_DECODER_BAD_BYTE;
+  return false;
+}
+
+// 5-21 channel format:
+//   0x80-0xFF: 7 bits of a sample value, d_tx_bps bytes per sample LSB first
+//   48-79: repeat the previous value N-47 times
+//   80-127: repeat the previous value (N-78)*32 times
+static bool decode_rle(sr_decoder_t *d, uint8_t b) {
+  if (b & 0x80) {
+    d->cval |= (uint32_t)(b & 0x7F) << (7 * d->cbyte);
+    if (++d->cbyte == d->d_tx_bps) {
+      d->cbyte = 0;
+      uint32_t cval = d->cval;
+      d->cval = 0;
+      return push_slice(d, cval, NULL);
+    }
+    return true;
+  } else if (d->cbyte) {
+    d->error = SR_DECODER_MID_SAMPLE;
+    return false;
+  } else if ((b >= 48) && (b <= 79)) {
+    return repeat_last(d, b - 47);
+  } else if (b >= 80) {
+    return repeat_last(d, (b - 78) * 32);
+  }
+  d->error = SR_DECODER_BAD_BYTE;
+  return false;
+}
+
+// Analog format: every slice is d_tx_bps digital bytes followed by a_bps 7 bit
+// bytes per analog channel, LSB first, all with bit 7 set. There is no RLE.
+static bool decode_analog(sr_decoder_t *d, uint8_t b) {
+  if (!(b & 0x80)) {
+    d->error = SR_DECODER_BAD_BYTE;
+    return false;
+  }
+  if (d->cbyte < d->d_tx_bps) {
+    d->cval |= (uint32_t)(b & 0x7F) << (7 * d->cbyte);
+  } else {
+    uint32_t a = d->cbyte - d->d_tx_bps;
+    if (a % d->a_bps) {
+      d->aval[a / d->a_bps] |= (uint16_t)(b & 0x7F) << 7;
+    } else {
+      d->aval[a / d->a_bps] = b & 0x7F;
+    }
+  }
+  if (++d->cbyte == d->d_tx_bps + d->a_chan_cnt * d->a_bps) {
+    d->cbyte = 0;
+    uint32_t cval = d->cval;
+    d->cval = 0;
+    return push_slice(d, cval, d->aval);
+  }
+  return true;
+}
+
+// Analog delta format: slices as in the analog format, but each analog value is
+// either a 0xC0-0xFF byte adding N-0xC0-32 to the last value of the channel, or
+// two bytes with the low 6 bits and then the rest. Between slices, 48-127
+// repeat the previous slice as in the 5-21 channel format.
+static bool decode_analog_delta(sr_decoder_t *d, uint8_t b) {
+  if (!(b & 0x80)) {
+    if (d->cbyte || d->achan || d->ahalf) {
+      d->error = SR_DECODER_MID_SAMPLE;
+      return false;
+    } else if ((b >= 48) && (b <= 79)) {
+      return repeat_last(d, b - 47);
+    } else if (b >= 80) {
+      return repeat_last(d, (b - 78) * 32);
+    }
+    d->error = SR_DECODER_BAD_BYTE;
+    return false;
+  }
+  if (d->cbyte < d->d_tx_bps) {
+    d->cval |= (uint32_t)(b & 0x7F) << (7 * d->cbyte);
+    d->cbyte++;
+  } else if (d->ahalf) {
+    d->aval[d->achan] |= (uint16_t)(b & 0x7F) << 6;
+    d->ahalf = false;
+    d->a_last[d->achan] = d->aval[d->achan];
+    d->achan++;
+  } else if (b & 0x40) {
+    d->aval[d->achan] = d->a_last[d->achan] + (b & 0x3F) - 32;
+    d->a_last[d->achan] = d->aval[d->achan];
+    d->achan++;
+  } else {
+    d->aval[d->achan] = b & 0x3F;
+    d->ahalf = true;
+  }
+  if ((d->cbyte == d->d_tx_bps) && (d->achan == d->a_chan_cnt)) {
+    d->cbyte = 0;
+    d->achan = 0;
+    uint32_t cval = d->cval;
+    d->cval = 0;
+    return push_slice(d, cval, d->aval);
+  }
+  return true;
+}
+
+// Gap marker "#<next>+" of a continuous capture, between slices of any format. The
+// samples after it start from sample next of the capture, with nothing to repeat and
+// analog deltas from 0. Those from where the decoding got to are missing.
+static bool decode_gap(sr_decoder_t *d, uint8_t b) {
+  if (!d->in_gap) {
+    if (d->cbyte || d->achan || d->ahalf) {
+      d->error = SR_DECODER_MID_SAMPLE;
+      return false;
+    }
+    d->in_gap = true;
+    d->gap_next = 0;
+  } else if ((b >= '0') && (b <= '9')) {
+    d->gap_next = d->gap_next * 10 + (b - '0');
+  } else if (b == '+') {
+    d->in_gap = false;
+    if (d->gap_next < d->count + d->dropped) {
+      d->error = SR_DECODER_GAP_BACK;
+      return false;
+    }
+    d->gaps++;
+    d->dropped = d->gap_next - d->count;
+    d->have_last = false;
+    memset(d->a_last, 0, sizeof(d->a_last));
+  } else {
+    d->error = SR_DECODER_BAD_BYTE;
+    return false;
+  }
+  return true;
+}
+
+sr_decoder_error_t sr_decode(sr_decoder_t *d, const uint8_t *buf, uint32_t len) {
+  for (uint32_t i = 0; (i < len) && (d->error == SR_DECODER_OK); i++) {
+    if (d->in_gap || (buf[i] == '#')) {
+      decode_gap(d, buf[i]);
+    } else if (d->a_chan_cnt && d->a_delta) {
+      decode_analog_delta(d, buf[i]);
+    } else if (d->a_chan_cnt) {
+      decode_analog(d, buf[i]);
+    } else if (d->d4) {
+      decode_d4(d, buf[i]);
+    } else {
+      decode_rle(d, buf[i]);
+    }
+    d->bytes++;
+  }
+  return d->error;
+}
+
+int sr_decode_frames(const uint8_t *buf, uint32_t len, sr_frame_t *frames, uint32_t capacity) {
+  static const uint8_t data_bytes[16] = SR_FRAME_DATA_BYTES;
+  uint64_t time = 0;
+  uint32_t count = 0;
+  uint32_t i = 0;
+  while (i < len) {
+    uint8_t head = buf[i++];
+    if ((head & 0xC0) != 0xC0) {
+      return -1;
+    }
+    uint32_t kind = (head >> 2) & 0xF;
+    uint32_t tlen = head & 0x3;
+    uint32_t dlen = data_bytes[kind];
+    if (i + tlen + dlen > len) {
+      return -1;
+    }
+    uint32_t fields[2] = {0, 0};
+    for (uint32_t f = 0; f < 2; f++) {
+      uint32_t n = f ? dlen : tlen;
+      for (uint32_t b = 0; b < n; b++, i++) {
+        if ((buf[i] & 0xC0) != 0x80) {
+          return -1;
+        }
+        fields[f] |= (uint32_t)(buf[i] & 0x3F) << (6 * b);
+      }
+    }
+    if (kind == SR_FRAME_TIME) {
+      time += (uint64_t)fields[0] << 18;
+      continue;
+    }
+    if (count >= capacity) {
+      return -1;
+    }
+    time += fields[0];
+    frames[count].kind = kind;
+    frames[count].time = time;
+    frames[count].data = fields[1];
+    count++;
+  }
+  return count;
+}
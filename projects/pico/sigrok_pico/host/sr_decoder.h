@@ -0,0 +1,73 @@
+#ifndef _SR_DECODER_H_
+#define _SR_DECODER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// ------------------------------------
+// Reference decoder for the sigrok_pico wire formats
+//
+// This is the host side of sr_encoder.c: it turns the serial stream back into
+// sample values so that captures can be checked bit for bit. It follows the
+// same rules as the libsigrok raspberrypi-pico driver.
+// ------------------------------------
+
+typedef enum sr_decoder_error {
+  SR_DECODER_OK = 0,
+  SR_DECODER_BAD_BYTE,    // A byte that is reserved in the current format
+  SR_DECODER_NO_PREVIOUS, // An RLE count before any sample value
+  SR_DECODER_MID_SAMPLE,  // An RLE count in the middle of a multi byte sample
+  SR_DECODER_OVERFLOW,    // More samples than the output buffers can hold
+  SR_DECODER_GAP_BACK,    // A gap marker with a sample that was already decoded
+} sr_decoder_error_t;
+
+typedef struct sr_decoder {
+  // Stream configuration, must match the encoder
+  bool d4;            // 1-4 digital channels and no analog (D4 format)
+  uint8_t d_tx_bps;   // Digital transmit bytes per slice, 0 if no digital channels
+  uint8_t a_chan_cnt; // Count of enabled analog channels
+  uint8_t a_bps;      // Bytes per analog value, 1 for 7 bit or 2 for 12 bit values
+  bool a_delta;       // Analog values are sent as differences, see sr_send_slices_analog_delta
+
+  // Output, digital values are stored with channel 0 in bit 0 and analog
+  // values in a_chan_cnt interleaved 7 or 12 bit values per slice
+  uint32_t *samples;  // Decoded digital values
+  uint16_t *analog;   // Decoded analog values, may be NULL without analog
+  uint32_t capacity;  // Number of slices the output buffers can hold
+  uint32_t count;     // Number of slices decoded so far
+  uint64_t bytes;     // Number of bytes consumed so far
+  uint32_t gaps;      // Number of gap markers, see sr_send_gap
+  uint64_t dropped;   // Samples the gap markers reported missing
+
+  // Decoding state
+  sr_decoder_error_t error; // First error seen, decoding stops after it
+  bool have_last;           // A slice has been decoded so there is something to repeat
+  uint32_t cval;            // Digital value being assembled
+  uint8_t cbyte;            // Index of the next byte within the current slice
+  uint16_t aval[8];         // Analog values being assembled
+  uint16_t a_last[8];       // Last analog values, for the delta format
+  uint8_t achan;            // Analog channel being assembled in the delta format
+  bool ahalf;               // The low bits of a whole delta format value have been read
+  bool in_gap;              // Reading the sample number of a gap marker
+  uint64_t gap_next;        // And its digits so far
+} sr_decoder_t;
+
+// Reset the decoding state and output count, keeping configuration and buffers
+void sr_decoder_reset(sr_decoder_t *d);
+
+// Decode a chunk of the serial stream. Chunks may split slices at any point.
+// Returns the error state, which stays set once an error has been found.
+sr_decoder_error_t sr_decode(sr_decoder_t *d, const uint8_t *buf, uint32_t len);
+
+// A protocol frame, see sr_protocol.h
+typedef struct sr_frame {
+  uint8_t kind;  // SR_FRAME_*, other than SR_FRAME_TIME
+  uint64_t time; // First sample of the frame, from the start of the capture
+  uint32_t data; // Value of its data bytes
+} sr_frame_t;
+
+// Decode a whole stream of protocol frames. Returns the number of frames, or
+// -1 if a byte is out of place or there are more than capacity.
+int sr_decode_frames(const uint8_t *buf, uint32_t len, sr_frame_t *frames, uint32_t capacity);
+
+#endif // _SR_DECODER_H_
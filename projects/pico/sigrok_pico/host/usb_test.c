@@ -0,0 +1,187 @@
+// Test of the sr_usb block ring against a stand in for the USB controller.
+//
+// sr_usb.c is built with the headers in pico_stub, and the endpoint, the
+// connection and the time are set here. Each case checks what reaches the
+// endpoint and the counters, in particular that:
+// * queued blocks are sent in order, one transfer at a time,
+// * once the host stops reading, the blocks behind the one in flight are
+//   dropped, and that one is only retired when the controller is done with it,
+// * sr_usb_tx_set_store doesn't swap the blocks while the controller may still
+//   read one of them, and the blocks it dropped aren't sent once it is retired.
+//
+// usage: sr_usb_test
+
+#include <stdio.h>
+#include <string.h>
+
+#include "sr_encoder.h"
+#include "sr_usb.h"
+
+// The stand in controller, a single endpoint that stays busy until retire()
+static uint64_t now;
+static bool busy;
+static bool connected = true;
+static uint32_t xfers;
+static uint8_t *xfer_buf;
+static uint16_t xfer_len;
+
+uint64_t time_us_64(void) {
+  // Every look at the clock takes a while, so that the timeouts end
+  now += 1000;
+  return now;
+}
+
+uint32_t time_us_32(void) {
+  return (uint32_t)time_us_64();
+}
+
+bool usbd_edpt_claim(uint8_t rhport, uint8_t ep_addr) {
+  return !busy;
+}
+
+bool usbd_edpt_release(uint8_t rhport, uint8_t ep_addr) {
+  return true;
+}
+
+bool usbd_edpt_xfer(uint8_t rhport, uint8_t ep_addr, uint8_t *buffer, uint16_t total_bytes) {
+  busy = true;
+  xfers++;
+  xfer_buf = buffer;
+  xfer_len = total_bytes;
+  return true;
+}
+
+bool usbd_edpt_busy(uint8_t rhport, uint8_t ep_addr) {
+  return busy;
+}
+
+void tud_task(void) {}
+
+bool tud_mounted(void) {
+  return connected;
+}
+
+bool tud_cdc_connected(void) {
+  return connected;
+}
+
+static uint8_t store[16 * TX_BUFFER_SIZE] __attribute__((aligned(4)));
+
+// Queue a block of one byte, tag
+static uint8_t *put(uint8_t tag) {
+  uint8_t *b = sr_usb_tx_get(NULL);
+  b[0] = tag;
+  sr_usb_tx_put(NULL, b, 1);
+  return b;
+}
+
+// The controller is done with the block in flight
+static void retire(void) {
+  busy = false;
+  sr_usb_tx_task();
+}
+
+static uint32_t dropped(void) {
+  uint32_t s, us, d;
+  sr_usb_tx_stalls(&s, &us, &d);
+  return d;
+}
+
+static int check(bool ok, const char *what) {
+  if (!ok) {
+    fprintf(stderr, "FAIL: %s\n", what);
+    return 1;
+  }
+  return 0;
+}
+
+// Blocks are sent in order, one at a time
+static int test_send(void) {
+  int fail = 0;
+  busy = false;
+  xfers = 0;
+  fail |= check(sr_usb_tx_set_store(NULL, 0), "set_store on an empty ring");
+  for (uint8_t i = 0; i < SR_USB_TX_BLOCKS; i++) {
+    put(i);
+  }
+  fail |= check(sr_usb_tx_full(), "ring full");
+  for (uint8_t i = 0; i < SR_USB_TX_BLOCKS; i++) {
+    sr_usb_tx_task();
+    fail |= check((xfers == i + 1u) && (xfer_buf[0] == i) && (xfer_len == 1), "block sent in order");
+    sr_usb_tx_task();
+    fail |= check(xfers == i + 1u, "one transfer at a time");
+    busy = false;
+  }
+  sr_usb_tx_task();
+  fail |= check(!sr_usb_tx_full() && (dropped() == 0), "all sent");
+  return fail;
+}
+
+// The host stops reading with a block in flight, and a capture is armed with a store before it is retired
+static int test_drop_in_flight(void) {
+  int fail = 0;
+  busy = false;
+  xfers = 0;
+  fail |= check(sr_usb_tx_set_store(NULL, 0), "set_store on an empty ring");
+  uint8_t *first = put(10);
+  for (uint8_t i = 1; i < SR_USB_TX_BLOCKS; i++) {
+    put(10 + i);
+  }
+  sr_usb_tx_task();
+  fail |= check((xfers == 1) && (xfer_buf == first), "first block in flight");
+  // The end of capture drain times out, dropping the blocks behind the one in flight
+  sr_usb_tx_drain();
+  fail |= check(dropped() == SR_USB_TX_BLOCKS - 1, "blocks behind the one in flight dropped");
+  fail |= check(sr_usb_tx_full(), "block in flight not retired");
+
+  // The next arm can't take the store while the controller reads the old blocks
+  fail |= check(!sr_usb_tx_set_store(store, sizeof(store)), "set_store refused with a block in flight");
+  fail |= check(dropped() == SR_USB_TX_BLOCKS - 1, "dropped blocks counted once");
+  fail |= check(sr_usb_tx_full(), "blocks kept");
+
+  // Once it is retired the dropped blocks are skipped rather than sent
+  retire();
+  fail |= check(xfers == 1, "dropped blocks not sent");
+  fail |= check(!sr_usb_tx_full(), "ring free once retired");
+
+  fail |= check(sr_usb_tx_set_store(store, sizeof(store)), "set_store once retired");
+  uint8_t *b = put(20);
+  fail |= check((b >= store) && (b < store + sizeof(store)), "block in the store");
+  sr_usb_tx_task();
+  fail |= check((xfers == 2) && (xfer_buf == b) && (xfer_buf[0] == 20), "new block sent from the store");
+  retire();
+  fail |= check(dropped() == 0, "nothing dropped since set_store");
+  return fail;
+}
+
+// The host goes away with a block in flight, which the bus reset aborts
+static int test_disconnect(void) {
+  int fail = 0;
+  busy = false;
+  xfers = 0;
+  fail |= check(sr_usb_tx_set_store(NULL, 0), "set_store on an empty ring");
+  put(30);
+  put(31);
+  sr_usb_tx_task();
+  fail |= check(xfers == 1, "block in flight");
+  connected = false;
+  busy = false;
+  sr_usb_tx_task();
+  fail |= check((dropped() == 2) && !sr_usb_tx_full(), "blocks dropped on disconnect");
+  connected = true;
+  fail |= check(sr_usb_tx_set_store(NULL, 0), "set_store after disconnect");
+  put(32);
+  sr_usb_tx_task();
+  fail |= check((xfers == 2) && (xfer_buf[0] == 32), "new block sent after reconnect");
+  retire();
+  return fail;
+}
+
+int main(int argc, char **argv) {
+  int failures = 0;
+  failures += test_send();
+  failures += test_drop_in_flight();
+  failures += test_disconnect();
+  printf("%d/3 usb ring tests passed\n", 3 - failures);
+  return failures ? 1 : 0;
+}
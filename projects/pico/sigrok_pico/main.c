@@ -2,12 +2,14 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "boards/pico.h"
 #include "hardware/adc.h"
 #include "hardware/clocks.h"
 #include "hardware/dma.h"
 #include "hardware/gpio.h"
+#include "hardware/irq.h"
 #include "hardware/pio.h"
 #include "hardware/structs/bus_ctrl.h"
 #include "hardware/structs/pwm.h"
@@ -15,38 +17,104 @@
 #include "pico/binary_info.h"
 #include "pico/multicore.h"
 #include "pico/stdlib.h"
+#include "sr_decimate.h"
 #include "sr_device.h"
+#include "sr_encoder.h"
+#include "sr_protocol.h"
+#include "sr_ring.h"
+#include "sr_transition.h"
+#include "sr_trigger.h"
+#include "sr_usb.h"
 #include "tusb.h"
 
 // NODMA is a debug mode that disables the DMA engine and prints raw PIO FIFO outputs
 // it is limited to testing a small number of samples equal to the PIO FIFO depths
 // #define NODMA 1
-// These two enable debug print outs of D4 generation, D4_DBG2 are consider higher verbosity
-// #define D4_DBG 1
-// #define D4_DBG2 2
+// ARM_DBG enables debug print outs of how the buffer is split when a capture is armed. The debug UART
+// blocks for about 10us a character, so they take most of the time to arm.
+// #define ARM_DBG 1
 
 uint8_t *capture_buf;
+uint32_t capture_size;
+// End of the striped SRAM banks, which the heap grows towards, from the pico-sdk linker script
+extern char __StackLimit;
 volatile uint32_t c1cnt = 0;
 volatile uint32_t c0cnt = 0;
 sigrok_device_t dev;
 volatile uint32_t tstart;
+volatile uint32_t ttrig; // time of the trigger, if any
 volatile bool send_resp = false;
-uint8_t txbuf[TX_BUFFER_SIZE];
-uint16_t txbufidx;
-uint32_t rxbufdidx;
-uint32_t rlecnt;
-uint32_t ccnt = 0; // count of characters sent serially
-// Number of bytes stored as DMA per slice, must be 1,2 or 4 to support aligned access
-// This will be be zero for 1-4 digital channels.
-uint8_t d_dma_bps;
-uint32_t samp_remain;
-uint32_t lval, cval; // last and current digital sample values
-uint32_t num_halves; // track the number of halves we have processed
-
-volatile uint32_t *tstsa0, *tstsa1, *tstsd0, *tstsd1;
-volatile uint32_t *taddra0, *taddra1, *taddrd0, *taddrd1;
-volatile int lowerhalf; // are we processing the upper or lower half of the data buffers
+volatile bool encoding = false; // core1 owns the capture from when core0 sets this until core1 clears it
+// sample encoder state, also tracks the count of characters sent serially. It lives in scratch X with
+// the stack of core1, which runs the encoder, so its accesses don't contend with the DMA writes
+// to the striped banks.
+sr_encoder_t __scratch_x("sr_encoder") enc;
+uint32_t num_segs;   // track the number of segments we have processed
+
+sr_ring_t dring, aring; // DMA segment rings of the digital and analog samples
 volatile bool mask_xfer_err;
+uint piosm = 0;         // PIO state machine sampling the digital channels
+uint trigsm = 1;        // PIO state machine running the trigger program
+
+// Burst capture, see burst_check
+bool burst;             // the capture is taken into RAM before anything is sent
+bool burst_done;        // the capture is complete and lossless, sending has begun
+uint32_t burst_last;    // segment holding the last sample
+
+// Stored capture: a fixed capture too big for a burst streams through smaller rings, and the rest of
+// capture_buf queues its encoded samples for the USB (see sr_usb_tx_set_store). The encoder then
+// only has to keep up with the DMA, not the host, so the depth that can be taken without loss is
+// set by how well the signal compresses. The blocks of a segment are held back until it is all
+// encoded, so that a segment the store can't take is left out whole and the capture ends before it.
+bool store;
+
+// Transition capture, see transition_check
+#define TRANS_BLOCK_US 20000 // longest wait of encoded runs for a full block
+bool transitions;            // the PIO pushes the changes of the digital channels rather than samples
+sr_transition_t trans;       // position of the last change read
+uint32_t trans_idx;          // words of the current segment read
+uint32_t trans_val;          // value of the run being sent
+uint32_t trans_start;        // sample the run started on
+uint32_t trans_block_us;     // time of the last block handed over
+uint32_t trans_seg_us;       // time spent reading the current segment
+uint32_t trans_seg_ccnt;     // bytes sent before it
+
+// Protocol capture, see protocol_event
+bool protocol;         // the changes of a transition capture go to the bus decoder
+uint32_t proto_sample; // sample the decoder has reached
+
+// Continuous capture with gaps, see check_segment
+#define GAP_READY (SR_RING_SEGMENTS - 2) // segments waiting for the encoder that make it drop some
+bool gaps;                               // segments are dropped rather than let the rings overrun
+bool gap_pending;                        // samples were dropped and the marker waits for a segment to go with
+
+// With gaps or a store the encoder stops waiting for the USB before the rings overrun, see cut_tx_get
+bool tx_cut;                       // the encoder gave up on the USB part way through the segment
+uint32_t tx_lost;                  // bytes it wrote since, which went nowhere
+uint8_t cut_block[TX_BUFFER_SIZE]; // block they were written to
+
+// Pre-trigger capture, see pretrigger_check
+// Samples either side of the trigger snapshot to look for the exact trigger sample in
+#define PRETRIG_WINDOW 128
+bool pretrig;                // rings free run until the trigger
+bool pretrig_armed;          // trigger state machine started
+bool pretrig_found;          // the capture start is known and sending has begun
+volatile bool triggered;     // set by trigger_irq_handler
+uint32_t pretrig_cnt;        // samples to send before the trigger
+uint32_t arm_pos;            // first sample the trigger can be on
+uint32_t seg_skip;           // samples to skip at the start of the first segment sent
+volatile uint32_t trig_snap; // data channel write address at the trigger, copied by DMA
+uint trig_snap_chan;
+
+// PIO programs left loaded between captures, see load_programs
+int loaded_trig_len = -1;                       // -1 until the first capture
+uint16_t loaded_trig[SR_TRIGGER_MAX_INSTR];     // trigger program at offset 0
+uint loaded_capture_len;
+uint16_t loaded_capture[SR_TRANSITION_MAX_INSTR];
+uint loaded_offset;                             // of the capture program
+
+// Time between repeats of the abort marker until the host acks it with a "+"
+#define ABORT_REPEAT_US 200000
 
 // The function stdio_usb_out_chars is part of the PICO sdk usb library.
 // However the function is not externally visible from the library and rather than
@@ -57,13 +125,18 @@ volatile bool mask_xfer_err;
 // This function also avoids the inserting of CR/LF in certain modes.
 // The tud_cdc_write_available function returns 256, and thus we have a 256B buffer to feed into
 // but the CDC serial issues in groups of 64B.
-// Since there is another memory fifo inside the TUD code this might possibly be optimized
-// to directly write to it, rather than writing txbuf.  That might allow faster rle processing
-// but is a bit too complicated.
+// Sample data doesn't come through here but goes straight from the encoder blocks to the
+// endpoint (see sr_usb.c), so this only carries responses and markers.
 
 void my_stdio_usb_out_chars(const char *buf, int length) {
   static uint64_t last_avail_time;
   uint32_t owner;
+  // Don't let text overtake sample data that is still queued. Samples on the vendor
+  // interface don't share the CDC, and draining them could wait for the whole capture.
+#ifdef SR_USB_VENDOR
+  if (!sr_usb_tx_vendor())
+#endif
+    sr_usb_tx_drain();
   if (tud_cdc_connected()) {
     for (int i = 0; i < length;) {
       int n = length - i;
@@ -91,546 +164,503 @@ void my_stdio_usb_out_chars(const char *buf, int length) {
   }
 }
 
-// This is an optimized transmit of trace data for configurations with 4 or fewer digital channels
-// and no analog.  Run length encoding (RLE) is used to send counts of repeated values to effeciently utilize
-// USB CDC link bandwidth.  This is the only mode where a given serial byte can have both sample information
-// and RLE counts.
-// Samples from PIO are dma'd in 32 bit words, each containing 8 samples of 4 bits (1 nibble).
-// RLE Encoding:
-// Values 0x80-0xFF encode an rle cnt of a previous value with a new value:
-//   Bit 7 is 1 to distinguish from the rle only values.
-//   Bits 6:4 indicate a run length up to 7 cycles of the previous value
-//   Bits 3:0 are the new value.
-// For longer runs, an RLE only encoding uses decimal values 48 to 127 (0x30 to 0x7F)
-// as x8 run length values of 8..640.
-// All other ascii values (except from the abort and the end of run byte_cnt) are reserved.
-uint32_t send_slices_D4(sigrok_device_t *d, uint8_t *dbuf) {
-  uint8_t nibcurr, niblast;
-  uint32_t cword, lword; // current and last word
-  uint32_t *cptr;
-  txbufidx = 0;
-  // Don't optimize the first word (eight samples) perfectly, just send them to make the for loop easier,
-  // and setup the initial conditions for rle tracking
-  cptr = (uint32_t *)&(dbuf[0]);
-  cword = *cptr;
-#ifdef D4_DBG
-  debug_printf("Dbuf %p cptr %p data 0x%X\n\r", (void *)&(dbuf[0]), (void *)cptr, cword);
-#endif
-  lword = cword;
-  for (int j = 0; j < 8; j++) {
-    nibcurr = cword & 0xF;
-    txbuf[j] = (nibcurr) | 0x80;
-    cword >>= 4;
-  }
-  niblast = nibcurr;
-  cptr = (uint32_t *)&(txbuf[0]);
-  txbufidx = 8;
-  rxbufdidx = 4;
-  rlecnt = 0;
-
-  if (d->samples_per_half <= 8) {
-    my_stdio_usb_out_chars(txbuf, txbufidx);
-    d->sent_cnt += d->samples_per_half;
-    return txbufidx;
-  }
-  // chngcnt=8;
-  // The total number of 4 bit samples remaining to process from this half.
-  // Subtract 8 because we procesed the word above.
-  samp_remain = d->samples_per_half - 8;
-
-  // If in fixed sample (non-continous mode) only send the amount of samples requested
-  if ((d->continuous == false) && ((d->sent_cnt + samp_remain) > (d->num_samples))) {
-    samp_remain = d->num_samples - d->sent_cnt;
-    d->sent_cnt += samp_remain;
-  } else {
-    d->sent_cnt += d->samples_per_half;
-  }
-  // Process one  word (8 samples) at a time.
-  for (int i = 0; i < (samp_remain >> 3); i++) {
-    cptr = (uint32_t *)&(dbuf[rxbufdidx]);
-    cword = *cptr;
-    rxbufdidx += 4;
-#ifdef D4_DBG2
-    debug_printf("dbuf0 %p dbufr %p cptr %p \n\r", dbuf, &(dbuf[rxbufdidx]), cptr);
-#endif
-    // Send maximal RLE counts in this outer section to the txbuf, and if we accumulate a few of them
-    // push to the device so that we don't accumulate large numbers
-    // of unsent RLEs.  That allows the host to process them gradually rather than in a flood
-    // when we get a value change.
-    while (rlecnt >= 640) {
-      txbuf[txbufidx++] = 127;
-      rlecnt -= 640;
-      if (txbufidx > 3) {
-        my_stdio_usb_out_chars(txbuf, txbufidx);
-        ccnt += txbufidx;
-        txbufidx = 0;
-      }
+// The trigger program at offset 0 and the capture program after it stay in the PIO between captures. They
+// are only written again when a capture needs different ones, so that repeating a capture doesn't reload
+// them. Returns the offset of the capture program.
+uint load_programs(PIO pio, const uint16_t *trig_instr, uint trig_len, const uint16_t *capture_instr, uint capture_len) {
+  if (((int)trig_len != loaded_trig_len) || (capture_len != loaded_capture_len) ||
+      (trig_len && memcmp(trig_instr, loaded_trig, trig_len * sizeof(uint16_t))) ||
+      (capture_len && memcmp(capture_instr, loaded_capture, capture_len * sizeof(uint16_t)))) {
+    pio_clear_instruction_memory(pio);
+    if (trig_len) {
+      struct pio_program trig_prog = {
+          .instructions = trig_instr,
+          .length = trig_len,
+          .origin = 0};
+      pio_add_program(pio, &trig_prog);
     }
-    // Coarse rle looks across the full word and allows a faster compare in cases with low activity factors
-    // We must make sure cword==lword and that all nibbles of cword are the same
-    if ((cword == lword) && ((cword >> 4) == (cword & 0x0FFFFFFF))) {
-      rlecnt += 8;
-#ifdef D4_DBG2
-      debug_printf("coarse word 0x%X\n\r", cword);
-#endif
-    } else { // if coarse rle didn't match
-#ifdef D4_DBG2
-      debug_printf("cword 0x%X nibcurr 0x%X i %d rx idx %u  rlecnt %u \n\r", cword, nibcurr, i, rxbufdidx, rlecnt);
-#endif
-      lword = cword;
-      for (int j = 0; j < 8; j++) { // process all 8 nibbles
-        nibcurr = cword & 0xF;
-        if (nibcurr == niblast) {
-          rlecnt++;
-        } else {
-          // If the value changes we must push all remaing rles to the txbuf
-          // chngcnt++;
-          // Send intermediate 8..632 RLEs
-          if (rlecnt > 7) {
-            int rlemid = rlecnt & 0x3F8;
-            txbuf[txbufidx++] = (rlemid >> 3) + 47;
-          }
-          // And finally the 0..7 rle along with the new value
-          rlecnt &= 0x7;
-#ifdef D4_DBG2 // print when sample value changes
-          debug_printf("VChang val 0x%X rlecnt %d i%d j%d \n\r", nibcurr, rlecnt, i, j);
-#endif
-          txbuf[txbufidx++] = 0x80 | nibcurr | rlecnt << 4;
-          rlecnt = 0;
-        } // nibcurr!=last
-        cword >>= 4;
-        niblast = nibcurr;
-      } // for j
-    }   // else (not a coarse rle )
-#ifdef D4_DBG2
-    debug_printf("i %d rx idx %u  rlecnt %u \n\r", i, rxbufdidx, rlecnt);
-    debug_printf("i %u tx idx %d bufs 0x%X 0x%X 0x%X\n\r", i, txbufidx, txbuf[txbufidx - 3], txbuf[txbufidx - 2], txbuf[txbufidx - 1]);
-#endif
-    // Emperically found that transmitting groups of around 32B gives optimum bandwidth
-    if (txbufidx >= 64) {
-      my_stdio_usb_out_chars(txbuf, txbufidx);
-      ccnt += txbufidx;
-      txbufidx = 0;
+    if (capture_len) {
+      struct pio_program capture_prog = {
+          .instructions = capture_instr,
+          .length = capture_len,
+          .origin = -1};
+      loaded_offset = pio_add_program(pio, &capture_prog);
     }
-  } // for i in samp_send>>3
-  // At the end of processing the half send any residual samples as we don't maintain state between the halves
-  // Maximal 640 values first
-  while (rlecnt >= 640) {
-    txbuf[txbufidx++] = 127;
-    rlecnt -= 640;
-  }
-  // Middle rles 8..632
-  if (rlecnt > 7) {
-    int rleend = rlecnt & 0x3F8;
-    txbuf[txbufidx++] = (rleend >> 3) + 47;
-  }
-  // 1..7 RLE
-  // The rle and value encoding counts as both a sample count of rle and a new sample
-  // thus we must decrement rlecnt by 1 and resend the current value which will match the previous values
-  //(if the current value didn't match, the rlecnt would be 0).
-  if (rlecnt) {
-    rlecnt &= 0x7;
-    rlecnt--;
-    txbuf[txbufidx++] = 0x80 | nibcurr | rlecnt << 4;
-    rlecnt = 0;
-  }
-  if (txbufidx) {
-    my_stdio_usb_out_chars(txbuf, txbufidx);
-    ccnt += txbufidx;
-    txbufidx = 0;
+    if (trig_len) {
+      memcpy(loaded_trig, trig_instr, trig_len * sizeof(uint16_t));
+    }
+    if (capture_len) {
+      memcpy(loaded_capture, capture_instr, capture_len * sizeof(uint16_t));
+    }
+    loaded_trig_len = trig_len;
+    loaded_capture_len = capture_len;
   }
+  return loaded_offset;
+}
 
-} // send_slices_D4
-
-// Send a digital sample of multiple bytes with the 7 bit encoding
-void inline tx_d_samp(sigrok_device_t *d, uint32_t cval) {
-  for (char b = 0; b < d->d_tx_bps; b++) {
-    txbuf[txbufidx++] = (cval | 0x80);
-    cval >>= 7;
+// The abort marker goes on the same pipe as the samples so that the host finds it in the stream
+void send_abort(void) {
+#ifdef SR_USB_VENDOR
+  if (dev.vendor_tx) {
+    // Send or drop what core1 left queued first, the abort must come after it
+    sr_usb_tx_drain();
+    sr_usb_tx_write("!!!", 3);
+    return;
   }
+#endif
+  my_stdio_usb_out_chars("!!!", 3);
 }
 
-// Allow for 1,2 or 4B reads of sample data to reduce memory read overhead when
-// parsing digital sample data.  This function is correct for all uses, but if included
-// the compiled code is substantially slower to the point that digital only transfers
-// can't keep up with USB rate.  Thus it is only used by the send_slices_analog which is already
-// limited to 500khz, and in the starting send_slice_init.
-uint32_t get_cval(uint8_t *dbuf) {
-  uint32_t cval;
-  if (d_dma_bps == 1) {
-    cval = dbuf[rxbufdidx];
-  } else if (d_dma_bps == 2) {
-    cval = (*((uint16_t *)(dbuf + rxbufdidx)));
-  } else {
-    cval = (*((uint32_t *)(dbuf + rxbufdidx)));
-    // To make a 32bit value written from PIO we pull in IOs that aren't actuall
-    // digital channels so mask them off
-    cval <<= 11;
-    cval >>= 11;
+// Count an encoded segment in the capture stats. ready is the completed segments that were waiting
+// for the encoder, this one included, and the DMA had the rest of the ring left before an overrun.
+// That only matters when the capture doesn't fit in RAM.
+void stats_segment(sigrok_device_t *d, uint32_t us, uint32_t bytes, uint32_t ready, uint32_t ram_bytes) {
+  sr_capture_stats_t *s = &d->stats;
+  s->segs++;
+  s->enc_us_total += us;
+  s->enc_us_max = MAX(s->enc_us_max, us);
+  s->seg_bytes_max = MAX(s->seg_bytes_max, bytes);
+  s->ram_bytes += ram_bytes;
+  s->wire_bytes = enc.ccnt;
+  if (!mask_xfer_err) {
+    s->ring_free_min = MIN(s->ring_free_min, (ready < SR_RING_SEGMENTS) ? SR_RING_SEGMENTS - ready : 0);
   }
-  rxbufdidx += d_dma_bps;
-  return cval;
 }
-/*RLE encoding for 5-21 channels has two ranges.
-Decimal 48 to  79 are RLEs of 1 to 32 respectively.
-Decimal 80 to 127 are (N-78)*32 thus 64,96..80,120..1568
-Note that it is the responsibility of the caller to
-forward txbuf bytes to USB to prevent txbufidx from overflowing the size
-of txbuf. We do not always push to USB to reduce its impact
-on performance.
- */
-void inline check_rle() {
-  while (rlecnt >= 1568) {
-    txbuf[txbufidx++] = 127;
-    rlecnt -= 1568;
-  }
-  if (rlecnt > 32) {
-    uint16_t rlediv = rlecnt >> 5;
-    txbuf[txbufidx++] = rlediv + 78; // was 86;
-    rlecnt -= rlediv << 5;
-  }
-  if (rlecnt) {
-    txbuf[txbufidx++] = 47 + rlecnt;
-    rlecnt = 0;
-  }
+
+// The DMA is a segment or two from running into the segment being encoded
+bool ring_full(void) {
+  return (dev.d_mask ? dring.done : aring.done) - num_segs >= GAP_READY;
 }
 
-// Send txbuf to usb based on an input threshold
-void check_tx_buf(uint16_t cnt) {
-  if (txbufidx >= cnt) {
-    my_stdio_usb_out_chars(txbuf, txbufidx);
-    ccnt += txbufidx;
-    txbufidx = 0;
+// Encoder tx_get of a capture with gaps or a store. Waiting for the USB to free a block stops once the
+// rings are about to overrun, and the rest of the segment is encoded into cut_block and dropped.
+// check_segment then sends a gap in its place, or ends a stored capture before the segment.
+uint8_t *cut_tx_get(void *ctx) {
+  uint8_t *block = tx_cut ? NULL : sr_usb_tx_get_unless(ring_full);
+  if (block == NULL) {
+    tx_cut = true;
+    return cut_block;
   }
+  return block;
 }
-// Common init for send_slices_1B/2B/4B, but not D4 or analog
-void send_slice_init(sigrok_device_t *d, uint8_t *dbuf) {
-  rxbufdidx = 0;
-  // Adjust the number of samples to send if there are more in the dma buffer
-  // then we need.
-  samp_remain = d->samples_per_half;
-  if ((d->continuous == false) && ((d->sent_cnt + samp_remain) > (d->num_samples))) {
-    samp_remain = d->num_samples - d->sent_cnt;
-    d->sent_cnt += samp_remain;
+
+void cut_tx_put(void *ctx, uint8_t *buf, uint32_t len) {
+  if (buf == cut_block) {
+    tx_lost += len;
   } else {
-    d->sent_cnt += d->samples_per_half;
+    sr_usb_tx_put(ctx, buf, len);
   }
-  txbufidx = 0;
-  // Always send the first sample to establish a previous value for RLE
-  // the use of get_cval is inefficient, but only done once per half buffer
-  lval = get_cval(dbuf);
-  // If we are in 4B mode shift off invalid bits
-  lval <<= 11;
-  lval >>= 11;
-  tx_d_samp(d, lval);
-  samp_remain--;
-  rlecnt = 0;
 }
-// There are three very similar functions send_slices_1B/2B/4B.
-// Each of which  is very similar but exist because if a common function
-// is used with the get_cval in the inner loop, the performance drops
-// substantially.  Thus each function has a 1,2, or 4B aligned read respectively.
-// We can just always read a 4B value because the core doesn't support non-aligned accesses.
-// These must be marked noinline to ensure they remain separate functions for good performance
-// 1B is 5-8 channels
-void __attribute__((noinline)) send_slices_1B(sigrok_device_t *d, uint8_t *dbuf) {
-  send_slice_init(d, dbuf);
-  for (int s = 0; s < samp_remain; s++) {
-    cval = dbuf[rxbufdidx++];
-    if (cval == lval) {
-      rlecnt++;
-    } else {
-      check_rle();
-      tx_d_samp(d, cval);
-      check_tx_buf(TX_BUFFER_THRESHOLD);
-    } // if cval!=lval
-    lval = cval;
-  } // for s
-  check_rle();
-  check_tx_buf(1);
-} // send_slices_1B
-
-// 2B is 9-16 channels
-void __attribute__((noinline)) send_slices_2B(sigrok_device_t *d, uint8_t *dbuf) {
-  send_slice_init(d, dbuf);
-  for (int s = 0; s < samp_remain; s++) {
-    cval = (*((uint16_t *)(dbuf + rxbufdidx)));
-    rxbufdidx += 2;
-    if (cval == lval) {
-      rlecnt++;
-    } else {
-      check_rle();
-      tx_d_samp(d, cval);
-      check_tx_buf(TX_BUFFER_THRESHOLD);
-    } // if cval!=lval
-    lval = cval;
-  } // for s
-  check_rle();
-  check_tx_buf(1);
-} // send_slices_2B
-// 4B is 17-21 channels and is the only one that must mask invalid bits which are captured by DMA
-void __attribute__((noinline)) send_slices_4B(sigrok_device_t *d, uint8_t *dbuf) {
-  send_slice_init(d, dbuf);
-  for (int s = 0; s < samp_remain; s++) {
-    cval = (*((uint32_t *)(dbuf + rxbufdidx)));
-    rxbufdidx += 4;
-    // Mask invalid bits
-    cval <<= 11;
-    cval >>= 11;
-    if (cval == lval) {
-      rlecnt++;
-    } else {
-      check_rle();
-      tx_d_samp(d, cval);
-      check_tx_buf(TX_BUFFER_THRESHOLD);
-    } // if cval!=lval
-    lval = cval;
-  } // for s
-  check_rle();
-  check_tx_buf(1);
-} // send_slices_4B
-
-// Slice transmit code, used for all cases with any analog channels
-// All digital channels for one slice are sent first in 7 bit bytes using values 0x80 to 0xFF
-// Analog channels are sent next, with each channel taking one 7 bit byte using values 0x80 to 0xFF.
-// This does not support run length encoding because it's not clear how to define RLE on analog signals
-uint32_t send_slices_analog(sigrok_device_t *d, uint8_t *dbuf, uint8_t *abuf) {
-  uint32_t rxbufaidx = 0;
-  rxbufdidx = 0;
-  samp_remain = d->samples_per_half;
-  if ((d->continuous == false) && ((d->sent_cnt + samp_remain) > (d->num_samples))) {
-    samp_remain = d->num_samples - d->sent_cnt;
-    d->sent_cnt += samp_remain;
-  } else {
-    d->sent_cnt += d->samples_per_half;
-  }
-  txbufidx = 0;
-  uint32_t lval = 0;
-  for (int s = 0; s < samp_remain; s++) {
-    if (d->d_mask) {
-      cval = get_cval(dbuf);
-      tx_d_samp(d, cval);
-      // debug_printf("s %d cv %X bps %d idx t %d r %d \n\r",s,cval,d_dma_bps,txbufidx,rxbufdidx);
+
+// See if the n-th segment of the capture has been filled by the dma rings and if so process the data and
+// hand the segment back to the rings, then check that the PIO and ADC didn't lose samples meanwhile.
+int check_segment(sigrok_device_t *d, uint32_t n, bool mask_xfer_err) {
+  volatile uint32_t *piodbg;
+  volatile uint32_t *adcfcs;
+  uint8_t piorxstall, adcfail;
+  uint32_t seg = n & (SR_RING_SEGMENTS - 1);
+
+  if (((d->a_mask == 0) || sr_ring_seg_done(&aring, n)) && ((d->d_mask == 0) || sr_ring_seg_done(&dring, n))) {
+    // The IRQ timestamped the segment, so we know how long it waited for us
+    uint32_t done_us = d->d_mask ? dring.done_us[seg] : aring.done_us[seg];
+    uint32_t enc_us = time_us_32();
+    uint32_t lag_us = enc_us - done_us;
+    uint32_t ccnt = enc.ccnt;
+    // Completed segments waiting for the encoder, this one included
+    uint32_t ready = (d->d_mask ? dring.done : aring.done) - n;
+    if (lag_us > d->stats.lag_us_max) {
+      d->stats.lag_us_max = lag_us;
+    }
+    if (gaps && ((ready >= GAP_READY) || (gap_pending && sr_usb_tx_full()))) {
+      // The DMA is a segment or two from running into this one, or the host still takes no blocks after
+      // an earlier gap. Rather than let the FIFOs overflow, hand the oldest segments back unsent so that
+      // it keeps going with half the ring free. The marker telling the host where the samples continue
+      // goes out with the next segment sent. A stall that still happens can't be measured, so it aborts
+      // as usual.
+      uint32_t drop = (ready >= GAP_READY) ? ready - SR_RING_SEGMENTS / 2 : 1;
+      for (uint32_t i = 0; i < drop; i++) {
+        sr_ring_release(&dring, (n + i) & (SR_RING_SEGMENTS - 1));
+        sr_ring_release(&aring, (n + i) & (SR_RING_SEGMENTS - 1));
+      }
+      num_segs += drop;
+      gap_pending = true;
+      d->stats.gap_samples += drop * d->samples_per_seg;
+      d->stats.ring_free_min = MIN(d->stats.ring_free_min, (ready < SR_RING_SEGMENTS) ? SR_RING_SEGMENTS - ready : 0);
+      debug_printf("Gap of %u segs at seg %u, lag %u us\n\r", drop, n, lag_us);
+      return 1;
     }
-    for (char i = 0; i < d->a_chan_cnt; i++) {
-      txbuf[txbufidx] = (abuf[rxbufaidx] >> 1) | 0x80;
-      txbufidx++;
-      rxbufaidx++;
-      // debug_printf("av %X cnt %d idx t %d r %d\n\r",abuf[rxbufaidx-1],d->a_chan_cnt,txbufidx,rxbufaidx);
+    if (gap_pending) {
+      // There is room for it now, so the marker can't be cut short
+      sr_send_gap(&enc, (uint64_t)n * d->samples_per_seg);
+      gap_pending = false;
+      d->stats.gaps++;
     }
-    // Since this doesn't support RLEs we don't need to buffer
-    // extra bytes to prevent txbuf overflow, but this value
-    // works well anyway
-    check_tx_buf(TX_BUFFER_THRESHOLD);
-  } // for s
-  check_tx_buf(1);
-} // send_slices_analog
-
-// See if a given half's dma engines are idle and if so process the data, update the write pointer and
-// ensure that when done the other dma is still busy indicating we didn't lose data .
-// int __not_in_flash_func(check_half)(sigrok_device_t *d,volatile uint32_t *tstsa0,volatile uint32_t *tstsa1,volatile uint32_t *tstsd0,
-int check_half(sigrok_device_t *d, volatile uint32_t *tstsa0, volatile uint32_t *tstsa1, volatile uint32_t *tstsd0, volatile uint32_t *tstsd1, volatile uint32_t *t_addra0, volatile uint32_t *t_addrd0, uint8_t *d_start_addr, uint8_t *a_start_addr, bool mask_xfer_err) {
-  int a0busy, d0busy;
-  uint64_t stime, etime, dtime;
-  volatile uint32_t *piodbg1, *piodbg2;
-  volatile uint8_t piorxstall1, piorxstall2;
-  stime = time_us_64();
-  a0busy = ((*tstsa0) >> 24) & 1;
-  d0busy = ((*tstsd0) >> 24) & 1;
-
-  if (((a0busy == 0) || (d->a_mask == 0)) && ((d0busy == 0) || (d->d_mask == 0))) {
-    // Use two dma controllers where each writes half of the trace space.
-    // When one half finishes we send it's data while the other dma controller writes to the other half.
-    // We rely on DMA chaining where one completing dma engine triggers the next.
-    // When chaining happens the original target address is not restored so we must rewrite the starting address.
-    // Also when chaining is enabled we can get into an infinite loop where we ping pong between each other.
-    // and it is possible that if the other DMA controller finishes before we have send our half of the data that
-    // our DMA controller will startup and overwrite our data.  That is the DMA overflow condition.
-    // We don't actually overflow the DMA, but instead we fail to establish proper chaining to keep the
-    // ping pong going.
+    // The digital and analog samples each go to a ring of SR_RING_SEGMENTS segments (see sr_ring.h).
+    // While we send this segment the DMA keeps filling the following ones, and once sent the segment
+    // is handed back so the DMA can reuse it on its next lap.
+    // If the DMA comes back around to a segment that we haven't sent yet it stops rather than overwrite
+    // it. That is the DMA overflow condition, and it makes the PIO/ADC FIFOs overflow which we detect
+    // below and abort.
     // The only way to avoid the overflow condition is to reduce the sampling rate so that the transmit of samples
-    // can keep up, or do a fixed sample that fits into the sample buffer.
-    // When we first enter the loop it is assumed that the other controller is not chained to us so that if we don't
-    // process in time then our DMA controller won't be started by the other.  That assumption is maintained by
-    // always pointing our DMA engine to itself so tht in the next function call it is the "other" controller.
-    // We then process our half's samples and send to USB.
-    // When done we confirm that the other channel is still active, and if so we know we haven't overflowed and thus
-    // can establish the chain from the other channel to us.  If the other channel is not still active, or if the
-    // PIO/ADC FIFOs indicates an RXstall condition which indicates PIO lost samples, then we abort.
+    // can keep up, or do a fixed sample that fits into the sample buffer. With G1 a continuous capture drops
+    // segments above instead.
     // Note that in all cases we should never actually send any corrupted data we just send less than what was requested.
-    // Note that we must use the "alias" versions of the DMA CSRs to prevent writes from triggering them.
-    // Since we swap the csr pointers we determine the other half from the address offsets.
-    uint8_t myachan = (((uint32_t)tstsa0) >> 6) & 0xF;
-    uint8_t otherachan = (((uint32_t)tstsa1) >> 6) & 0xF;
-    uint8_t mydchan = (((uint32_t)tstsd0) >> 6) & 0xF;
-    uint8_t otherdchan = (((uint32_t)tstsd1) >> 6) & 0xF;
-    //  debug_printf("my stts pre a 0x%X d 0x%X\n\r",*tstsa0,*tstsd0);
-    // Set my chain to myself so that I can't chain to the other.
-    volatile uint32_t ttmp;
-    ttmp = ((tstsd0[1]) & 0xFFFF87FF) | mydchan << 11;
-    tstsd0[1] = ttmp;
-    ttmp = ((tstsa0[1]) & 0xFFFF87FF) | myachan << 11;
-    tstsa0[1] = ttmp;
-    (*t_addra0) = (uint32_t)a_start_addr;
-    (*t_addrd0) = (uint32_t)d_start_addr;
-
-    piodbg1 = (volatile uint32_t *)(PIO0_BASE + 0x8); // PIO DBG
-    piorxstall1 = (((*piodbg1) & 0x1) && (d->d_mask != 0));
-
-    if (d->a_mask) {
-      send_slices_analog(d, d_start_addr, a_start_addr);
-    } else if (d_dma_bps == 0) {
-      send_slices_D4(d, d_start_addr);
-    } else if (d_dma_bps == 1) {
-      send_slices_1B(d, d_start_addr);
-    } else if (d_dma_bps == 2) {
-      send_slices_2B(d, d_start_addr);
+    if (d->a_ratio > 1) {
+      // Average the oversampled conversions into the values the encoder expects, in place
+      sr_decimate(sr_ring_seg(&aring, seg), d->samples_per_seg, d->a_chan_cnt, d->a_ratio, d->a_bps);
+    }
+    // A stored capture may have to take the segment back, see below
+    sr_encoder_t before = enc;
+    if (seg_skip) {
+      // A pre-trigger capture can start part way through its first segment
+      enc.samples_per_seg = d->samples_per_seg - seg_skip;
+      sr_send_slices(&enc, sr_ring_seg(&dring, seg) + (d->d_mask ? seg_skip / (32 / d->pin_count) * 4 : 0), sr_ring_seg(&aring, seg) + seg_skip * d->a_chan_cnt * d->a_bps);
+      enc.samples_per_seg = d->samples_per_seg;
+      seg_skip = 0;
     } else {
-      send_slices_4B(d, d_start_addr);
+      sr_send_slices(&enc, sr_ring_seg(&dring, seg), sr_ring_seg(&aring, seg));
     }
+    if (tx_cut && store) {
+      // The store filled up and the rings are about to overrun, see cut_tx_get. The blocks of this
+      // segment are still held back, so take it back whole and end the capture cleanly after the
+      // segment before. The host gets what the store holds and the byte count as usual.
+      sr_usb_tx_discard();
+      enc = before;
+      enc.txbuf = NULL;
+      tx_cut = false;
+      tx_lost = 0;
+      d->sent_cnt = enc.sent_cnt;
+      d->sending = false;
+      debug_printf("Store full at seg %u, %u samples\n\r", n, d->sent_cnt);
+      return 1;
+    }
+    if (tx_cut) {
+      // The host stopped taking blocks part way through the segment, see cut_tx_get. It only got the
+      // samples before that.
+      sr_encoder_cut(&enc, tx_lost);
+      tx_cut = false;
+      tx_lost = 0;
+      gap_pending = true;
+      d->stats.gap_samples += d->samples_per_seg;
+    }
+    if (store) {
+      sr_usb_tx_commit();
+      d->stats.stored = enc.sent_cnt;
+    }
+    d->sent_cnt = enc.sent_cnt;
+    stats_segment(d, time_us_32() - enc_us, enc.ccnt - ccnt, ready, d->d_size + d->a_size);
 
     if ((d->continuous == false) && (d->sent_cnt >= d->num_samples)) {
       d->sending = false;
     }
 
-    // Set my other chain to me
-    // use aliases here as well to prevent triggers
-    ttmp = ((tstsd1[1]) & 0xFFFF87FF) | mydchan << 11;
-    tstsd1[1] = ttmp;
-    ttmp = ((tstsa1[1]) & 0xFFFF87FF) | myachan << 11;
-    tstsa1[1] = ttmp;
-    num_halves++;
-    piodbg2 = (volatile uint32_t *)(PIO0_BASE + 0x8); // PIO DBG
-    piorxstall2 = ((*piodbg2) & 0x1) && (d->d_mask != 0);
-    volatile uint32_t *adcfcs;
-    uint8_t adcfail;
+    // A pre-trigger capture fits in the rings and they must stop where it started
+    if (!pretrig) {
+      sr_ring_release(&dring, seg);
+      sr_ring_release(&aring, seg);
+    }
+    num_segs++;
+    // The stall and overflow flags are sticky, so a loss at any point up to now shows here
+    piodbg = (volatile uint32_t *)(PIO0_BASE + 0x8); // PIO DBG
+    piorxstall = ((*piodbg) & 0x1) && (d->d_mask != 0);
     adcfcs = (volatile uint32_t *)(ADC_BASE + 0x8); // ADC FCS
     adcfail = (((*adcfcs) & 0xC00) && (d->a_mask)) ? 1 : 0;
-    // if(adcfail){debug_printf("adcfcs 0x%X %p\n\r",*adcfcs,(void *) adcfcs);}
-    // Ensure other dma is still busy, if not that means we have samples from PIO/ADC that could be lost.
-    // It's only an error if we haven't already gotten the samples we need, or if we are processing the first
-    // half and all the remaining samples we need are in the 2nd half.
-    // Note that in continuous mode num_samples isn't defined.
-    uint8_t proc_fail;
-    proc_fail = (~(((((*tstsa1) >> 24) & 1) || (d->a_mask == 0)) && ((((*tstsd1) >> 24) & 1) || (d->d_mask == 0))) & 1);
-    // debug_printf("pf 0x%X 0x%X %d\n\r",*tstsa1,*tstsd1,proc_fail);
-    //        if(mask_xfer_err
-    //      || ((piorxstall1==0)
-    //       &&((((*tstsa1)>>24)&1)||(d->a_mask==0))
-    //		  &&((((*tstsd1)>>24)&1)||(d->d_mask==0)))){
-    if (mask_xfer_err || ((piorxstall1 == 0) && (adcfail == 0) && (piorxstall2 == 0) && (proc_fail == 0))) {
-      //           debug_printf("h\n\r");
+    // It's only an error if we haven't already gotten the samples we need, which is always the case when
+    // the whole capture fits in the rings.
+    if (mask_xfer_err || ((piorxstall == 0) && (adcfail == 0))) {
       return 1;
     } else {
-
-      if (piorxstall1 || piorxstall2) {
-        debug_printf("***Abort PIO RXSTALL*** %d %d half %d\n\r", piorxstall1, piorxstall2, num_halves);
-      }
-      if (proc_fail) {
-        debug_printf("***Abort DMA ovrflow*** half %d \n\r", num_halves);
+      if (piorxstall) {
+        debug_printf("***Abort PIO RXSTALL*** seg %d\n\r", num_segs);
       }
       if (adcfail) {
-        debug_printf("***Abort ADC ovrflow*** half %d \n\r", num_halves);
+        debug_printf("***Abort ADC ovrflow*** seg %d \n\r", num_segs);
       }
+      // With the segment time in the ring we can tell a slow encoder from a slow USB host
+      debug_printf("seg done at %u us, started encoding %u us later, max lag %u us\n\r", done_us - tstart, lag_us, d->stats.lag_us_max);
+      d->stats.abort = (piorxstall ? SR_ABORT_PIO : 0) | (adcfail ? SR_ABORT_ADC : 0);
       d->aborted = true;
-      // Issue end of trace markers to host
-      // The main loop also sends these periodically until the host is done..
-      my_stdio_usb_out_chars("!!!", 3);
-      // debug_printf("sent_cnt %u \n\r",d->sent_cnt);
-      // debug_printf("a st %u msk %u\n\r",(*tstsa1),d->a_mask);
-      // debug_printf("d st %u msk %u\n\r",(*tstsd1),d->d_mask);
+      // The end of trace markers are sent by the main loop on core0, which owns the USB,
+      // periodically until the host is done..
       return -1;
     }
-  } // if not busy
+  } // if segment done
   return 0;
-} // check_half
-// Check if dma activity is complete.  This was split out to allow core1 to do the monitoring
-// and slice processing and leave usb interrupt handling to core 0, but doing so did not improve
-// streaming performance, so it's left in core0.
-void dma_check(sigrok_device_t *d) {
-  if (d->sending && d->started && ((d->sent_cnt < d->num_samples) || d->continuous)) {
-    uint32_t a, b;
-    int ret;
-    c0cnt++;
-    if (lowerhalf) {
-      ret = check_half(&dev, tstsa0, tstsa1, tstsd0, tstsd1, taddra0, taddrd0, &(capture_buf[d->dbuf0_start]), &(capture_buf[d->abuf0_start]), mask_xfer_err);
+} // check_segment
+// A fixed capture that fits in RAM is taken as a burst, with a spare segment after it for the rings to
+// run into. Nothing is sent until the segment with the last sample is done, so encoding and USB don't
+// compete with the DMA for the bus. The sticky FIFO flags then tell whether the DMA lost any sample while
+// the spare segment still keeps the PIO and ADC from stalling on the end of the rings.
+// The capture is stopped before it is sent. Returns 1 once it can be sent, 0 if it's not complete and -1
+// on an abort.
+int burst_check(sigrok_device_t *d) {
+  volatile uint32_t *piodbg;
+  volatile uint32_t *adcfcs;
+  uint8_t piorxstall, adcfail;
+
+  if (((d->a_mask == 0) || sr_ring_seg_done(&aring, burst_last)) && ((d->d_mask == 0) || sr_ring_seg_done(&dring, burst_last))) {
+    piodbg = (volatile uint32_t *)(PIO0_BASE + 0x8); // PIO DBG
+    piorxstall = ((*piodbg) & 0x1) && (d->d_mask != 0);
+    adcfcs = (volatile uint32_t *)(ADC_BASE + 0x8); // ADC FCS
+    adcfail = (((*adcfcs) & 0xC00) && (d->a_mask)) ? 1 : 0;
+    pio_sm_set_enabled(pio0, piosm, false);
+    adc_run(false);
+    if (piorxstall || adcfail) {
+      debug_printf("***Abort burst lost samples*** PIO %d ADC %d\n\r", piorxstall, adcfail);
+      d->stats.abort = SR_ABORT_BURST | (piorxstall ? SR_ABORT_PIO : 0) | (adcfail ? SR_ABORT_ADC : 0);
+      d->aborted = true;
+      return -1;
+    }
+    return 1;
+  }
+  return 0;
+}
 
-      if (ret == 1) {
-        lowerhalf = 0;
-      } else if (ret < 0) {
+// Digital sample i of the capture, counting across laps of the ring, with the channels in their
+// own bits. Each word holds spw samples in its top bits, which is all of it unless they are packed.
+static uint32_t ring_sample(uint32_t i) {
+  uint32_t spw = 32 / dev.pin_count;
+  i = i % (dev.samples_per_seg * SR_RING_SEGMENTS);
+  uint32_t w = ((uint32_t *)sr_ring_seg(&dring, 0))[i / spw];
+  uint32_t shift = (32 - spw * dev.pin_count) + (i % spw) * dev.pin_count;
+  return ((dev.pin_count == 32) ? w : (w >> shift) & ((1u << dev.pin_count) - 1)) << dev.d_shift;
+}
+
+// In a pre-trigger capture the rings free run and nothing is sent until the trigger. Once the rings
+// hold pretrig_cnt samples this arms the trigger. When it fires this finds the trigger sample, stops the
+// rings before they lap the first sample to send and points check_segment at it.
+// Returns 1 once the capture can be sent, 0 until then and -1 if the rings lapped the first sample.
+int pretrigger_check(sigrok_device_t *d) {
+  sr_ring_t *r = d->d_mask ? &dring : &aring;
+  uint32_t done = r->done;
+  uint32_t sps = d->samples_per_seg;
+
+  if (!pretrig_armed) {
+    if (done * sps >= pretrig_cnt + PRETRIG_WINDOW) {
+      arm_pos = done * sps;
+      pio_sm_set_enabled(pio0, trigsm, true);
+      pretrig_armed = true;
+    }
+    return 0;
+  }
+  if (!triggered) {
+    return 0;
+  }
+  // The snapshot is a byte offset within segment k, whose count in the capture we get from done
+  // as the ring can't be a lap ahead yet
+  uint32_t off = trig_snap - (uint32_t)sr_ring_seg(r, 0);
+  uint32_t k = off / r->seg_bytes;
+  uint32_t kabs = done - ((done - k) & (SR_RING_SEGMENTS - 1));
+  off -= k * r->seg_bytes;
+  uint32_t pos = kabs * sps + (d->d_mask ? off / 4 * (32 / d->pin_count) : off / d->a_slice_bytes);
+  // The trigger program polls the pins and the capture FIFO lags the DMA, so the snapshot is only
+  // close to the trigger. Look for the matching sample around it once it's all in the ring.
+  uint32_t t = pos;
+  if (d->d_mask) {
+    if (done * sps <= pos + PRETRIG_WINDOW) {
+      return 0;
+    }
+    uint32_t i = (pos > arm_pos + PRETRIG_WINDOW) ? pos - PRETRIG_WINDOW : arm_pos;
+    for (; i <= pos + PRETRIG_WINDOW; i++) {
+      if (sr_trigger_match(ring_sample(i), ring_sample(i - 1), d->lvl0mask, d->lvl1mask, d->risemask, d->fallmask, d->chgmask)) {
+        t = i;
+        break;
+      }
+    }
+  }
+  // Start on a whole word of samples, which can add a few pre-trigger samples. The host learns where
+  // the trigger ended up from S.
+  uint32_t start = t - pretrig_cnt;
+  if (d->d_mask) {
+    start -= start % (32 / d->pin_count);
+  }
+  d->stats.trig_at = t - start;
+  num_segs = start / sps;
+  seg_skip = start % sps;
+  sr_ring_stop_at(&dring, num_segs & (SR_RING_SEGMENTS - 1));
+  sr_ring_stop_at(&aring, num_segs & (SR_RING_SEGMENTS - 1));
+  // A slow trigger search or a late core1 can leave the stop too late, once the DMA has come back
+  // around to the first segment. Its samples are then gone.
+  if ((d->d_mask && (dring.done - num_segs >= SR_RING_SEGMENTS - 1)) ||
+      (d->a_mask && (aring.done - num_segs >= SR_RING_SEGMENTS - 1))) {
+    debug_printf("***Abort pre-trigger start lapped*** seg %d done %d\n\r", num_segs, r->done);
+    d->stats.abort = SR_ABORT_PRETRIG;
+    d->aborted = true;
+    return -1;
+  }
+  return 1;
+}
+
+// In a protocol capture the changes go to the bus decoder rather than the encoder, and only its frames
+// are sent (see sr_protocol.h). A fixed capture ends at num_samples, and the value carried to it completes
+// the frames before.
+void protocol_event(sigrok_device_t *d, uint32_t s, uint32_t value) {
+  uint8_t out[SR_PROTOCOL_MAX_OUT];
+  if ((d->continuous == false) && (s >= d->num_samples)) {
+    if (proto_sample >= d->num_samples) {
+      return;
+    }
+    s = d->num_samples;
+    value = d->protocol.value;
+  }
+  sr_send_bytes(&enc, out, sr_protocol_edge(&d->protocol, out, s, value));
+  proto_sample = s;
+}
+
+// A transition capture gets a pair of words for each change from the PIO, the samples the last
+// value lasted and the new value (see sr_transition.h), and turns them into runs for the encoder.
+// The pairs come as the pins change rather than at the sample rate, so this reads them as soon as the
+// DMA writes them rather than waiting for whole segments, and hands back each segment once read.
+// The PIO stalls rather than drop a change when the rings are full, which loses the timing, so a
+// stall aborts the capture. Returns 1 as it has to keep polling, or -1 on an abort.
+int transition_check(sigrok_device_t *d) {
+  uint32_t seg_words = dring.seg_bytes / 4;
+  uint32_t start_us = time_us_32();
+  while (true) {
+    uint32_t seg = num_segs & (SR_RING_SEGMENTS - 1);
+    uint32_t *buf = (uint32_t *)sr_ring_seg(&dring, seg);
+    bool seg_done = sr_ring_seg_done(&dring, num_segs);
+    uint32_t avail = seg_words;
+    if (!seg_done) {
+      // The write address only moves past a word once it is written. If it is in another segment
+      // the DMA has just moved on and the IRQ will tell.
+      avail = (*dring.write_addr - (uint32_t)buf) / 4;
+      avail = (avail <= seg_words) ? (avail & ~1) : 0;
+    }
+    for (; trans_idx < avail; trans_idx += 2) {
+      uint32_t value = buf[trans_idx + 1];
+      uint32_t s = sr_transition_event(&trans, buf[trans_idx], value);
+      value = (value << d->d_shift) & d->d_mask;
+      if (protocol) {
+        protocol_event(d, s, value);
+        continue;
+      }
+      // Runs of the same value merge in the encoder, so the repeated pushes just send the time so far
+      sr_send_run(&enc, trans_val, s - trans_start);
+      trans_val = value;
+      trans_start = s;
+    }
+    if (!seg_done || (trans_idx < seg_words)) {
+      break;
+    }
+    sr_ring_release(&dring, seg);
+    uint32_t now = time_us_32();
+    stats_segment(d, trans_seg_us + now - start_us, enc.ccnt - trans_seg_ccnt, dring.done - num_segs, dring.seg_bytes);
+    start_us = now;
+    trans_seg_us = 0;
+    trans_seg_ccnt = enc.ccnt;
+    num_segs++;
+    trans_idx = 0;
+  }
+  trans_seg_us += time_us_32() - start_us;
+  d->sent_cnt = protocol ? proto_sample : enc.sent_cnt;
+  if ((d->continuous == false) && (d->sent_cnt >= d->num_samples)) {
+    d->sending = false;
+  }
+  // A slow signal can take a long time to fill a block
+  if ((time_us_32() - trans_block_us) > TRANS_BLOCK_US) {
+    sr_encoder_send_block(&enc);
+    trans_block_us = time_us_32();
+  }
+  volatile uint32_t *piodbg = (volatile uint32_t *)(PIO0_BASE + 0x8); // PIO DBG
+  if (d->sending && ((*piodbg) & 0x1)) {
+    debug_printf("***Abort PIO RXSTALL*** transitions seg %d\n\r", num_segs);
+    d->stats.abort = SR_ABORT_PIO;
+    d->aborted = true;
+    return -1;
+  }
+  return 1;
+}
+
+// The trigger state machine sets SR_TRIGGER_IRQ on a match, which starts the capture state machine by itself.
+// Here we only start the ADC, as close to the first digital sample as we can, and note the time.
+// In a pre-trigger capture everything is already running and core1 takes it from here.
+void __not_in_flash_func(trigger_irq_handler)(void) {
+  if (dev.a_mask && !pretrig) {
+    adc_run(true);
+  }
+  ttrig = time_us_32();
+  triggered = true;
+  __sev();
+  // The flag stays set until the capture state machine takes it, so don't let it interrupt again
+  pio_set_irq0_source_enabled(pio0, pis_interrupt0 + SR_TRIGGER_IRQ, false);
+  // Without digital channels there is no capture state machine to take it
+  if (dev.d_mask == 0) {
+    pio_interrupt_clear(pio0, SR_TRIGGER_IRQ);
+  }
+}
+// Check if dma activity is complete.  This runs on core1 so that encoding a segment overlaps with
+// core0 sending the previous blocks over USB. Returns 0 if there was no segment ready.
+int dma_check(sigrok_device_t *d) {
+  int ret = 0;
+  if (d->sending && d->started && ((d->sent_cnt < d->num_samples) || d->continuous)) {
+    c1cnt++;
+    if (pretrig && !pretrig_found) {
+      ret = pretrigger_check(d);
+      pretrig_found = (ret == 1);
+      if (ret < 0) {
+        d->sending = false;
+      }
+      return ret;
+    }
+    if (burst && !burst_done) {
+      ret = burst_check(d);
+      burst_done = (ret == 1);
+      if (ret < 0) {
         d->sending = false;
       }
+      return ret;
     }
-    if (lowerhalf == 0) {
-      ret = check_half(&dev, tstsa1, tstsa0, tstsd1, tstsd0, taddra1, taddrd1, &(capture_buf[d->dbuf1_start]), &(capture_buf[d->abuf1_start]), mask_xfer_err);
-      if (ret == 1) {
-        lowerhalf = 1;
-      } else if (ret < 0) {
+    if (transitions) {
+      ret = transition_check(d);
+      if (ret < 0) {
         d->sending = false;
       }
+      return ret;
+    }
+    ret = check_segment(d, num_segs, mask_xfer_err);
+    if (ret < 0) {
+      d->sending = false;
     }
   } // if sending and started and under numsamples
+  return ret;
 }
-// This is a simple maintenance loop to monitor serial activity so that core0 can be dedicated
-// to monitoring DMA activity and sending trace data.
-// Most of the time this loop is stalled with wfes (wait for events).
+// Core1 owns the DMA segments and the encoding of samples into the sr_usb block ring, while core0
+// runs USB, commands and the capture setup. The ring is a lock free queue between the two so that
+// encoding the next segment overlaps with USB sending the last one.
+// Between captures and between segments this loop is stalled with wfes (wait for events).
 void core1_code() {
-  uint32_t testinc = 0x0;
-  int intin;
-  uint8_t uartch;
-  uint32_t ctime;
-  uint32_t cval;
-  volatile uint32_t *usbctrl;
-  usbctrl = (volatile uint32_t *)(USBCTRL_BASE);
-  uint32_t usb_last = 1, usb_curr;
+  // Take the segment completions on this core so that they wake it
+  sr_ring_irq_init();
   while (true) {
-    // The wait for event (wfe) puts core1 in an idle state
-    // Each core instruction takes a memory cycle, as does each core memory or IO register read.
-    // The memory fabric supports up to 4 reads per cycle if there are no bank conflicts
-    // The DMA engine needs a read of the PIO and ADC and a write of memory
-    // and thus chances of conflicts are high.  Thus once we are in sampling mode slow down C1 to allow
-    // C0 to loop faster and process faster.
-    // Without wfes C1 typically completes 10x the number of outer loops as C0, but with the wfes
-    // C0 completes more loops and C1 activity drops to 1% .
-    // Much of the C0 code has built in sev (Send Event) but we also add an explicit one in the main while loop
-
-    if (dev.started) {
-      c1cnt++;
-      __wfe();
-      __wfe();
-      __wfe();
-      __wfe();
-      __wfe();
-      __wfe();
-      __wfe();
-      __wfe();
-      __wfe();
-      __wfe();
-    }
-    if (dev.started == false) {
-      // always drain all defined uarts as if that is not done it can
-      // effect the usb serial CDC stability
-      // these are generally rare events caused by noise/reset events
-      // and thus not checked when dev.started
-      while (uart_is_readable_within_us(uart0, 0)) {
-        uartch = uart_getc(uart0);
-      }
-    }
-    // look for commands on usb cdc
-    intin = getchar_timeout_us(0);
-    // The '+' is the only character we track during normal sampling because it can end
-    // a continuous trace.  A reset '*' should only be seen after we have completed normally
-    // or hit an error condition.
-    if (intin == '+') {
-      dev.sending = false;
-      dev.aborted = false; // clear the abort so we stop sending !!
-    }
-    // send_resp is used to eliminate all prints from core1 to prevent collisions with
-    // prints in core0
-    else if (intin >= 0) {
-      if (process_char(&dev, (char)intin)) {
-        send_resp = true;
+    if (encoding) {
+      if (dev.sending) {
+        // Sleep until the ring IRQ reports a segment, or core0 ends the capture
+        if (dma_check(&dev) == 0) {
+          __wfe();
+        }
+      } else {
+        // The capture ended by reaching num_samples, an abort or a '+' from the host.
+        // Send the last run, which the encoder holds until it knows the run has ended.
+        // The rings no longer matter, so this waits for the host even with gaps or a store.
+        enc.tx_get = sr_usb_tx_get;
+        enc.tx_put = sr_usb_tx_put;
+        sr_usb_tx_hold(false);
+        if (dev.aborted == false) {
+          if (gap_pending) {
+            sr_send_gap(&enc, (uint64_t)num_segs * dev.samples_per_seg);
+            gap_pending = false;
+            dev.stats.gaps++;
+          }
+          sr_encoder_flush(&enc);
+        }
+        // Hand the block ring back to core0
+        __dmb();
+        encoding = false;
+        __sev();
       }
+    } else {
+      __wfe();
     }
   } // while true
 }
@@ -643,15 +673,21 @@ int main() {
   uint16_t len;
   uint32_t tmpint, tmpint2;
 
-  dma_channel_config acfg0, acfg1, pcfg0, pcfg1;
-  uint admachan0, admachan1, pdmachan0, pdmachan1;
   PIO pio = pio0;
-  uint piosm = 0;
+  uint16_t trig_instr[SR_TRIGGER_MAX_INSTR];
+  int trig_len = 0;
   float ddiv;
   int res;
   bool init_done = false;
   uint64_t starttime, endtime;
+  uint64_t abort_next = 0; // time to repeat the abort marker
+  int intin;
+  uint8_t uartch;
   set_sys_clock_khz(SYS_CLK_BASE, true);
+#ifdef SR_USB_VENDOR
+  // With our own TinyUSB configuration stdio_usb expects TinyUSB to be initialized already
+  tusb_init();
+#endif
   stdio_usb_init();
   uart_set_format(uart0, 8, 1, 1);
   uart_init(uart0, 921600);
@@ -680,54 +716,14 @@ int main() {
 
   multicore_launch_core1(core1_code);
 
-  admachan0 = dma_claim_unused_channel(true);
-  admachan1 = dma_claim_unused_channel(true);
-  pdmachan0 = dma_claim_unused_channel(true);
-  pdmachan1 = dma_claim_unused_channel(true);
-  acfg0 = dma_channel_get_default_config(admachan0);
-  acfg1 = dma_channel_get_default_config(admachan1);
-  pcfg0 = dma_channel_get_default_config(pdmachan0);
-  pcfg1 = dma_channel_get_default_config(pdmachan1);
-  // ADC transfer 8 bytes, PIO transfer the 4B default
-  channel_config_set_transfer_data_size(&acfg0, DMA_SIZE_8);
-  channel_config_set_transfer_data_size(&acfg1, DMA_SIZE_8);
-  channel_config_set_transfer_data_size(&pcfg0, DMA_SIZE_32);
-  channel_config_set_transfer_data_size(&pcfg1, DMA_SIZE_32);
-  channel_config_set_read_increment(&acfg0, false);
-  channel_config_set_read_increment(&acfg1, false);
-  channel_config_set_read_increment(&pcfg0, false);
-  channel_config_set_read_increment(&pcfg1, false);
-  channel_config_set_write_increment(&acfg0, true);
-  channel_config_set_write_increment(&acfg1, true);
-  channel_config_set_write_increment(&pcfg0, true);
-  channel_config_set_write_increment(&pcfg1, true);
-
-  // Pace transfers based on availability of ADC samples
-  channel_config_set_dreq(&acfg0, DREQ_ADC);
-  channel_config_set_dreq(&acfg1, DREQ_ADC);
-  volatile uint32_t *tcounta0, *tcounta1, *tcountd0, *tcountd1;
-  tcounta0 = (volatile uint32_t *)(DMA_BASE + 0x40 * admachan0 + 0x8); // DMA_TRANS_COUNT offset
-  tcounta1 = (volatile uint32_t *)(DMA_BASE + 0x40 * admachan1 + 0x8); // DMA_TRANS_COUNT offset
-  tcountd0 = (volatile uint32_t *)(DMA_BASE + 0x40 * pdmachan0 + 0x8); // DMA_TRANS_COUNT offset
-  tcountd1 = (volatile uint32_t *)(DMA_BASE + 0x40 * pdmachan1 + 0x8); // DMA_TRANS_COUNT offset
-
-  // Use the debug version of the count registers because the count of the DMA_TRANS_COUNT is not
-  // visible if it is not active
-  volatile uint32_t *tcountdbga0, *tcountdbga1, *tcountdbgd0, *tcountdbgd1;
-  tcountdbga0 = (volatile uint32_t *)(DMA_BASE + 0x40 * admachan0 + 0x804); // DMA_TRANS_COUNT DBGoffset
-  tcountdbga1 = (volatile uint32_t *)(DMA_BASE + 0x40 * admachan1 + 0x804); // DMA_TRANS_COUNT DBGoffset
-  tcountdbgd0 = (volatile uint32_t *)(DMA_BASE + 0x40 * pdmachan0 + 0x804); // DMA_TRANS_COUNT DBGoffset
-  tcountdbgd1 = (volatile uint32_t *)(DMA_BASE + 0x40 * pdmachan1 + 0x804); // DMA_TRANS_COUNT DBGoffset
-
-  taddra0 = (volatile uint32_t *)(DMA_BASE + 0x40 * admachan0 + 0x4); // DMA_WRITE_addr offset
-  taddra1 = (volatile uint32_t *)(DMA_BASE + 0x40 * admachan1 + 0x4); // DMA_WRITE_addr offset
-  taddrd0 = (volatile uint32_t *)(DMA_BASE + 0x40 * pdmachan0 + 0x4); // DMA_WRITE_addr offset
-  taddrd1 = (volatile uint32_t *)(DMA_BASE + 0x40 * pdmachan1 + 0x4); // DMA_WRITE_addr offset
-
-  tstsa0 = (volatile uint32_t *)(DMA_BASE + 0x40 * admachan0 + 0xc); // DMA_WRITE_sts offset
-  tstsa1 = (volatile uint32_t *)(DMA_BASE + 0x40 * admachan1 + 0xc); // DMA_WRITE_sts offset
-  tstsd0 = (volatile uint32_t *)(DMA_BASE + 0x40 * pdmachan0 + 0xc); // DMA_WRITE_sts offset
-  tstsd1 = (volatile uint32_t *)(DMA_BASE + 0x40 * pdmachan1 + 0xc); // DMA_WRITE_sts offset
+  // Each ring takes three channels, the transfer sizes and pacing are set when a capture starts
+  sr_ring_claim(&aring);
+  sr_ring_claim(&dring);
+  // Copies the write address of a ring when the trigger program pushes
+  trig_snap_chan = dma_claim_unused_channel(true);
+  // The trigger interrupt is taken on core0, core1 takes the ring ones
+  irq_set_exclusive_handler(PIO0_IRQ_0, trigger_irq_handler);
+  irq_set_enabled(PIO0_IRQ_0, true);
   // PIO status
   volatile uint32_t *pioctrl, *piofstts, *piodbg, *pioflvl;
   pioctrl = (volatile uint32_t *)(PIO0_BASE);        // PIO CTRL
@@ -742,17 +738,18 @@ int main() {
   bus_ctrl_hw->priority = BUSCTRL_BUS_PRIORITY_DMA_W_BITS | BUSCTRL_BUS_PRIORITY_DMA_R_BITS;
 
   init(&dev);
-  // Since RP2040 is 32 bit this should always be 4B aligned, and it must be because the PIO
-  // does DMA on a per byte basis
-  // If either malloc fails the code will just hang
-  debug_printf("Malloc\n\r");
-  capture_buf = malloc(DMA_BUFFER_SIZE);
-  debug_printf("DMA start %p\n\r", (void *)capture_buf);
-  // Ensure we leave 10k or more left for any dynamic allocations that need it
-  uint8_t *tptr;
-  tptr = malloc(10000);
-  debug_printf("10K free start %p\n\r", (void *)tptr);
-  free(tptr);
+  enc.tx_get = sr_usb_tx_get;
+  enc.tx_put = sr_usb_tx_put;
+  enc.tx_ctx = NULL;
+  // The capture buffer takes all of the striped SRAM that the program leaves, apart from
+  // HEAP_RESERVE for any dynamic allocations that need it. Claiming it from the heap
+  // keeps malloc from handing it out again. It must be 4B aligned because the PIO DMA
+  // writes words.
+  uint8_t *heap_end = sbrk(0);
+  uint32_t pad = -(uintptr_t)heap_end & 3;
+  capture_size = ((uint32_t)((uint8_t *)&__StackLimit - heap_end) - pad - HEAP_RESERVE) & ~3;
+  capture_buf = (uint8_t *)sbrk(pad + capture_size) + pad;
+  debug_printf("DMA start %p size %d\n\r", (void *)capture_buf, capture_size);
 
   // This testmode forces the device into a capture state without needing
   // sigrok cli/pulseview to initiate it
@@ -768,15 +765,42 @@ int main() {
      dev.sample_rate=1000;
      dev.num_samples=5000;
      dev.sent_cnt=0; //number of samples sent
-     ccnt=0;
+     enc.ccnt=0;
 
   */
 
   gpio_init_mask(GPIO_DIGITAL_MASK);         // set as GPIO_FUNC_SIO and clear output enable
   gpio_set_dir_masked(GPIO_DIGITAL_MASK, 0); // Set all to input
   while (1) {
-    __sev(); // send event to wake core1
-    if (send_resp) {
+    c0cnt++;
+    if (dev.started == false) {
+      // always drain all defined uarts as if that is not done it can
+      // effect the usb serial CDC stability
+      // these are generally rare events caused by noise/reset events
+      // and thus not checked when dev.started
+      while (uart_is_readable_within_us(uart0, 0)) {
+        uartch = uart_getc(uart0);
+      }
+    }
+    // look for commands on usb cdc
+    intin = getchar_timeout_us(0);
+    // The '+' is the only character we track during normal sampling because it can end
+    // a continuous trace.  A reset '*' should only be seen after we have completed normally
+    // or hit an error condition.
+    if (intin == '+') {
+      dev.sending = false;
+      dev.aborted = false; // clear the abort so we stop sending !!
+    } else if (intin >= 0) {
+      if (process_char(&dev, (char)intin)) {
+        send_resp = true;
+      }
+    }
+    if (intin >= 0) {
+      // Wake core1 in case the command ended the capture while it waits for a segment
+      __sev();
+    }
+    // A response during a capture on the CDC serial would land in the samples, so it waits for the end
+    if (send_resp && !(init_done && !dev.vendor_tx)) {
       // Don't mix printf with direct to usb commands
       // printf("%s",dev.rspstr);
       my_stdio_usb_out_chars(dev.rspstr, strlen(dev.rspstr));
@@ -797,7 +821,11 @@ int main() {
         uart_init(uart0, UART_BAUD);
       }
 #endif
-      lowerhalf = 1;
+      uint32_t arm_start = time_us_32();
+      // An abort of this capture goes out at once, whenever the last one was repeated
+      abort_next = 0;
+      memset(&dev.stats, 0, sizeof(dev.stats));
+      dev.stats.ring_free_min = SR_RING_SEGMENTS;
       // Sample rate must always be even.  Pulseview code enforces this
       // because a frequency step of 2 is required to get a pulldown to specify
       // the sample rate, but sigrok cli can still pass it.
@@ -810,56 +838,149 @@ int main() {
       dev.num_samples = (dev.num_samples + 3) & 0xFFFFFFFC;
       // Divide capture buf evenly based on channel enables
       // d_size is aligned to 4 bytes because pio operates on words
-      // These are the sizes for each half buffer in bytes
+      // These are the sizes for each ring segment in bytes
       // Calculate relative size in terms of nibbles which is the smallest unit, thus a_chan_cnt is multiplied by 2
       // Nibble size storage is only allow for D4 mode with no analog channels enabled
       // For instance a D0..D5 with A0 would give 1/2 the storage to digital and 1/2 to analog
-      uint32_t d_nibbles, a_nibbles, t_nibbles; // digital, analog and total nibbles
-      d_nibbles = dev.d_nps;                    // digital is in grous of 4 bits
-      a_nibbles = dev.a_chan_cnt * 2;           // 1 byte per sample
+      uint32_t d_nibbles, a_nibbles, t_nibbles;   // digital, analog and total nibbles
+      d_nibbles = dev.d_nps;                      // digital is in grous of 4 bits
+      a_nibbles = dev.a_slice_bytes * 2;          // 1 byte per sample, 2 for 12 bit or oversampled values
       t_nibbles = d_nibbles + a_nibbles;
 
       // total buf size must be a multiple of a_nibbles*2, d_nibbles*8, and t_nibbles so that division is always
       // in whole samples
-      // Also set a multiple of 32  because the dma buffer is split in half, and
+      // Also set a multiple of 32  because the dma buffer is split in segments, and
       // the PIO does writes on 4B boundaries, and then a 4x factor for any other size/alignment issues
       uint32_t chunk_size = t_nibbles * 32;
       if (a_nibbles)
         chunk_size *= a_nibbles;
       if (d_nibbles)
         chunk_size *= d_nibbles;
+      if (dev.a_ratio > 1) {
+        // Oversampled analog slices are already many nibbles, and 8 slices keep the digital part in
+        // whole words, so the chunk doesn't need to grow with a_nibbles
+        chunk_size = t_nibbles * 4;
+      }
       uint32_t dig_bytes_per_chunk = chunk_size * d_nibbles / t_nibbles;
       uint32_t dig_samples_per_chunk = (d_nibbles) ? dig_bytes_per_chunk * 2 / d_nibbles : 0;
       uint32_t chunk_samples = d_nibbles ? dig_samples_per_chunk : (chunk_size * 2) / (a_nibbles);
-      // total chunks in entire buffer-round to 2 since we split it in half
-      uint32_t buff_chunks = (DMA_BUFFER_SIZE / chunk_size) & 0xFFFFFFFE;
-      // round up and force power of two since we cut it in half
-      uint32_t chunks_needed = ((dev.num_samples / chunk_samples) + 2) & 0xFFFFFFFE;
+      if (dev.pack_bits) {
+        // Packed samples don't fill whole nibbles, so a chunk is instead 32 words of 32/pack_bits samples
+        chunk_size = 32 * 4;
+        chunk_samples = 32 * (32 / dev.pack_bits);
+      }
+      // total chunks in entire buffer-round to the segment count since we split it in segments
+      uint32_t buff_chunks = (capture_size / chunk_size) & ~(SR_RING_SEGMENTS - 1);
+      // round up to the segment count as well
+      uint32_t chunks_needed = ((dev.num_samples / chunk_samples) + SR_RING_SEGMENTS) & ~(SR_RING_SEGMENTS - 1);
+#ifdef ARM_DBG
       debug_printf("Initial buf calcs nibbles d %d a %d t %d \n\r", d_nibbles, a_nibbles, t_nibbles);
       debug_printf("chunk size %d samples %d buff %d needed %d\n\r", chunk_size, chunk_samples, buff_chunks, chunks_needed);
       debug_printf("dbytes per chunk %d dig samples per chunk %d\n\r", dig_bytes_per_chunk, dig_samples_per_chunk);
-      // If all of the samples we need fit in two half buffers or less then we can mask the error
-      // logic that is looking for cases where we didn't send one half buffer to the host before
-      // the 2nd buffer ended because we only use each half buffer once.
+#endif
+      // If all of the samples we need fit in one lap of the rings then we can mask the error
+      // logic that is looking for cases where we didn't send a segment to the host before
+      // the DMA came back around to it because we only use each segment once.
       mask_xfer_err = false;
+      // A fixed capture with a trigger and pre-trigger samples keeps the samples before the trigger
+      // in free running rings, so it takes the whole buffer
+      pretrig = (dev.continuous == false) && (dev.pretrig_cnt > 0) && ((dev.lvl0mask | dev.lvl1mask | dev.risemask | dev.fallmask | dev.chgmask) != 0);
+      // A transition capture streams changes rather than samples, so it takes the whole buffer whatever
+      // the number of samples. Its program is longer than the sampling one and has to fit next to the
+      // trigger program. Pre-trigger samples aren't supported.
+      // A protocol capture decodes the changes of a transition capture, so it has the same limits, and its
+      // channels must be enabled
+      protocol = (dev.protocol.kind != SR_PROTOCOL_NONE) && ((sr_protocol_mask(&dev.protocol) & ~dev.d_mask) == 0) &&
+                 sr_protocol_reset(&dev.protocol, dev.sample_rate);
+      // The trigger program goes first, at offset 0 where its jumps point
+      trig_len = sr_trigger_program(trig_instr, dev.lvl0mask, dev.lvl1mask, dev.risemask, dev.fallmask, dev.chgmask);
+      transitions = (dev.transitions || protocol) && (dev.a_mask == 0) && (dev.d_mask != 0);
+      if (transitions) {
+        if (trig_len + SR_TRANSITION_MAX_INSTR > 32) {
+          debug_printf("Trigger too long for transitions, sampling\n\r");
+          transitions = false;
+        } else if ((uint64_t)dev.sample_rate * SR_TRANSITION_LOOP > clock_get_hz(clk_sys)) {
+          // The PIO can't run the transition program fast enough, and the runs would come out short
+          debug_printf("Rate too high for transitions, sampling\n\r");
+          transitions = false;
+        } else {
+          pretrig = false;
+        }
+      }
+      protocol = protocol && transitions;
+      if ((dev.protocol.kind != SR_PROTOCOL_NONE) && !protocol) {
+        // Sending samples instead would change the stream format without the host knowing. Nothing
+        // has started yet, so end it as an abort that the cleanup below and the "!!!" take care of.
+        debug_printf("Protocol can't be decoded, refused\n\r");
+        dev.stats.abort = SR_ABORT_REFUSE;
+        dev.aborted = true;
+        dev.sending = false;
+        init_done = true;
+        continue;
+      }
+      // The samples of a transition capture are only known from the runs before them, so it can't skip any
+      gaps = dev.gaps && dev.continuous && !transitions;
+      gap_pending = false;
       // If requested samples are smaller than the buffer, reduce the size so that the
       // transfer completes sooner.
       // Also, mask the sending of aborts if the requested number of samples fit into RAM
       // Don't do this in continuous mode as the final size is unknown
-      if (dev.continuous == false) {
-        if (buff_chunks > chunks_needed) {
+      // A burst needs the samples in all but the last segment, which is spare
+      uint32_t burst_chunks = (((dev.num_samples / chunk_samples) + 1) * SR_RING_SEGMENTS / (SR_RING_SEGMENTS - 1) + SR_RING_SEGMENTS) & ~(SR_RING_SEGMENTS - 1);
+      burst = false;
+      store = false;
+      if ((dev.continuous == false) && !transitions) {
+        if ((buff_chunks >= burst_chunks) && !pretrig) {
+          mask_xfer_err = true;
+          burst = true;
+          buff_chunks = burst_chunks;
+        } else if (buff_chunks > chunks_needed) {
           mask_xfer_err = true;
-          buff_chunks = chunks_needed;
+          if (!pretrig) {
+            buff_chunks = chunks_needed;
+          }
           // debug_printf("Reduce buf chunks to %d\n\r",buff_chunks);
+        } else if (dev.store && !pretrig) {
+          store = true;
+          buff_chunks = MAX((buff_chunks / 4) & ~(SR_RING_SEGMENTS - 1), SR_RING_SEGMENTS);
         }
       }
+      tx_cut = false;
+      tx_lost = 0;
+      enc.tx_get = (gaps || store) ? cut_tx_get : sr_usb_tx_get;
+      enc.tx_put = (gaps || store) ? cut_tx_put : sr_usb_tx_put;
       // Give dig and analog equal fractions
-      // This is the size of each half buffer in bytes
-      dev.d_size = (buff_chunks * chunk_size * d_nibbles) / (t_nibbles * 2);
-      dev.a_size = (buff_chunks * chunk_size * a_nibbles) / (t_nibbles * 2);
-      dev.samples_per_half = chunk_samples * buff_chunks / 2;
-      // debug_printf("Final sizes d %d a %d mask err %d samples per half %d\n\r"
-      //,dev.d_size,dev.a_size,mask_xfer_err,dev.samples_per_half);
+      // This is the size of each ring segment in bytes
+      dev.d_size = (buff_chunks * chunk_size * d_nibbles) / (t_nibbles * SR_RING_SEGMENTS);
+      dev.a_size = (buff_chunks * chunk_size * a_nibbles) / (t_nibbles * SR_RING_SEGMENTS);
+      dev.samples_per_seg = chunk_samples * buff_chunks / SR_RING_SEGMENTS;
+      if (pretrig) {
+        // The rings stop a lap after the first sample sent, and have to be stopped before they are more
+        // than 7 segments past it, which gives some margin over the trigger search and core1's response
+        if (dev.num_samples > dev.samples_per_seg * (SR_RING_SEGMENTS - 1)) {
+          debug_printf("Too many samples for pre-trigger, sending from the trigger\n\r");
+          pretrig = false;
+        } else {
+          pretrig_cnt = MIN(dev.pretrig_cnt, dev.num_samples);
+          pretrig_cnt = MIN(pretrig_cnt, dev.samples_per_seg * (SR_RING_SEGMENTS / 2) - 2 * PRETRIG_WINDOW - 8);
+          mask_xfer_err = true;
+        }
+      }
+      burst_last = (dev.num_samples - 1) / dev.samples_per_seg;
+      burst_done = false;
+      pretrig_armed = false;
+      pretrig_found = false;
+      triggered = false;
+      seg_skip = 0;
+      trans_idx = 0;
+      trans_val = 0;
+      trans_start = 0;
+      trans_block_us = time_us_32();
+      trans_seg_us = 0;
+      trans_seg_ccnt = 0;
+      proto_sample = 0;
+      // debug_printf("Final sizes d %d a %d mask err %d samples per seg %d\n\r"
+      //,dev.d_size,dev.a_size,mask_xfer_err,dev.samples_per_seg);
 
       // Clear any previous ADC over/underflow
       volatile uint32_t *adcfcs;
@@ -868,31 +989,70 @@ int main() {
 
       // Ensure any previous dma is done
       // The cleanup loop also does this but it doesn't hurt to do it twice
-      dma_channel_abort(admachan0);
-      dma_channel_abort(admachan1);
-      dma_channel_abort(pdmachan0);
-      dma_channel_abort(pdmachan1);
-      // Enable the initial chaing from the first half to 2nd, further chains are enabled based
-      // on whether we can parse each half in time.
-      channel_config_set_chain_to(&acfg0, admachan1);
-      channel_config_set_chain_to(&pcfg0, pdmachan1);
-
-      num_halves = 0;
-      dev.dbuf0_start = 0;
-      ccnt = 0;
-      dev.dbuf1_start = dev.d_size;
-      dev.abuf0_start = dev.dbuf1_start + dev.d_size;
-      dev.abuf1_start = dev.abuf0_start + dev.a_size;
+      sr_ring_abort(&aring);
+      sr_ring_abort(&dring);
+
+      num_segs = 0;
+      dev.dbuf_start = 0;
+      enc.d_mask = dev.d_mask;
+      enc.num_samples = dev.num_samples;
+      enc.samples_per_seg = dev.samples_per_seg;
+      enc.continuous = dev.continuous;
+      enc.a_chan_cnt = dev.a_chan_cnt;
+      enc.a_bps = dev.a_bps;
+      enc.a_delta = dev.a_delta;
+      enc.d_tx_bps = dev.d_tx_bps;
+      sr_encoder_reset(&enc);
+      dev.abuf_start = dev.dbuf_start + dev.d_size * SR_RING_SEGMENTS;
+      uint32_t store_start = (dev.abuf_start + dev.a_size * SR_RING_SEGMENTS + 3) & ~3;
+      if (!sr_usb_tx_set_store(store ? &(capture_buf[store_start]) : NULL, capture_size - store_start)) {
+        // The controller still reads a block of the last capture that the host never took, which may be
+        // in capture_buf, so this capture can't start until the host reads again
+        debug_printf("USB still busy with the last capture, refused\n\r");
+        dev.stats.abort = SR_ABORT_REFUSE;
+        dev.aborted = true;
+        dev.sending = false;
+        init_done = true;
+        continue;
+      }
+#ifdef SR_USB_VENDOR
+      sr_usb_tx_select_vendor(dev.vendor_tx);
+#endif
+      sr_usb_tx_hold(store);
 
       volatile uint32_t *adcdiv;
       adcdiv = (volatile uint32_t *)(ADC_BASE + 0x10); // ADC DIV
       //   debug_printf("adcdiv start %u\n\r",*adcdiv);
       //	  debug_printf("starting d_nps %u a_chan_cnt %u d_size %u a_size %u a_mask %X\n\r"
       //         ,dev.d_nps,dev.a_chan_cnt,dev.d_size,dev.a_size,dev.a_mask);
-      // debug_printf("start offsets d0 0x%X d1 0x%X a0 0x%X a1 0x%X samperhalf %u\n\r"
-      //    ,dev.dbuf0_start,dev.dbuf1_start,dev.abuf0_start,dev.abuf1_start,dev.samples_per_half);
-      // debug_printf("starting data buf values 0x%X 0x%X\n\r",capture_buf[dev.dbuf0_start],capture_buf[dev.dbuf1_start]);
-      uint32_t adcdivint = 48000000ULL / (dev.sample_rate * dev.a_chan_cnt);
+      // debug_printf("start offsets d 0x%X a 0x%X samperseg %u\n\r"
+      //    ,dev.dbuf_start,dev.abuf_start,dev.samples_per_seg);
+      if (trig_len > 0) {
+        // The program itself is loaded with the capture one, see load_programs.
+        // Read the same pins as the capture and shift samples out of the OSR lowest channel first,
+        // at full speed so that the trigger is checked several times per sample
+        pio_sm_config tc = pio_get_default_sm_config();
+        sm_config_set_in_pins(&tc, 2);
+        sm_config_set_out_shift(&tc, true, false, 32);
+        pio_sm_init(pio, trigsm, 0, &tc);
+        pio_interrupt_clear(pio, SR_TRIGGER_IRQ);
+        pio_set_irq0_source_enabled(pio, pis_interrupt0 + SR_TRIGGER_IRQ, true);
+        if (pretrig) {
+          // The push of the trigger program has this take the ring position with DMA latency rather
+          // than that of an interrupt
+          dma_channel_config sc = dma_channel_get_default_config(trig_snap_chan);
+          channel_config_set_read_increment(&sc, false);
+          channel_config_set_write_increment(&sc, false);
+          channel_config_set_dreq(&sc, pio_get_dreq(pio, trigsm, false));
+          dma_channel_configure(trig_snap_chan, &sc, &trig_snap, dev.d_mask ? dring.write_addr : aring.write_addr, 1, true);
+        }
+      } else {
+        trig_len = 0;
+        pretrig = false;
+      }
+      // Oversampling runs the ADC a_ratio times faster than the sample rate
+      uint32_t adc_rate = dev.sample_rate * dev.a_chan_cnt * dev.a_ratio;
+      uint32_t adcdivint = adc_rate ? 48000000ULL / adc_rate : 0;
       if (dev.a_chan_cnt) {
         adc_run(false);
         //             en, dreq_en,dreq_thresh,err_in_fifo,byte_shift to 8 bit
@@ -914,7 +1074,7 @@ int main() {
         // Fractional divisors should generally be avoided because it creates
         // skew with digital samples.
         uint8_t adc_frac_int;
-        adc_frac_int = (uint8_t)(((48000000ULL % dev.sample_rate) * 256ULL) / dev.sample_rate);
+        adc_frac_int = (uint8_t)(((48000000ULL % adc_rate) * 256ULL) / adc_rate);
         if (adcdivint <= 96) {
           *adcdiv = 0;
         } else {
@@ -925,77 +1085,94 @@ int main() {
         // This is needed to clear the AINSEL so that when the round robin arbiter starts we start sampling on channel 0
         adc_select_input(0);
         adc_set_round_robin(dev.a_mask & 0x7);
-        //             en, dreq_en,dreq_thresh,err_in_fifo,byte_shift to 8 bit
-        adc_fifo_setup(true, true, 1, false, true);
+        //             en, dreq_en,dreq_thresh,err_in_fifo,byte_shift to 8 bit unless we keep 12
+        adc_fifo_setup(true, true, 1, false, (dev.a_bps == 1) && (dev.a_ratio == 1));
 
-        // set chan0 to immediate trigger (but without adc_run it shouldn't start), chan1 is chained to it.
-        //  channel, config, write_addr,read_addr,transfer_count,trigger)
-        dma_channel_configure(admachan0, &acfg0, &(capture_buf[dev.abuf0_start]), &adc_hw->fifo, dev.a_size, true);
-        dma_channel_configure(admachan1, &acfg1, &(capture_buf[dev.abuf1_start]), &adc_hw->fifo, dev.a_size, false);
+        // Start the ring right away (but without adc_run it shouldn't get samples), ADC transfers are 1 byte,
+        // or 2 for 12 bit or oversampled values
+        bool adc_16 = (dev.a_bps == 2) || (dev.a_ratio > 1);
+        sr_ring_start(&aring, &(capture_buf[dev.abuf_start]), dev.a_size, &adc_hw->fifo, DREQ_ADC, adc_16 ? DMA_SIZE_16 : DMA_SIZE_8, pretrig);
         adc_fifo_drain();
       } // any analog enabled
       if (dev.d_mask) {
         // analyzer_init from pico-examples
-        // Due to how PIO shifts in bits, if any digital channel within a group of 8 is set,
-        // then all groups below it must also be set. We further restrict it in the tx_init function
-        // by saying digital channel usage must be continous.
-        /* pin count is restricted to 4,8,16 or 32, and pin count of 4 is only used
-       Pin count is kept to a powers of 2 so that we always read a sample with a single byte/word/dword read
-       for faster parsing.
-          if analog is disabled and we are in D4 mode
+        // The PIO samples pin_count pins from the lowest one tx_init picked, channels in between
+        // that aren't enabled are sampled too.
+        /* pin count is set by tx_init to 4,8,16 or 32, and pin count of 4 is only used
+       if analog is disabled and we are in D4 mode. Without analog 5,6,9 and 10 channels
+       are packed 32/pin_count samples to a word.
            bits d_dma_bps   d_tx_bps
            0-4    0          1        No analog channels
            0-4    1          1        1 or more analog channels
+           5-6    4          1        packed 6 or 5 per word, no analog channels
            5-7    1          1
            8      1          2
+           9-10   4          2        packed 3 per word, no analog channels
            9-12   2          2
            13-14  2          2
            15-16  2          3
            17-21  4          3
+          Without analog, channels that don't start at D0 are always packed, with the pins
+          from the lowest to the highest enabled channel. The bits column is then the highest.
        */
-        dev.pin_count = 0;
-        if (dev.d_mask & 0x0000000F)
-          dev.pin_count += 4;
-        if (dev.d_mask & 0x000000F0)
-          dev.pin_count += 4;
-        if (dev.d_mask & 0x0000FF00)
-          dev.pin_count += 8;
-        if (dev.d_mask & 0x0FFF0000)
-          dev.pin_count += 16;
-        // If 4 or less channels are enabled but ADC is also enabled, set a minimum size of 1B of PIO storage
-        if ((dev.pin_count == 4) && (dev.a_chan_cnt)) {
-          dev.pin_count = 8;
-        }
-        d_dma_bps = dev.pin_count >> 3;
+        enc.d_dma_bps = dev.pack_bits ? 4 : dev.pin_count >> 3;
+        enc.d_pack_bits = dev.pack_bits;
+        enc.d_shift = dev.d_shift;
         // debug_printf("pin_count %d\n\r",dev.pin_count);
-        uint16_t capture_prog_instr;
-        capture_prog_instr = pio_encode_in(pio_pins, dev.pin_count);
+        // With a trigger the first instruction holds the capture until the trigger program matches,
+        // unless we need the samples before the trigger
+        uint16_t capture_prog_instr[SR_TRANSITION_MAX_INSTR];
+        uint capture_len = 0;
+        uint wrap_target = 0;
+        uint32_t trans_shift = 0;
+        if (transitions) {
+          // The count of samples between pushes restarts from a power of 2 of about sample_rate/64, so
+          // an idle bus still gets 32 to 64 pushes a second
+          trans_shift = __builtin_clz(MAX(dev.sample_rate / 64, 2));
+          // Only the pins up to the highest channel, as the others would push changes for nothing
+          capture_len = sr_transition_program(capture_prog_instr, trig_len != 0, 32 - __builtin_clz(dev.d_mask) - dev.d_shift, trans_shift);
+          wrap_target = (trig_len != 0) ? 1 : 0;
+          sr_transition_reset(&trans, trans_shift);
+        } else {
+          if (trig_len && !pretrig) {
+            capture_prog_instr[capture_len++] = pio_encode_wait_irq(true, false, SR_TRIGGER_IRQ);
+          }
+          capture_prog_instr[capture_len++] = pio_encode_in(pio_pins, dev.pin_count);
+          wrap_target = capture_len - 1;
+        }
         // debug_printf("capture_prog_instr 0x%X\n\r",capture_prog_instr);
-        struct pio_program capture_prog = {
-            .instructions = &capture_prog_instr,
-            .length = 1,
-            .origin = -1};
-        uint offset = pio_add_program(pio, &capture_prog);
-        // Configure state machine to loop over this `in` instruction forever,
+        uint offset = load_programs(pio, trig_instr, trig_len, capture_prog_instr, capture_len);
+        // Configure state machine to loop over the `in` instruction forever,
         // with autopush enabled.
         pio_sm_config c = pio_get_default_sm_config();
-        // start at GPIO2 (keep 0 and 1 for uart)
-        sm_config_set_in_pins(&c, 2);
-        sm_config_set_wrap(&c, offset, offset);
+        // D0 is GPIO2 (keep 0 and 1 for uart)
+        sm_config_set_in_pins(&c, 2 + dev.d_shift);
+        sm_config_set_wrap(&c, offset + wrap_target, offset + capture_len - 1);
 
         uint16_t div_int;
         uint8_t frac_int;
-        div_int = frequency_count_khz(CLOCKS_FC0_SRC_VALUE_CLK_SYS) * 1000 / dev.sample_rate;
+        // The transition program takes SR_TRANSITION_LOOP cycles per sample rather than one
+        uint32_t pio_rate = dev.sample_rate * (transitions ? SR_TRANSITION_LOOP : 1);
+        // The clock set by set_sys_clock_khz, which is exact where the frequency counter takes about a
+        // millisecond to measure it to the kHz
+        uint32_t clk_sys_hz = clock_get_hz(clk_sys);
+        div_int = clk_sys_hz / pio_rate;
         if (div_int < 1)
           div_int = 1;
-        frac_int = (uint8_t)(((frequency_count_khz(CLOCKS_FC0_SRC_VALUE_CLK_SYS) * 1000 % dev.sample_rate) * 256ULL) / dev.sample_rate);
+        frac_int = (uint8_t)(((clk_sys_hz % pio_rate) * 256ULL) / pio_rate);
         //             debug_printf("PIO sample clk %u divint %d divfrac %d \n\r",dev.sample_rate,div_int,frac_int);
         // Unlike the ADC, the PIO int divisor does not have to subtract 1.
         // Frequency=sysclkfreq/(CLKDIV_INT+CLKDIV_FRAC/256)
         sm_config_set_clkdiv_int_frac(&c, div_int, frac_int);
 
-        // Since we enable digital channels in groups of 4, we always get 32 bit words
-        sm_config_set_in_shift(&c, true, true, 32);
+        // Since we enable digital channels in groups of 4, we always get 32 bit words, and
+        // when packed the push comes after the last whole sample that fits
+        sm_config_set_in_shift(&c, true, true, dev.pack_bits ? (32 / dev.pack_bits) * dev.pack_bits : 32);
+        if (transitions) {
+          // The transition program pushes by itself, and shifts the pins out of the OSR
+          sm_config_set_in_shift(&c, true, false, 32);
+          sm_config_set_out_shift(&c, true, false, 32);
+        }
         sm_config_set_fifo_join(&c, PIO_FIFO_JOIN_RX);
         pio_sm_init(pio, piosm, offset, &c);
         // Analyzer arm from pico examples
@@ -1005,36 +1182,30 @@ int main() {
         pio_sm_clear_fifos(pio, piosm);
         // write the restart bit of PIO_CTRL
         pio_sm_restart(pio, piosm);
+        if (transitions) {
+          uint16_t setup_instr[SR_TRANSITION_SETUP_INSTR];
+          sr_transition_setup(setup_instr, trans_shift);
+          for (uint k = 0; k < SR_TRANSITION_SETUP_INSTR; k++) {
+            pio_sm_exec(pio, piosm, setup_instr[k]);
+          }
+        }
 
 #ifndef NODMA
-        channel_config_set_dreq(&pcfg0, pio_get_dreq(pio, piosm, false));
-        channel_config_set_dreq(&pcfg1, pio_get_dreq(pio, piosm, false));
-
-        //                       number    config   buffer target                  piosm          xfer size  trigger
-        dma_channel_configure(pdmachan0, &pcfg0, &(capture_buf[dev.dbuf0_start]), &pio->rxf[piosm], dev.d_size >> 2, true);
-        dma_channel_configure(pdmachan1, &pcfg1, &(capture_buf[dev.dbuf1_start]), &pio->rxf[piosm], dev.d_size >> 2, false);
+        // PIO transfers are the 4B words of the autopush, or of the pushed pairs of a transition capture
+        sr_ring_start(&dring, &(capture_buf[dev.dbuf_start]), dev.d_size, &pio->rxf[piosm], pio_get_dreq(pio, piosm, false), DMA_SIZE_32, pretrig);
 #endif
 
         // This is done later so that we start everything as close in time as possible
         //              pio_sm_set_enabled(pio, piosm, true);
+      } else {
+        load_programs(pio, trig_instr, trig_len, NULL, 0);
       } // dev.d_mask
-      // These must be at their initial value,(or zero for the 2ndhalf) otherwise it indicates they have started to countdown
-      // debug_printf("Tcount start d %u %u a %u %u\n\r",*tcountd0,*tcountd1,*tcounta0,*tcounta1);
-      // These must be the initial value for both
-      // debug_printf("Tcount dbg start d 0x%X 0x%X a 0x%X 0x%X\n\r",*tcountdbgd0,*tcountdbgd1,*tcountdbga0,*tcountdbga1);
-      // These catch cases in DMA coding where DMA engines have started too soon..
-
-      if ((*tcountd0) != (*tcountdbgd0) && (dev.d_mask)) {
-        debug_printf("\n\r\n\rERROR: DMAD0 changing\n\r\n\r");
-      }
-      if ((*tcounta0) != (*tcountdbga0) && (dev.a_mask)) {
-        debug_printf("\n\r\n\rERROR: DMAA0 changing\n\r\n\r");
-      }
-      if ((*tcountd1) != 0) {
-        debug_printf("\n\r\n\rERROR: DMAD1 should start with 0 tcount\n\r\n\r");
+      // The rings start in segment 0 and must not have moved yet, otherwise they started too soon
+      if ((*dring.write_addr != (uint32_t)sr_ring_seg(&dring, 0)) && (dev.d_mask)) {
+        debug_printf("\n\r\n\rERROR: DMAD changing\n\r\n\r");
       }
-      if ((*tcounta1) != 0) {
-        debug_printf("\n\r\n\rERROR: DMAA1 should start with 0 tcount\n\r\n\r");
+      if ((*aring.write_addr != (uint32_t)sr_ring_seg(&aring, 0)) && (dev.a_mask)) {
+        debug_printf("\n\r\n\rERROR: DMAA changing\n\r\n\r");
       }
 
       // debug_printf("LVL0mask 0x%X\n\r",dev.lvl0mask);
@@ -1043,46 +1214,67 @@ int main() {
       // debug_printf("fallmask 0x%X\n\r",dev.fallmask);
       // debug_printf("edgemask 0x%X\n\r",dev.chgmask);
 
-      // debug_printf("dma addr start d 0x%X 0x%X a 0x%X 0x%X\n\r",*taddrd0,*taddrd1,*taddra0,*taddra1);
       // debug_printf("capture_buf base %p \n\r",capture_buf);
-      // debug_printf("capture_buf dig %p %p \n\r",&(capture_buf[dev.dbuf0_start]),&(capture_buf[dev.dbuf1_start]));
-      // debug_printf("capture_buf analog %p %p\n\r",&(capture_buf[dev.abuf0_start]),&(capture_buf[dev.abuf1_start]));
+      // debug_printf("capture_buf dig %p analog %p\n\r",&(capture_buf[dev.dbuf_start]),&(capture_buf[dev.abuf_start]));
       // debug_printf("PIOSMCLKDIV 0x%X\n\r",*pio0sm0clkdiv);
 
       // debug_printf("PIO ctrl 0x%X fstts 0x%X dbg 0x%X lvl 0x%X\n\r",*pioctrl,*piofstts,*piodbg,*pioflvl);
-      // debug_printf("DMA channel assignments a %d %d d %d %d\n\r",admachan0,admachan1,pdmachan0,pdmachan1);
-      // debug_printf("DMA ctr reg addrs a %p %p d %p %p\n\r",(void *) tstsa0,(void *)tstsa1,(void *)tstsd0,(void *)tstsd1);
-      // debug_printf("DMA ctrl reg a 0x%X 0x%X d 0x%X 0x%X\n\r",*tstsa0,*tstsa1,*tstsd0,*tstsd1);
+      // debug_printf("DMA data channels a %d d %d\n\r",aring.data_chan,dring.data_chan);
       // Enable logic and analog close together for best possible alignment
       // warning - do not put printfs or similar things here...
       tstart = time_us_32();
-      adc_run(true); // enable free run sample mode
-      pio_sm_set_enabled(pio, piosm, true);
+      // With a trigger the ADC is started by trigger_irq_handler, and with a pre-trigger core1 starts
+      // the trigger once there are enough samples before it
+      if ((trig_len == 0) || pretrig) {
+        adc_run(true); // enable free run sample mode
+      }
+      pio_set_sm_mask_enabled(pio, (1u << piosm) | ((trig_len && !pretrig) ? (1u << trigsm) : 0), true);
+      dev.stats.arm_us = tstart - arm_start;
       dev.started = true;
       init_done = true;
+      // Hand the capture to core1
+      __dmb();
+      encoding = true;
+      __sev();
 
     } // if dev.sending and not started
-    dma_check(&dev);
+    sr_usb_tx_task();
+#ifdef SR_USB_VENDOR
+    // stdio_usb doesn't run the TinyUSB task in the background when the application has its own descriptors
+    tud_task();
+#endif
 
-    // In high verbosity modes the host can miss the "!" so send these until it sends a "+"
-    if (dev.aborted == true) {
+    // In high verbosity modes the host can miss the "!" so send these until it sends a "+". The loop keeps
+    // running meanwhile, so the "+" is taken as soon as it comes.
+    if ((dev.aborted == true) && (encoding == false) && (time_us_64() >= abort_next)) {
       debug_printf("sending abort !\n\r");
-      my_stdio_usb_out_chars("!!!", 3);
-      sleep_us(200000);
+      send_abort();
+      abort_next = time_us_64() + ABORT_REPEAT_US;
     }
     // if we abort or normally finish a run sending gets dropped
-    if ((dev.sending == false) && (init_done == true)) {
+    if ((dev.sending == false) && (init_done == true) && (encoding == false)) {
       // debug_printf("Ending PIO ctrl 0x%X fstts 0x%X dbg 0x%X lvl 0x%X\n\r",*pioctrl,*piofstts,*piodbg,*pioflvl);
       // The end of sequence byte_cnt uses a "$<byte_cnt>+" format.
       // Send the byte_cnt to ensure no bytes were lost
       if (dev.aborted == false) {
         char brsp[16];
-        // Give the host time to finish processing samples so that the bytecnt
-        // isn't dropped on the wire
-        sleep_us(100000);
-        debug_printf("Cleanup bytecnt %d\n\r", ccnt);
-        sprintf(brsp, "$%d%c", ccnt, '+');
+        // core1 has flushed the encoder, wait for its blocks to go out. Each one is only retired once the
+        // host has taken it, so the bytecnt can't overtake the samples and needs no delay.
+        sr_usb_tx_drain();
+        debug_printf("Cleanup bytecnt %d\n\r", enc.ccnt);
+        sprintf(brsp, "$%d%c", enc.ccnt, '+');
+#ifdef SR_USB_VENDOR
+        // The byte count follows the samples on the vendor interface, with the newline puts_raw adds
+        if (dev.vendor_tx) {
+          strcat(brsp, "\n");
+          sr_usb_tx_write(brsp, strlen(brsp));
+          sr_usb_tx_drain();
+        } else {
+          puts_raw(brsp);
+        }
+#else
         puts_raw(brsp);
+#endif
       }
 
 #ifdef NODMA
@@ -1102,12 +1294,12 @@ int main() {
       pio_sm_restart(pio, piosm);
       pio_sm_set_enabled(pio, piosm, false);
       pio_sm_clear_fifos(pio, piosm);
-      pio_clear_instruction_memory(pio);
+      pio_sm_set_enabled(pio, trigsm, false);
+      pio_set_irq0_source_enabled(pio, pis_interrupt0 + SR_TRIGGER_IRQ, false);
+      dma_channel_abort(trig_snap_chan);
 
-      dma_channel_abort(admachan0);
-      dma_channel_abort(admachan1);
-      dma_channel_abort(pdmachan0);
-      dma_channel_abort(pdmachan1);
+      sr_ring_abort(&aring);
+      sr_ring_abort(&dring);
       init_done = false;
 
       // Print USB Endpoint controls in the DPSRAM, which is at the base of USBCTRL
@@ -1127,12 +1319,27 @@ int main() {
       // Print out debug information after completing, rather than before so that it doesn't
       // delay the start of a capture
       debug_printf("Complete: SRate %d NSmp %d\n\r", dev.sample_rate, dev.num_samples);
-      debug_printf("Cont %d bcnt %d\n\r", dev.continuous, ccnt);
-      debug_printf("DMsk 0x%X AMsk 0x%X\n\r", dev.d_mask, dev.a_mask);
-      debug_printf("Half buffers %d sampperhalf %d\n\r", num_halves, dev.samples_per_half);
+      debug_printf("Cont %d bcnt %d\n\r", dev.continuous, enc.ccnt);
+      debug_printf("DMsk 0x%X AMsk 0x%X burst %d\n\r", dev.d_mask, dev.a_mask, burst);
+      if (dev.a_ratio > 1) {
+        debug_printf("Analog oversampled x%d\n\r", dev.a_ratio);
+      }
+      if (trig_len) {
+        debug_printf("Trigger len %d at %d us pretrig %d\n\r", trig_len, ttrig - tstart, pretrig ? pretrig_cnt : 0);
+      }
+      debug_printf("Segments %d sampperseg %d max lag %d us\n\r", num_segs, dev.samples_per_seg, dev.stats.lag_us_max);
+      if (transitions) {
+        // Each segment held d_size/8 changes and repeated pushes
+        debug_printf("Transitions %d segments of %d changes\n\r", num_segs, dev.d_size / 8);
+      }
+      if (store) {
+        // How far ahead of the USB the encoder got, and the raw bytes that held the same samples
+        debug_printf("Store peak %d blocks, samples %d bytes %d\n\r", sr_usb_tx_peak(), num_segs * dev.samples_per_seg,
+                     num_segs * (dev.d_size + dev.a_size));
+      }
 
-      // Report the number of main loops for each core to ensure
-      // C0 runs more loops
+      // Report the number of loops of core0 (USB and commands) and of the
+      // core1 DMA polling during the capture
       debug_printf("loop counts C0 %d C1 %d\n\r", c0cnt, c1cnt);
       c0cnt = 0;
       c1cnt = 0;
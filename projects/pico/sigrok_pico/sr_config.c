@@ -0,0 +1,42 @@
+#include "sr_config.h"
+
+// The 32 bit values in the order they are sent
+#define CONFIG_VALUE_CNT 9
+#define CONFIG_VALUES(c) {&(c)->d_mask, &(c)->sample_rate, &(c)->num_samples, &(c)->pretrig_cnt, &(c)->lvl0mask, \
+                          &(c)->lvl1mask, &(c)->risemask, &(c)->fallmask, &(c)->chgmask}
+
+uint32_t sr_config_pack(const sr_config_t *c, uint8_t *out) {
+  const uint32_t *values[CONFIG_VALUE_CNT] = CONFIG_VALUES(c);
+  uint32_t len = 0;
+  for (uint32_t v = 0; v < CONFIG_VALUE_CNT; v++) {
+    uint32_t value = *values[v];
+    for (uint32_t b = 0; b < 5; b++) {
+      out[len++] = 0x80 | (value & 0x7F);
+      value >>= 7;
+    }
+  }
+  out[len++] = 0x80 | (c->a_mask & 0x7F);
+  out[len++] = 0x80 | (c->flags & 0x7F);
+  return len;
+}
+
+bool sr_config_unpack(sr_config_t *c, const uint8_t *in, uint32_t len) {
+  uint32_t *values[CONFIG_VALUE_CNT] = CONFIG_VALUES(c);
+  if (len != SR_CONFIG_LEN) {
+    return false;
+  }
+  for (uint32_t i = 0; i < len; i++) {
+    if (!(in[i] & 0x80)) {
+      return false;
+    }
+  }
+  for (uint32_t v = 0; v < CONFIG_VALUE_CNT; v++) {
+    *values[v] = 0;
+    for (uint32_t b = 0; b < 5; b++) {
+      *values[v] |= (uint32_t)(in[v * 5 + b] & 0x7F) << (7 * b);
+    }
+  }
+  c->a_mask = in[CONFIG_VALUE_CNT * 5] & 0x7F;
+  c->flags = in[CONFIG_VALUE_CNT * 5 + 1] & 0x7F;
+  return true;
+}
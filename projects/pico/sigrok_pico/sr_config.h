@@ -0,0 +1,56 @@
+#ifndef _SR_CONFIG_H_
+#define _SR_CONFIG_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// ------------------------------------
+// Binary capture configuration
+//
+// The ASCII commands set one thing each and are acked one at a time, so a
+// host enabling many channels waits dozens of USB round trips before the
+// capture starts. The B command instead carries the whole configuration of a
+// capture in one line, as sr_config_pack writes it, and starts it.
+//
+// Every byte of the message has bit 7 set, as in the wire formats, so it can
+// never be a line end, the '*' reset or the '+' that ends a continuous
+// capture. Values are sent 7 bits to a byte, least significant first, in the
+// order of sr_config_t: 5 bytes for each 32 bit value, then a byte for the
+// analog mask and one for the SR_CONFIG_* flags.
+// ------------------------------------
+
+// Mode flags, each the same as its ASCII command
+#define SR_CONFIG_CONTINUOUS 0x01  // C rather than F
+#define SR_CONFIG_STORE 0x02       // Z1
+#define SR_CONFIG_TRANSITIONS 0x04 // M1
+#define SR_CONFIG_A_12BIT 0x08     // W1
+#define SR_CONFIG_A_DELTA 0x10     // E1
+#define SR_CONFIG_OVERSAMPLE 0x20  // O1
+#define SR_CONFIG_GAPS 0x40        // G1
+
+// Bytes of a packed configuration, after the B
+#define SR_CONFIG_LEN 47
+
+typedef struct sr_config {
+  uint32_t d_mask;      // Dxyy
+  uint32_t sample_rate; // R
+  uint32_t num_samples; // L
+  uint32_t pretrig_cnt; // p
+  uint32_t lvl0mask;    // t0xx
+  uint32_t lvl1mask;    // t1xx
+  uint32_t risemask;    // trxx
+  uint32_t fallmask;    // tfxx
+  uint32_t chgmask;     // texx
+  uint8_t a_mask;       // Axyy, 7 bits
+  uint8_t flags;        // SR_CONFIG_*
+} sr_config_t;
+
+// Write c to out as SR_CONFIG_LEN bytes. Returns the length.
+uint32_t sr_config_pack(const sr_config_t *c, uint8_t *out);
+
+// Read a configuration of len bytes. Returns false if len is not
+// SR_CONFIG_LEN or a byte doesn't have bit 7 set. The values themselves are
+// checked by the device.
+bool sr_config_unpack(sr_config_t *c, const uint8_t *in, uint32_t len);
+
+#endif // _SR_CONFIG_H_
@@ -0,0 +1,27 @@
+#include "sr_decimate.h"
+
+// A boxcar over each ratio values of a channel, as there is no room for a longer filter at the
+// ADC rate. The output is never ahead of the input, so it can overwrite the values already summed.
+void sr_decimate(uint8_t *buf, uint32_t slices, uint8_t a_chan_cnt, uint32_t ratio, uint8_t a_bps) {
+  const uint16_t *in = (const uint16_t *)buf;
+  uint16_t *out16 = (uint16_t *)buf;
+  uint32_t shift = __builtin_ctz(ratio);
+  uint32_t acc[3];
+  for (uint32_t s = 0; s < slices; s++) {
+    for (uint8_t c = 0; c < a_chan_cnt; c++) {
+      acc[c] = 0;
+    }
+    for (uint32_t k = 0; k < ratio; k++) {
+      for (uint8_t c = 0; c < a_chan_cnt; c++) {
+        acc[c] += *in++;
+      }
+    }
+    for (uint8_t c = 0; c < a_chan_cnt; c++) {
+      if (a_bps == 2) {
+        *out16++ = (acc[c] + (ratio >> 1)) >> shift;
+      } else {
+        *buf++ = acc[c] >> (shift + 4);
+      }
+    }
+  }
+}
@@ -0,0 +1,28 @@
+#ifndef _SR_DECIMATE_H_
+#define _SR_DECIMATE_H_
+
+#include <stdint.h>
+
+// ------------------------------------
+// Analog decimation
+//
+// At low sample rates the ADC can run faster than asked and the extra
+// conversions are averaged, which lowers the noise of every value sent without
+// sending more of them. The ADC then fills its ring with ratio slices of 12 bit
+// values for each slice sent, and before a segment is encoded core1 averages
+// them into a slice of values in the format the encoders expect. Like the
+// encoders it doesn't depend on the pico-sdk, so it is tested on the host.
+// ------------------------------------
+
+// Largest averaging ratio, which gives 2 more bits below the noise of the ADC
+// and keeps the ring a reasonable size. Must be a power of 2.
+#define SR_DECIMATE_MAX 16
+
+// Average each ratio consecutive slices of a_chan_cnt 12 bit values in buf into
+// one, in place. buf holds slices*ratio slices, and ratio is a power of 2 up to
+// SR_DECIMATE_MAX. The slices averaged are left at the start of buf, rounded to
+// 16 bit values if a_bps is 2, or cut to 8 bit ones like the ADC FIFO byte
+// shift does if a_bps is 1.
+void sr_decimate(uint8_t *buf, uint32_t slices, uint8_t a_chan_cnt, uint32_t ratio, uint8_t a_bps);
+
+#endif // _SR_DECIMATE_H_
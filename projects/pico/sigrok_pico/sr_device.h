@@ -1,6 +1,11 @@
 #include <string.h>
 
 #include "stdarg.h"
+#include "sr_config.h"
+#include "sr_decimate.h"
+#include "sr_protocol.h"
+#include "sr_trigger.h"
+#include "sr_usb.h"
 
 // ------------------------------------
 // Pin usage:
@@ -15,28 +20,16 @@
 // Number of analog channels
 #define NUM_ANALOG_CHANNELS 3
 
+// Fastest conversion rate of the ADC in Hz, shared by the enabled channels
+#define ADC_MAX_RATE 500000
+
 // Mask of bits 22:2 to use as inputs
 #define GPIO_DIGITAL_MASK 0x7FFFFC
 
-// Storage size of the DMA buffer. The buffer is split into two halves so that
-// when the first buffer fills we can send the trace data serially while the
-// other buffer is DMA'd into.
-#define DMA_BUFFER_SIZE 220000
-
-// The size of the buffer sent to the CDC serial. The TUD CDC buffer is only
-// 256B so it doesn't help to have more than this.
-#define TX_BUFFER_SIZE 260
-
-// This sets the point which we will send data from the txbuf to the USB CDC.
-// For the 5-21 channel RLE, it must leave a spare ~83 entries to cover the case
-// where a new long steady input comes after deciding to not send a sample.
-// (Assuming 128KB samples per half, a max RLE value of 1568 we can get
-// 256*1024/2/1568=83 max length RLEs on a steady input). Other than that, the
-// value is not very specific because the usb tub code implements a 256 entry
-// fifo that queues things up and sends max length 64B transactions. The value
-// 20 is arbitrarly picked to ensure that if we have even a little we send it so
-// that at least something goes across the link.
-#define TX_BUFFER_THRESHOLD 20
+// Heap left free for dynamic allocations after the DMA buffer. The buffer
+// takes the rest of the striped SRAM and is split into segments so that we
+// can send the trace data serially while the other segments are DMA'd into.
+#define HEAP_RESERVE 10000
 
 // The baud rate used to communicate with the host.
 #define UART_BAUD 921600
@@ -85,35 +78,80 @@ int debug_printf(const char *fmt, ...) {
 // ------------------------------------
 // Sigrok device
 
+// Causes of an abort, see sr_capture_stats_t
+#define SR_ABORT_PIO 1   // The PIO FIFO overflowed, as the digital ring was full
+#define SR_ABORT_ADC 2   // The ADC FIFO overflowed, as the analog ring was full
+#define SR_ABORT_BURST 4 // Samples were lost while taking a burst capture
+#define SR_ABORT_REFUSE 8 // The capture can't be taken as configured, so it wasn't started
+#define SR_ABORT_PRETRIG 16 // The rings lapped the first pre-trigger sample before they were stopped
+
+// Health of the current or last capture, reported by the 'S' command. Core1 updates it as it
+// encodes, so a report during a capture may mix the counts of two segments.
+typedef struct sr_capture_stats {
+  uint32_t arm_us;        // Time to set up the capture before the PIO and ADC start
+  uint32_t segs;          // Segments encoded
+  uint32_t enc_us_max;    // Longest time encoding a segment
+  uint32_t enc_us_total;  // Time encoding all of them
+  uint32_t lag_us_max;    // Longest wait of a completed segment for the encoder
+  uint32_t seg_bytes_max; // Most bytes handed to the USB while encoding a segment
+  uint32_t ram_bytes;     // Bytes the encoded segments held in the rings
+  uint32_t wire_bytes;    // Bytes handed to the USB
+  uint32_t gaps;          // Gap markers sent in place of dropped segments
+  uint32_t gap_samples;   // Samples they dropped, counting the segments cut short whole
+  uint32_t trig_at;       // Samples sent before the trigger sample of a pre-trigger capture
+  uint32_t stored;        // Samples a stored capture kept, fewer than asked for if the store filled up
+  uint8_t ring_free_min;  // Fewest free segments the DMA had left, unless the capture fit in RAM
+  uint8_t abort;          // SR_ABORT_* causes of the abort, 0 if none
+} sr_capture_stats_t;
+
 typedef struct sigrok_device {
   uint32_t a_mask;           // ???
-  uint32_t a_size;           // Size of the analog data buffer
+  uint32_t a_size;           // Size of each analog ring segment
   uint32_t d_mask;           // ???
-  uint32_t d_size;           // Size of the digital data buffer
+  uint32_t d_size;           // Size of each digital ring segment
   uint32_t num_samples;      // Number of samples to measure
   uint32_t sample_rate;      // Sample rate of the device in Hz
-  uint32_t samples_per_half; // Number of samples for one of the 4 dma target arrays
+  uint32_t samples_per_seg;  // Number of samples in each ring segment
   uint32_t sent_cnt;         // Number of samples sent
   uint8_t a_chan_cnt;        // Count of enabled analog channels
+  uint8_t a_bps;             // Analog bytes stored per value, 2 with 12 bit values else 1
+  uint8_t a_ratio;           // ADC conversions averaged into each analog value, see sr_decimate
+  uint16_t a_slice_bytes;    // Analog ring bytes per slice, before any decimation
   uint8_t d_chan_cnt;        // Count of enabled digital channels
   uint8_t d_nps;             // Digital nibbles per slice from a PIO/DMA perspective
   uint8_t d_tx_bps;          // Digital transmit bytes per slice
-  uint8_t pin_count;         // Pins sampled by the PIO (4,8,16 or 32)
+  uint8_t pin_count;         // Pins sampled by the PIO (4,8,16 or 32, or 5,6,9 or 10 when packed)
+  uint8_t pack_bits;         // pin_count when the PIO packs 32/pin_count samples per word, else 0
+  uint8_t d_shift;           // Lowest channel sampled by the PIO
+
+  uint32_t dbuf_start; // Starting memory pointers of the rings
+  uint32_t abuf_start; //
 
-  uint32_t dbuf0_start; // Starting memory pointers of buffers
-  uint32_t dbuf1_start; //
-  uint32_t abuf0_start; //
-  uint32_t abuf1_start; //
+  uint32_t lvl0mask; // Trigger channels that must be low
+  uint32_t lvl1mask; // Trigger channels that must be high
+  uint32_t risemask; // Trigger channel that must rise
+  uint32_t fallmask; // Trigger channel that must fall
+  uint32_t chgmask;  // Trigger channel that must change
+  uint32_t pretrig_cnt; // Samples to send from before the trigger
 
-  char cmdstr[20]; // Used for parsing commands input
+  char cmdstr[64]; // Used for parsing commands input, long enough for a B configuration
   char cmdstrptr;  // Index within the input command buffer
 
-  char rspstr[20]; // Used for storing commands output
+  char rspstr[512]; // Used for storing commands output
 
   volatile bool started;    // Started flag
   volatile bool sending;    // Sending flag
   volatile bool aborted;    // Aborted flag
   volatile bool continuous; // Continuous mode flag
+  bool vendor_tx;           // Send capture data on the vendor bulk interface rather than the CDC serial
+  bool store;               // Keep streamed fixed captures encoded in spare capture RAM
+  bool transitions;         // Capture only the changes of the digital channels, see transition_check
+  bool a_12bit;             // Send all 12 bits of the analog values rather than the top 7
+  bool a_delta;             // Send analog values as differences, see sr_send_slices_analog_delta
+  bool oversample;          // Run the ADC faster than the sample rate and average, see sr_decimate
+  bool gaps;                // Drop samples of a continuous capture that falls behind rather than abort it
+  sr_protocol_t protocol;   // Bus to decode into frames rather than sending samples, see sr_protocol.h
+  sr_capture_stats_t stats; // Health of the current or last capture
 } sigrok_device_t;
 
 // Reset as part of init, or on a completed send
@@ -123,6 +161,12 @@ void reset(sigrok_device_t *d) {
   d->aborted = false;
   d->continuous = 0;
   d->sent_cnt = 0;
+  d->lvl0mask = 0;
+  d->lvl1mask = 0;
+  d->risemask = 0;
+  d->fallmask = 0;
+  d->chgmask = 0;
+  d->pretrig_cnt = 0;
 };
 
 // Initial post reset state
@@ -135,6 +179,14 @@ void init(sigrok_device_t *d) {
   d->a_chan_cnt = 0;
   d->d_nps = 0;
   d->cmdstrptr = 0;
+  d->vendor_tx = false;
+  d->store = false;
+  d->transitions = false;
+  d->a_12bit = false;
+  d->a_delta = false;
+  d->oversample = false;
+  d->gaps = false;
+  d->protocol.kind = SR_PROTOCOL_NONE;
 }
 
 // Initialize the the transmission
@@ -150,6 +202,19 @@ void tx_init(sigrok_device_t *d) {
     }
   }
 
+  // The ADC FIFO gives 12 bit values, which are kept whole in 16 bits or shifted to 8
+  d->a_bps = d->a_12bit ? 2 : 1;
+
+  // Oversampling doubles the ADC rate for as long as it fits, and the ring then keeps every
+  // conversion in 16 bits until core1 averages them
+  d->a_ratio = 1;
+  if (d->oversample && d->a_chan_cnt) {
+    while ((d->a_ratio < SR_DECIMATE_MAX) && ((uint64_t)d->sample_rate * d->a_chan_cnt * d->a_ratio * 2 <= ADC_MAX_RATE)) {
+      d->a_ratio <<= 1;
+    }
+  }
+  d->a_slice_bytes = d->a_chan_cnt * ((d->a_ratio > 1) ? 2 * d->a_ratio : d->a_bps);
+
   // Nibbles per slice controls how PIO digital data is stored. Only supports
   // 0,1,2,4 or 8, which use 0,4,8,16 or 32 bits of PIO fifo data per sample
   // clock.
@@ -165,8 +230,9 @@ void tx_init(sigrok_device_t *d) {
     d->d_nps = 2;
   }
 
-  // Digital channels must enable from D0 and go up, but that is checked by the
-  // host.
+  // The host enables digital channels from D0 up, but any mask works here. The
+  // channels are sent at their own bit positions, so the width on the wire is set
+  // by the highest one.
   d->d_chan_cnt = 0;
   for (int i = 0; i < NUM_DIGITAL_CHANNELS; i++) {
     if (((d->d_mask) >> i) & 1) {
@@ -174,8 +240,29 @@ void tx_init(sigrok_device_t *d) {
     }
   }
 
+  uint8_t low = d->d_mask ? __builtin_ctz(d->d_mask) : 0;      // lowest enabled channel
+  uint8_t top = d->d_mask ? 32 - __builtin_clz(d->d_mask) : 0; // highest enabled channel + 1
+
   // Set the device baud rate.
-  d->d_tx_bps = (d->d_chan_cnt + 6) / 7;
+  d->d_tx_bps = (top + 6) / 7;
+
+  // The PIO samples pin_count pins per sample clock. It is kept to a power of 2 so that
+  // samples are read with a single byte/word/dword access, but without analog channels
+  // 5, 6, 9 or 10 channels are packed 32/n samples to a word instead, which makes up to
+  // 1.5x more samples fit in the capture buffer.
+  // Channels below the lowest enabled one aren't sampled at all, so that for instance
+  // D12-D15 take 4 bits per sample like D0-D3. Those captures are always packed.
+  d->pin_count = d->d_nps * 4;
+  d->pack_bits = 0;
+  d->d_shift = 0;
+  if ((d->a_chan_cnt == 0) && (low > 0)) {
+    d->pin_count = top - low;
+    d->pack_bits = top - low;
+    d->d_shift = low;
+  } else if ((d->a_chan_cnt == 0) && ((top == 5) || (top == 6) || (top == 9) || (top == 10))) {
+    d->pin_count = top;
+    d->pack_bits = top;
+  }
 
   // Enable sending mode.
   d->sending = true;
@@ -223,7 +310,11 @@ int process_cmd(sigrok_device_t *d, char c) {
     if (tmpint >= 0) {
       // scale and offset are both in integer uVolts
       // separated by x
-      sprintf(d->rspstr, "25700x0"); // 3.3/(2^7) and 0V offset
+      if (d->a_12bit) {
+        sprintf(d->rspstr, "806x0"); // 3.3/(2^12) and 0V offset
+      } else {
+        sprintf(d->rspstr, "25700x0"); // 3.3/(2^7) and 0V offset
+      }
       ret = 1;
     } else {
       debug_printf("bad ascale %s\n\r", d->cmdstr);
@@ -245,14 +336,85 @@ int process_cmd(sigrok_device_t *d, char c) {
     ret = 0;
     break;
 
-  case 't': // trigger -format tvxx where v is value and xx is two digit channel
-    ret = 1;
+  // format is B followed by the SR_CONFIG_LEN bytes of sr_config_pack (see sr_config.h). It sets the channels,
+  // rate, sample limit, trigger and modes in one go, replacing the previous ones, and starts the capture as F or
+  // C would. It is acked with '*' ahead of the samples, and if any value is bad nothing is changed or started.
+  case 'B': {
+    sr_config_t cfg;
+    uint16_t instr[SR_TRIGGER_MAX_INSTR];
+    ret = 0;
+    if (sr_config_unpack(&cfg, (const uint8_t *)&d->cmdstr[1], d->cmdstrptr - 1) && (cfg.sample_rate >= 5000) &&
+        (cfg.sample_rate <= 120000016) && ((int32_t)cfg.num_samples > 0) && ((int32_t)cfg.pretrig_cnt >= 0) &&
+        ((cfg.d_mask >> NUM_DIGITAL_CHANNELS) == 0) && ((cfg.a_mask >> NUM_ANALOG_CHANNELS) == 0) &&
+        (((cfg.lvl0mask | cfg.lvl1mask | cfg.risemask | cfg.fallmask | cfg.chgmask) >> NUM_DIGITAL_CHANNELS) == 0) &&
+        (sr_trigger_program(instr, cfg.lvl0mask, cfg.lvl1mask, cfg.risemask, cfg.fallmask, cfg.chgmask) >= 0)) {
+      d->d_mask = cfg.d_mask;
+      d->a_mask = cfg.a_mask;
+      d->sample_rate = cfg.sample_rate;
+      d->num_samples = cfg.num_samples;
+      d->pretrig_cnt = cfg.pretrig_cnt;
+      d->lvl0mask = cfg.lvl0mask;
+      d->lvl1mask = cfg.lvl1mask;
+      d->risemask = cfg.risemask;
+      d->fallmask = cfg.fallmask;
+      d->chgmask = cfg.chgmask;
+      d->store = (cfg.flags & SR_CONFIG_STORE) != 0;
+      d->transitions = (cfg.flags & SR_CONFIG_TRANSITIONS) != 0;
+      d->a_12bit = (cfg.flags & SR_CONFIG_A_12BIT) != 0;
+      d->a_delta = (cfg.flags & SR_CONFIG_A_DELTA) != 0;
+      d->oversample = (cfg.flags & SR_CONFIG_OVERSAMPLE) != 0;
+      d->gaps = (cfg.flags & SR_CONFIG_GAPS) != 0;
+      tx_init(d);
+      d->continuous = (cfg.flags & SR_CONFIG_CONTINUOUS) != 0;
+      debug_printf("STRT_BIN %s D 0x%X A 0x%X R %u L %u\n\r", d->continuous ? "cont" : "fix", d->d_mask, d->a_mask,
+                   d->sample_rate, d->num_samples);
+      ret = 1;
+    } else {
+      debug_printf("bad config len %d\n\r", d->cmdstrptr - 1);
+    }
+    break;
+  }
+
+  // trigger -format tvxx where v is value and xx is two digit channel
+  // v is 0 or 1 for a level, r or f for a rising or falling edge and e for either edge.
+  // All conditions must hold on the same sample, and only one channel can have an edge (see sr_trigger.h).
+  case 't':
+    tmpint = d->cmdstr[1];
+    tmpint2 = atoi(&(d->cmdstr[2]));
+    if ((tmpint2 >= 0) && (tmpint2 < NUM_DIGITAL_CHANNELS)) {
+      uint32_t bit = 1 << tmpint2;
+      uint32_t masks[5] = {d->lvl0mask & ~bit, d->lvl1mask & ~bit, d->risemask & ~bit, d->fallmask & ~bit, d->chgmask & ~bit};
+      const char *v = strchr("01rfe", tmpint);
+      uint16_t instr[SR_TRIGGER_MAX_INSTR];
+      ret = 0;
+      if (v && tmpint) {
+        masks[v - "01rfe"] |= bit;
+        if (sr_trigger_program(instr, masks[0], masks[1], masks[2], masks[3], masks[4]) > 0) {
+          d->lvl0mask = masks[0];
+          d->lvl1mask = masks[1];
+          d->risemask = masks[2];
+          d->fallmask = masks[3];
+          d->chgmask = masks[4];
+          ret = 1;
+        }
+      }
+    } else {
+      ret = 0;
+    }
+    if (ret == 0) {
+      debug_printf("bad trigger %s\n\r", d->cmdstr);
+    }
     break;
 
   case 'p': // pretrigger count
     tmpint = atoi(&(d->cmdstr[1]));
     debug_printf("Pre-trigger samples %d cmd %s\n\r", tmpint, d->cmdstr);
-    ret = 1;
+    if (tmpint >= 0) {
+      d->pretrig_cnt = tmpint;
+      ret = 1;
+    } else {
+      ret = 0;
+    }
     break;
 
   // format is Axyy where x is 0 for disabled, 1 for enabled and yy is channel #
@@ -283,6 +445,156 @@ int process_cmd(sigrok_device_t *d, char c) {
     }
     break;
 
+  // format is Zx where x is 1 to queue the encoded samples of a fixed capture that doesn't fit in RAM
+  // in the spare capture buffer, and 0 to stream them through the small USB blocks.
+  case 'Z':
+    tmpint = d->cmdstr[1] - '0';
+    if ((tmpint >= 0) && (tmpint <= 1)) {
+      d->store = tmpint;
+      debug_printf("Store %d\n\r", tmpint);
+      ret = 1;
+    } else {
+      ret = 0;
+    }
+    break;
+  // format is Mx where x is 1 to capture only the changes of the digital channels, see sr_transition.h
+  case 'M':
+    tmpint = d->cmdstr[1] - '0';
+    if ((tmpint >= 0) && (tmpint <= 1)) {
+      d->transitions = tmpint;
+      debug_printf("Transitions %d\n\r", tmpint);
+      ret = 1;
+    } else {
+      ret = 0;
+    }
+    break;
+
+  // format is Wx where x is 1 to send the analog channels as 12 bit values in two bytes, or 0 for 7 bits
+  // in one. The 'a' scale follows it, so the host must send it first.
+  case 'W':
+    tmpint = d->cmdstr[1] - '0';
+    if ((tmpint >= 0) && (tmpint <= 1)) {
+      d->a_12bit = tmpint;
+      debug_printf("Analog 12 bit %d\n\r", tmpint);
+      ret = 1;
+    } else {
+      ret = 0;
+    }
+    break;
+
+  // format is Ex where x is 1 to send the analog values as differences from the previous ones, with runs
+  // of repeated slices, and 0 to send every value whole
+  case 'E':
+    tmpint = d->cmdstr[1] - '0';
+    if ((tmpint >= 0) && (tmpint <= 1)) {
+      d->a_delta = tmpint;
+      debug_printf("Analog delta %d\n\r", tmpint);
+      ret = 1;
+    } else {
+      ret = 0;
+    }
+    break;
+
+  // format is Ox where x is 1 to average as many ADC conversions per analog value as the ADC rate allows,
+  // up to SR_DECIMATE_MAX, or 0 for a single one
+  case 'O':
+    tmpint = d->cmdstr[1] - '0';
+    if ((tmpint >= 0) && (tmpint <= 1)) {
+      d->oversample = tmpint;
+      debug_printf("Analog oversample %d\n\r", tmpint);
+      ret = 1;
+    } else {
+      ret = 0;
+    }
+    break;
+
+  // format is Gx where x is 1 to let a continuous capture that falls behind drop segments and send
+  // a "#<next>+" gap marker in their place, and 0 to abort it
+  case 'G':
+    tmpint = d->cmdstr[1] - '0';
+    if ((tmpint >= 0) && (tmpint <= 1)) {
+      d->gaps = tmpint;
+      debug_printf("Gaps %d\n\r", tmpint);
+      ret = 1;
+    } else {
+      ret = 0;
+    }
+    break;
+
+  // format is P0 to send samples, or Pu<rx>,<baud> for a UART, Ps<clk>,<mosi>,<miso>,<cs>,<mode> for SPI with -1
+  // for no MISO or CS, and Pi<scl>,<sda> for I2C to send the frames of that bus instead (see sr_protocol.h).
+  // The numbers are digital channels, which must also be enabled, or the capture is refused with "!!!".
+  case 'P':
+    ret = 0;
+    if (d->cmdstr[1] == '0') {
+      d->protocol.kind = SR_PROTOCOL_NONE;
+      ret = 1;
+    } else {
+      int v[5] = {-1, -1, -1, -1, -1};
+      int n = sscanf(&(d->cmdstr[2]), "%d,%d,%d,%d,%d", &v[0], &v[1], &v[2], &v[3], &v[4]);
+      int roles = (d->cmdstr[1] == 's') ? 4 : (d->cmdstr[1] == 'i') ? 2 : 1;
+      bool chs = (v[0] >= 0);
+      for (int i = 0; i < roles; i++) {
+        chs = chs && (v[i] >= -1) && (v[i] < NUM_DIGITAL_CHANNELS);
+      }
+      if ((d->cmdstr[1] == 'u') && (n == 2) && chs && (v[1] > 0)) {
+        d->protocol.kind = SR_PROTOCOL_UART;
+        d->protocol.baud = v[1];
+        v[1] = -1;
+        ret = 1;
+      } else if ((d->cmdstr[1] == 's') && (n == 5) && chs && (v[1] >= 0) && (v[4] >= 0) && (v[4] <= 3)) {
+        d->protocol.kind = SR_PROTOCOL_SPI;
+        d->protocol.spi_mode = v[4];
+        ret = 1;
+      } else if ((d->cmdstr[1] == 'i') && (n == 2) && chs && (v[1] >= 0) && (v[0] != v[1])) {
+        d->protocol.kind = SR_PROTOCOL_I2C;
+        ret = 1;
+      }
+      if (ret) {
+        for (int i = 0; i < 4; i++) {
+          d->protocol.ch[i] = (v[i] >= 0) ? v[i] : SR_PROTOCOL_NO_CH;
+        }
+      }
+    }
+    debug_printf("Protocol %s %s\n\r", ret ? "set" : "bad", d->cmdstr);
+    break;
+
+  // Status of the current or last capture as space separated name=value counters, see sr_capture_stats_t.
+  // The ratio is of the ring bytes to the bytes sent. During a capture on the CDC serial the reply waits
+  // for the end of the capture, as it would otherwise land in the samples.
+  case 'S':
+    if (d->cmdstr[1] == 0) {
+      sr_capture_stats_t *s = &d->stats;
+      uint32_t stalls, stall_us, dropped;
+      sr_usb_tx_stalls(&stalls, &stall_us, &dropped);
+      uint32_t ratio = s->wire_bytes ? (uint32_t)((uint64_t)s->ram_bytes * 100 / s->wire_bytes) : 0;
+      snprintf(d->rspstr, sizeof(d->rspstr),
+               "arm_us=%u segs=%u enc_us_max=%u enc_us_avg=%u lag_us_max=%u seg_bytes_max=%u ram=%u wire=%u ratio=%u.%02u "
+               "usb_stalls=%u usb_stall_us=%u usb_dropped=%u ring_free_min=%u gaps=%u gap_samples=%u trig_at=%u stored=%u abort=%u sent=%u",
+               s->arm_us, s->segs, s->enc_us_max, s->segs ? s->enc_us_total / s->segs : 0, s->lag_us_max, s->seg_bytes_max,
+               s->ram_bytes, s->wire_bytes, ratio / 100, ratio % 100, stalls, stall_us, dropped, s->ring_free_min,
+               s->gaps, s->gap_samples, s->trig_at, s->stored, s->abort, d->sent_cnt);
+      ret = 1;
+    } else {
+      ret = 0;
+    }
+    break;
+
+#ifdef SR_USB_VENDOR
+  // format is Vx where x is 1 to send capture data on the vendor bulk interface and 0 for the CDC serial.
+  // Firmware built without the interface treats it as a bad command, so a host that gets no ack keeps using the CDC.
+  case 'V':
+    tmpint = d->cmdstr[1] - '0';
+    if ((tmpint >= 0) && (tmpint <= 1)) {
+      d->vendor_tx = tmpint;
+      debug_printf("Vendor tx %d\n\r", tmpint);
+      ret = 1;
+    } else {
+      ret = 0;
+    }
+    break;
+#endif
+
   default:
     debug_printf("bad command %s\n\r", d->cmdstr);
     ret = 0;
@@ -309,8 +621,8 @@ int process_char(sigrok_device_t *d, char c) {
   } else if ((c == '\r') || (c == '\n')) {
     ret = process_cmd(d, c);
   } else { // no CR/LF
-    if (d->cmdstrptr >= 19) {
-      d->cmdstr[18] = 0;
+    if (d->cmdstrptr >= sizeof(d->cmdstr) - 1) {
+      d->cmdstr[sizeof(d->cmdstr) - 2] = 0;
       debug_printf("Command overflow %s\n\r", d->cmdstr);
       d->cmdstrptr = 0;
     }
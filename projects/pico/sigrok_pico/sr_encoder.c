@@ -0,0 +1,668 @@
+#include "sr_encoder.h"
+
+#include <string.h>
+
+// Get the block to encode into, if the previous segment did not leave one
+static inline uint8_t *tx_begin(sr_encoder_t *e) {
+  if (e->txbuf == NULL) {
+    e->txbuf = e->tx_get(e->tx_ctx);
+  }
+  return e->txbuf;
+}
+
+// Hand the first len bytes of the block to the transport and continue in a new one.
+// Returns the new txbuf index.
+static inline uint32_t tx_flush(sr_encoder_t *e, uint8_t **txbuf, uint32_t len) {
+  e->tx_put(e->tx_ctx, *txbuf, len);
+  e->ccnt += len;
+  *txbuf = e->txbuf = e->tx_get(e->tx_ctx);
+  return 0;
+}
+
+// Hand over what is left at the end of a segment. An empty block is kept for the next one.
+static inline void tx_end(sr_encoder_t *e, uint8_t *txbuf, uint32_t len) {
+  if (len) {
+    e->tx_put(e->tx_ctx, txbuf, len);
+    e->ccnt += len;
+    e->txbuf = NULL;
+  }
+  e->txbufidx = 0;
+}
+
+// Send a digital sample of multiple bytes with the 7 bit encoding
+static inline uint32_t tx_d_samp(uint8_t *txbuf, uint32_t txbufidx, uint32_t cval, uint8_t d_tx_bps) {
+  for (uint8_t b = 0; b < d_tx_bps; b++) {
+    txbuf[txbufidx++] = (cval | 0x80);
+    cval >>= 7;
+  }
+  return txbufidx;
+}
+
+/*RLE encoding for 5-21 channels has two ranges.
+Decimal 48 to  79 are RLEs of 1 to 32 respectively.
+Decimal 80 to 127 are (N-78)*32 thus 64,96..80,120..1568
+Note that it is the responsibility of the caller to
+hand txbuf to the transport to prevent txbufidx from overflowing the size
+of txbuf. We do not always push to USB to reduce its impact
+on performance.
+ */
+static inline uint32_t check_rle(uint8_t *txbuf, uint32_t txbufidx, uint32_t rlecnt) {
+  while (rlecnt >= 1568) {
+    txbuf[txbufidx++] = 127;
+    rlecnt -= 1568;
+  }
+  if (rlecnt > 32) {
+    uint16_t rlediv = rlecnt >> 5;
+    txbuf[txbufidx++] = rlediv + 78; // was 86;
+    rlecnt -= rlediv << 5;
+  }
+  if (rlecnt) {
+    txbuf[txbufidx++] = 47 + rlecnt;
+  }
+  return txbufidx;
+}
+
+// Adjust the number of samples to send if there are more in the dma buffer
+// then we need.
+static inline uint32_t samples_to_send(sr_encoder_t *e, uint32_t samp_remain) {
+  if ((e->continuous == false) && ((e->sent_cnt + samp_remain) > (e->num_samples))) {
+    samp_remain = e->num_samples - e->sent_cnt;
+    e->sent_cnt += samp_remain;
+  } else {
+    e->sent_cnt += e->samples_per_seg;
+  }
+  return samp_remain;
+}
+
+// Send the RLE of the previous nibble followed by a new value in the D4 format.
+// If the value changes we must push all remaing rles to the txbuf.
+static inline uint32_t d4_change(uint8_t *txbuf, uint32_t txbufidx, uint32_t rlecnt, uint8_t nibcurr) {
+  // Send intermediate 8..632 RLEs
+  if (rlecnt > 7) {
+    int rlemid = rlecnt & 0x3F8;
+    txbuf[txbufidx++] = (rlemid >> 3) + 47;
+  }
+  // And finally the 0..7 rle along with the new value
+  rlecnt &= 0x7;
+  txbuf[txbufidx++] = 0x80 | nibcurr | rlecnt << 4;
+  return txbufidx;
+}
+
+// Runs are tracked across segments. At the start of a capture there is no previous value, so
+// lval is set to one that differs from the first sample, which is then sent as a change.
+static inline void rle_init(sr_encoder_t *e, uint32_t not_first) {
+  if (e->have_last == false) {
+    e->lval = not_first;
+    e->rlecnt = 0;
+    e->have_last = true;
+  }
+}
+
+// Common end of send_slices_1B/2B/4B. Send the maximal 1568 RLEs so that the host sees progress
+// on a steady input, flush txbuf, and keep the rest of the run for the next segment.
+static inline void rle_end_seg(sr_encoder_t *e, uint8_t *txbuf, uint32_t txbufidx, uint32_t lval, uint32_t rlecnt) {
+  while (rlecnt >= 1568) {
+    txbuf[txbufidx++] = 127;
+    rlecnt -= 1568;
+  }
+  tx_end(e, txbuf, txbufidx);
+  e->lval = lval;
+  e->rlecnt = rlecnt;
+}
+
+void sr_encoder_reset(sr_encoder_t *e) {
+  e->sent_cnt = 0;
+  e->ccnt = 0;
+  e->txbuf = NULL;
+  e->txbufidx = 0;
+  e->have_last = false;
+  e->lval = 0;
+  e->rlecnt = 0;
+  memset(e->a_last, 0, sizeof(e->a_last));
+}
+
+void sr_encoder_flush(sr_encoder_t *e) {
+  uint8_t *txbuf = tx_begin(e);
+  uint32_t txbufidx = e->txbufidx;
+  uint32_t rlecnt = e->rlecnt;
+  if (e->a_chan_cnt && !e->a_delta) {
+    // The analog format has no RLE so nothing is ever pending
+  } else if ((e->a_chan_cnt == 0) && (e->d_dma_bps == 0)) {
+    // Maximal 640 values first
+    while (rlecnt >= 640) {
+      txbuf[txbufidx++] = 127;
+      rlecnt -= 640;
+    }
+    // Middle rles 8..632
+    if (rlecnt > 7) {
+      int rleend = rlecnt & 0x3F8;
+      txbuf[txbufidx++] = (rleend >> 3) + 47;
+      rlecnt &= 0x7;
+    }
+    // 1..7 RLE
+    // The rle and value encoding counts as both a sample count of rle and a new sample
+    // thus we must decrement rlecnt by 1 and resend the current value which will match the previous values
+    //(if the current value didn't match, the rlecnt would be 0).
+    if (rlecnt) {
+      rlecnt--;
+      txbuf[txbufidx++] = 0x80 | e->lval | rlecnt << 4;
+    }
+  } else {
+    txbufidx = check_rle(txbuf, txbufidx, rlecnt);
+  }
+  tx_end(e, txbuf, txbufidx);
+  e->rlecnt = 0;
+}
+
+void sr_send_gap(sr_encoder_t *e, uint64_t next) {
+  char digits[20];
+  uint32_t ndigits = 0;
+  sr_encoder_flush(e);
+  uint8_t *txbuf = tx_begin(e);
+  uint32_t txbufidx = e->txbufidx;
+  do {
+    digits[ndigits++] = '0' + next % 10;
+    next /= 10;
+  } while (next);
+  txbuf[txbufidx++] = '#';
+  while (ndigits) {
+    txbuf[txbufidx++] = digits[--ndigits];
+  }
+  txbuf[txbufidx++] = '+';
+  // Hand it over now, the host may want to know before the next segment
+  tx_end(e, txbuf, txbufidx);
+  e->have_last = false;
+  memset(e->a_last, 0, sizeof(e->a_last));
+}
+
+void sr_encoder_cut(sr_encoder_t *e, uint32_t lost) {
+  e->ccnt -= lost;
+  e->txbuf = NULL;
+  e->txbufidx = 0;
+  e->rlecnt = 0;
+  e->have_last = false;
+}
+
+// This is an optimized transmit of trace data for configurations with 4 or fewer digital channels
+// and no analog.  Run length encoding (RLE) is used to send counts of repeated values to effeciently utilize
+// USB CDC link bandwidth.  This is the only mode where a given serial byte can have both sample information
+// and RLE counts.
+// Samples from PIO are dma'd in 32 bit words, each containing 8 samples of 4 bits (1 nibble).
+// RLE Encoding:
+// Values 0x80-0xFF encode an rle cnt of a previous value with a new value:
+//   Bit 7 is 1 to distinguish from the rle only values.
+//   Bits 6:4 indicate a run length up to 7 cycles of the previous value
+//   Bits 3:0 are the new value.
+// For longer runs, an RLE only encoding uses decimal values 48 to 127 (0x30 to 0x7F)
+// as x8 run length values of 8..640.
+// All other ascii values (except from the abort and the end of run byte_cnt) are reserved.
+void __attribute__((noinline)) sr_send_slices_D4(sr_encoder_t *e, const uint8_t *dbuf) {
+  const uint32_t *wbuf = (const uint32_t *)dbuf;
+  uint8_t *txbuf = tx_begin(e);
+  uint8_t nibcurr, niblast;
+  uint32_t cword, rep;
+  uint32_t txbufidx = 0, rlecnt, samp_remain, nwords, w;
+  // If in fixed sample (non-continous mode) only send the amount of samples requested
+  samp_remain = samples_to_send(e, e->samples_per_seg);
+  nwords = samp_remain >> 3;
+  // Pick up the run from the previous segment. The first sample of a capture has nothing to
+  // run on from, so pretend the previous value differs from it and it is sent as a change.
+  rle_init(e, ~wbuf[0] & 0xF);
+  niblast = e->lval;
+  rlecnt = e->rlecnt;
+  // A word matching rep is eight more samples of the current run
+  rep = niblast * 0x11111111u;
+  // Process one  word (8 samples) at a time.
+  for (w = 0; w < nwords; w++) {
+    cword = wbuf[w];
+    // Send maximal RLE counts in this outer section to the txbuf, and if we accumulate a block of them
+    // push to the device so that we don't accumulate large numbers
+    // of unsent RLEs.  That allows the host to process them gradually rather than in a flood
+    // when we get a value change.
+    while (rlecnt >= 640) {
+      txbuf[txbufidx++] = 127;
+      rlecnt -= 640;
+      if (txbufidx >= TX_BUFFER_THRESHOLD) {
+        txbufidx = tx_flush(e, &txbuf, txbufidx);
+      }
+    }
+    // Coarse rle looks across the full word and allows a faster compare in cases with low activity factors
+    if (cword == rep) {
+      rlecnt += 8;
+    } else { // if coarse rle didn't match
+      for (int j = 0; j < 8; j++) { // process all 8 nibbles
+        nibcurr = cword & 0xF;
+        if (nibcurr == niblast) {
+          rlecnt++;
+        } else {
+          txbufidx = d4_change(txbuf, txbufidx, rlecnt, nibcurr);
+          rlecnt = 0;
+        }
+        cword >>= 4;
+        niblast = nibcurr;
+      } // for j
+      rep = niblast * 0x11111111u;
+    }   // else (not a coarse rle )
+    // Each word adds at most 16 bytes, well within the margin above the threshold
+    if (txbufidx >= TX_BUFFER_THRESHOLD) {
+      txbufidx = tx_flush(e, &txbuf, txbufidx);
+    }
+  } // for w in samp_remain>>3
+  // In fixed mode the last segment may end part way through a word
+  if (samp_remain & 7) {
+    while (rlecnt >= 640) {
+      txbuf[txbufidx++] = 127;
+      rlecnt -= 640;
+    }
+    cword = wbuf[nwords];
+    for (uint32_t j = 0; j < (samp_remain & 7); j++) {
+      nibcurr = cword & 0xF;
+      if (nibcurr == niblast) {
+        rlecnt++;
+      } else {
+        txbufidx = d4_change(txbuf, txbufidx, rlecnt, nibcurr);
+        rlecnt = 0;
+      }
+      cword >>= 4;
+      niblast = nibcurr;
+    }
+  }
+  // Send the maximal 640 values so that the host sees progress on a steady input, the rest of the
+  // run carries over to the next segment and is sent by sr_encoder_flush at the end of the capture.
+  while (rlecnt >= 640) {
+    txbuf[txbufidx++] = 127;
+    rlecnt -= 640;
+  }
+  tx_end(e, txbuf, txbufidx);
+  e->lval = niblast;
+  e->rlecnt = rlecnt;
+} // sr_send_slices_D4
+
+// Process one sample of the 5-21 channel formats: either extend the current run
+// or send the pending RLE followed by the new value, moved up to the channel of its bit 0.
+// txbuf and d_tx_bps are passed in rather than read from e, as otherwise every byte written to
+// txbuf forces them to be reloaded.
+static inline uint32_t rle_sample(sr_encoder_t *e, uint8_t **txbuf, uint32_t txbufidx, uint32_t cval, uint32_t *lval, uint32_t *rlecnt, uint8_t d_tx_bps, uint8_t shift) {
+  if (cval == *lval) {
+    (*rlecnt)++;
+  } else {
+    txbufidx = check_rle(*txbuf, txbufidx, *rlecnt);
+    *rlecnt = 0;
+    txbufidx = tx_d_samp(*txbuf, txbufidx, cval << shift, d_tx_bps);
+    if (txbufidx >= TX_BUFFER_THRESHOLD) {
+      txbufidx = tx_flush(e, txbuf, txbufidx);
+    }
+    *lval = cval;
+  }
+  return txbufidx;
+}
+
+// There are three very similar functions send_slices_1B/2B/4B.
+// Each of which  is very similar but exist because if a common function
+// is used with a generic sample read in the inner loop, the performance drops
+// substantially.  Thus each function has a 1,2, or 4B aligned read respectively.
+// We can just always read a 4B value because the core doesn't support non-aligned accesses.
+// These must be marked noinline to ensure they remain separate functions for good performance
+// 1B and 2B read a whole 32 bit word (4 or 2 samples) at a time and compare it against the
+// last value replicated across the word, similar to the coarse rle of D4. Only words that
+// contain a change are split into samples. Runs of identical words are then skipped 16 bytes
+// at a time, which is what dominates on mostly idle buses.
+// 1B is 5-8 channels
+void __attribute__((noinline)) sr_send_slices_1B(sr_encoder_t *e, const uint8_t *dbuf) {
+  uint8_t *txbuf = tx_begin(e);
+  uint8_t d_tx_bps = e->d_tx_bps;
+  const uint32_t *wbuf = (const uint32_t *)dbuf;
+  uint32_t samp_end = samples_to_send(e, e->samples_per_seg);
+  uint32_t txbufidx = 0;
+  uint32_t s, w, wend, cword, rep;
+  rle_init(e, ~dbuf[0]);
+  uint32_t lval = e->lval;
+  uint32_t rlecnt = e->rlecnt;
+  // The first word one sample at a time
+  for (s = 0; (s < 4) && (s < samp_end); s++) {
+    txbufidx = rle_sample(e, &txbuf, txbufidx, dbuf[s], &lval, &rlecnt, d_tx_bps, 0);
+  }
+  // Whole words
+  wend = samp_end >> 2;
+  rep = lval * 0x01010101;
+  for (w = 1; w < wend; w++) {
+    cword = wbuf[w];
+    if (cword == rep) {
+      rlecnt += 4;
+      while ((w + 4 < wend) && (wbuf[w + 1] == rep) && (wbuf[w + 2] == rep) && (wbuf[w + 3] == rep) && (wbuf[w + 4] == rep)) {
+        rlecnt += 16;
+        w += 4;
+      }
+    } else {
+      for (int j = 0; j < 4; j++) {
+        txbufidx = rle_sample(e, &txbuf, txbufidx, cword & 0xFF, &lval, &rlecnt, d_tx_bps, 0);
+        cword >>= 8;
+      }
+      rep = lval * 0x01010101;
+    }
+  } // for w
+  // In fixed mode the last segment may end part way through a word
+  for (s = (w << 2); s < samp_end; s++) {
+    txbufidx = rle_sample(e, &txbuf, txbufidx, dbuf[s], &lval, &rlecnt, d_tx_bps, 0);
+  }
+  rle_end_seg(e, txbuf, txbufidx, lval, rlecnt);
+} // sr_send_slices_1B
+
+// 2B is 9-16 channels
+void __attribute__((noinline)) sr_send_slices_2B(sr_encoder_t *e, const uint8_t *dbuf) {
+  const uint16_t *hbuf = (const uint16_t *)dbuf;
+  uint8_t *txbuf = tx_begin(e);
+  uint8_t d_tx_bps = e->d_tx_bps;
+  const uint32_t *wbuf = (const uint32_t *)dbuf;
+  uint32_t samp_end = samples_to_send(e, e->samples_per_seg);
+  uint32_t txbufidx = 0;
+  uint32_t s, w, wend, cword, rep;
+  rle_init(e, ~hbuf[0]);
+  uint32_t lval = e->lval;
+  uint32_t rlecnt = e->rlecnt;
+  // The first word
+  for (s = 0; (s < 2) && (s < samp_end); s++) {
+    txbufidx = rle_sample(e, &txbuf, txbufidx, hbuf[s], &lval, &rlecnt, d_tx_bps, 0);
+  }
+  // Whole words
+  wend = samp_end >> 1;
+  rep = lval * 0x00010001;
+  for (w = 1; w < wend; w++) {
+    cword = wbuf[w];
+    if (cword == rep) {
+      rlecnt += 2;
+      while ((w + 4 < wend) && (wbuf[w + 1] == rep) && (wbuf[w + 2] == rep) && (wbuf[w + 3] == rep) && (wbuf[w + 4] == rep)) {
+        rlecnt += 8;
+        w += 4;
+      }
+    } else {
+      txbufidx = rle_sample(e, &txbuf, txbufidx, cword & 0xFFFF, &lval, &rlecnt, d_tx_bps, 0);
+      txbufidx = rle_sample(e, &txbuf, txbufidx, cword >> 16, &lval, &rlecnt, d_tx_bps, 0);
+      rep = lval * 0x00010001;
+    }
+  } // for w
+  // In fixed mode the last segment may end part way through a word
+  for (s = (w << 1); s < samp_end; s++) {
+    txbufidx = rle_sample(e, &txbuf, txbufidx, hbuf[s], &lval, &rlecnt, d_tx_bps, 0);
+  }
+  rle_end_seg(e, txbuf, txbufidx, lval, rlecnt);
+} // sr_send_slices_2B
+
+// Packed is 5, 6, 9 or 10 channels, where a power of 2 bits per sample would waste up to 3/8 of the
+// storage, or any channels that don't start at D0. The PIO samples exactly d_pack_bits pins from
+// D<d_shift> and autopushes 32/d_pack_bits samples per word. As the ISR shifts right they fill the
+// top of the word, first sample lowest, and the bits below them are zero. Like 1B/2B the words are
+// compared against the last value replicated across them.
+void __attribute__((noinline)) sr_send_slices_packed(sr_encoder_t *e, const uint8_t *dbuf) {
+  const uint32_t *wbuf = (const uint32_t *)dbuf;
+  uint8_t *txbuf = tx_begin(e);
+  uint8_t d_tx_bps = e->d_tx_bps;
+  uint8_t d_shift = e->d_shift;
+  uint32_t bits = e->d_pack_bits;
+  uint32_t spw = 32 / bits;
+  uint32_t shift = 32 - spw * bits;
+  uint32_t mask = (1u << bits) - 1;
+  uint32_t samp_end = samples_to_send(e, e->samples_per_seg);
+  uint32_t txbufidx = 0;
+  uint32_t s, j, w, wend, cword, rep, ones = 0;
+  for (j = 0; j < spw; j++) {
+    ones |= 1u << (shift + j * bits);
+  }
+  rle_init(e, ~(wbuf[0] >> shift) & mask);
+  uint32_t lval = e->lval;
+  uint32_t rlecnt = e->rlecnt;
+  // Whole words
+  wend = samp_end / spw;
+  rep = lval * ones;
+  for (w = 0; w < wend; w++) {
+    cword = wbuf[w];
+    if (cword == rep) {
+      rlecnt += spw;
+      while ((rlecnt < 1568) && (w + 4 < wend) && (wbuf[w + 1] == rep) && (wbuf[w + 2] == rep) && (wbuf[w + 3] == rep) && (wbuf[w + 4] == rep)) {
+        rlecnt += 4 * spw;
+        w += 4;
+      }
+      // At 1 bit per sample a segment holds hundreds of maximal runs, so like D4 they are sent as they
+      // build up rather than all at once on the next change
+      while (rlecnt >= 1568) {
+        txbuf[txbufidx++] = 127;
+        rlecnt -= 1568;
+        if (txbufidx >= TX_BUFFER_THRESHOLD) {
+          txbufidx = tx_flush(e, &txbuf, txbufidx);
+        }
+      }
+    } else {
+      cword >>= shift;
+      for (j = 0; j < spw; j++) {
+        txbufidx = rle_sample(e, &txbuf, txbufidx, cword & mask, &lval, &rlecnt, d_tx_bps, d_shift);
+        cword >>= bits;
+      }
+      rep = lval * ones;
+    }
+  } // for w
+  // In fixed mode the last segment may end part way through a word
+  if (w * spw < samp_end) {
+    cword = wbuf[w] >> shift;
+    for (s = w * spw; s < samp_end; s++) {
+      txbufidx = rle_sample(e, &txbuf, txbufidx, cword & mask, &lval, &rlecnt, d_tx_bps, d_shift);
+      cword >>= bits;
+    }
+  }
+  rle_end_seg(e, txbuf, txbufidx, lval, rlecnt);
+} // sr_send_slices_packed
+
+// 4B is 17-21 channels and is the only one that must mask invalid bits which are captured by DMA.
+// To make a 32bit value written from PIO we pull in IOs that aren't actual digital channels.
+void __attribute__((noinline)) sr_send_slices_4B(sr_encoder_t *e, const uint8_t *dbuf) {
+  const uint32_t *wbuf = (const uint32_t *)dbuf;
+  uint8_t *txbuf = tx_begin(e);
+  uint8_t d_tx_bps = e->d_tx_bps;
+  uint32_t samp_remain = samples_to_send(e, e->samples_per_seg);
+  uint32_t txbufidx = 0;
+  rle_init(e, ~wbuf[0] << 11 >> 11);
+  uint32_t lval = e->lval;
+  uint32_t rlecnt = e->rlecnt;
+  for (uint32_t s = 0; s < samp_remain; s++) {
+    // Mask invalid bits
+    uint32_t cval = wbuf[s] << 11 >> 11;
+    if (cval == lval) {
+      rlecnt++;
+    } else {
+      txbufidx = check_rle(txbuf, txbufidx, rlecnt);
+      rlecnt = 0;
+      txbufidx = tx_d_samp(txbuf, txbufidx, cval, d_tx_bps);
+      if (txbufidx >= TX_BUFFER_THRESHOLD) {
+        txbufidx = tx_flush(e, &txbuf, txbufidx);
+      }
+    } // if cval!=lval
+    lval = cval;
+  } // for s
+  rle_end_seg(e, txbuf, txbufidx, lval, rlecnt);
+} // sr_send_slices_4B
+
+// Allow for 1,2 or 4B reads of sample data to reduce memory read overhead when
+// parsing digital sample data.  This function is correct for all uses, but if included
+// the compiled code is substantially slower to the point that digital only transfers
+// can't keep up with USB rate.  Thus it is only used by the send_slices_analog which is already
+// limited to 500khz.
+static inline uint32_t get_cval(const uint8_t *dbuf, uint32_t s, uint8_t d_dma_bps) {
+  if (d_dma_bps == 1) {
+    return dbuf[s];
+  } else if (d_dma_bps == 2) {
+    return ((const uint16_t *)dbuf)[s];
+  } else {
+    return ((const uint32_t *)dbuf)[s] << 11 >> 11;
+  }
+}
+
+// Slice transmit code, used for all cases with any analog channels
+// All digital channels for one slice are sent first in 7 bit bytes using values 0x80 to 0xFF
+// Analog channels are sent next, with each channel taking one 7 bit byte using values 0x80 to 0xFF,
+// or with 12 bit values two of them, the low 7 bits first.
+// This does not support run length encoding because it's not clear how to define RLE on analog signals
+void sr_send_slices_analog(sr_encoder_t *e, const uint8_t *dbuf, const uint8_t *abuf) {
+  const uint16_t *hbuf = (const uint16_t *)abuf;
+  uint8_t *txbuf = tx_begin(e);
+  uint32_t txbufidx = 0;
+  uint32_t rxbufaidx = 0;
+  uint32_t samp_remain = samples_to_send(e, e->samples_per_seg);
+  for (uint32_t s = 0; s < samp_remain; s++) {
+    if (e->d_mask) {
+      txbufidx = tx_d_samp(txbuf, txbufidx, get_cval(dbuf, s, e->d_dma_bps), e->d_tx_bps);
+    }
+    if (e->a_bps == 2) {
+      for (uint8_t i = 0; i < e->a_chan_cnt; i++) {
+        uint16_t aval = hbuf[rxbufaidx++];
+        txbuf[txbufidx++] = (aval & 0x7F) | 0x80;
+        txbuf[txbufidx++] = (aval >> 7) | 0x80;
+      }
+    } else {
+      for (uint8_t i = 0; i < e->a_chan_cnt; i++) {
+        txbuf[txbufidx++] = (abuf[rxbufaidx++] >> 1) | 0x80;
+      }
+    }
+    // Since this doesn't support RLEs we don't need to buffer
+    // extra bytes to prevent txbuf overflow, but this value
+    // works well anyway
+    if (txbufidx >= TX_BUFFER_THRESHOLD) {
+      txbufidx = tx_flush(e, &txbuf, txbufidx);
+    }
+  } // for s
+  tx_end(e, txbuf, txbufidx);
+} // sr_send_slices_analog
+
+// Delta version of send_slices_analog for slowly varying analog channels. The digital channels of a
+// slice are sent as in the analog format, then each analog channel as its difference from the previous
+// value of that channel, which starts at 0:
+//   0xC0-0xFF: the value is the previous one plus N-0xC0-32, for differences of -32 to 31
+//   0x80-0xBF: the low 6 bits of the value, followed by a 0x80-0xFF byte with the rest
+// A slice that is the same as the previous one isn't sent, and runs of them use the RLE values of the
+// 5-21 channel format, 48 to 127, between slices. As the maximal 1568 RLE is sent as soon as it is
+// complete the pending run is always short.
+void __attribute__((noinline)) sr_send_slices_analog_delta(sr_encoder_t *e, const uint8_t *dbuf, const uint8_t *abuf) {
+  const uint16_t *hbuf = (const uint16_t *)abuf;
+  uint8_t *txbuf = tx_begin(e);
+  uint32_t txbufidx = 0;
+  uint32_t rxbufaidx = 0;
+  uint8_t a_chan_cnt = e->a_chan_cnt;
+  uint32_t samp_remain = samples_to_send(e, e->samples_per_seg);
+  rle_init(e, e->d_mask ? ~get_cval(dbuf, 0, e->d_dma_bps) : 1);
+  uint32_t lval = e->lval;
+  uint32_t rlecnt = e->rlecnt;
+  for (uint32_t s = 0; s < samp_remain; s++) {
+    uint32_t cval = e->d_mask ? get_cval(dbuf, s, e->d_dma_bps) : 0;
+    uint16_t aval[3];
+    bool same = (cval == lval);
+    for (uint8_t i = 0; i < a_chan_cnt; i++) {
+      aval[i] = (e->a_bps == 2) ? hbuf[rxbufaidx++] : (abuf[rxbufaidx++] >> 1);
+      same = same && (aval[i] == e->a_last[i]);
+    }
+    if (same) {
+      if (++rlecnt == 1568) {
+        txbuf[txbufidx++] = 127;
+        rlecnt = 0;
+      }
+    } else {
+      txbufidx = check_rle(txbuf, txbufidx, rlecnt);
+      rlecnt = 0;
+      if (e->d_mask) {
+        txbufidx = tx_d_samp(txbuf, txbufidx, cval, e->d_tx_bps);
+      }
+      for (uint8_t i = 0; i < a_chan_cnt; i++) {
+        int32_t delta = (int32_t)aval[i] - (int32_t)e->a_last[i];
+        if ((delta >= -32) && (delta < 32)) {
+          txbuf[txbufidx++] = 0xC0 | (delta + 32);
+        } else {
+          txbuf[txbufidx++] = 0x80 | (aval[i] & 0x3F);
+          txbuf[txbufidx++] = 0x80 | (aval[i] >> 6);
+        }
+        e->a_last[i] = aval[i];
+      }
+      lval = cval;
+    }
+    if (txbufidx >= TX_BUFFER_THRESHOLD) {
+      txbufidx = tx_flush(e, &txbuf, txbufidx);
+    }
+  } // for s
+  tx_end(e, txbuf, txbufidx);
+  e->lval = lval;
+  e->rlecnt = rlecnt;
+} // sr_send_slices_analog_delta
+
+// Runs rather than samples, for the transition capture. The bytes are the same that the slice
+// encoders send for those samples, so the host can't tell them apart. The block stays open between
+// calls, as a run may be only a few bytes.
+void sr_send_run(sr_encoder_t *e, uint32_t value, uint32_t count) {
+  bool d4 = (e->a_chan_cnt == 0) && (e->d_dma_bps == 0);
+  uint32_t max = d4 ? 640 : 1568;
+  if ((e->continuous == false) && ((e->sent_cnt + count) > e->num_samples)) {
+    count = e->num_samples - e->sent_cnt;
+  }
+  if (count == 0) {
+    return;
+  }
+  e->sent_cnt += count;
+  uint8_t *txbuf = tx_begin(e);
+  uint32_t txbufidx = e->txbufidx;
+  uint32_t rlecnt;
+  rle_init(e, d4 ? (~value & 0xF) : ~value);
+  if (value == e->lval) {
+    rlecnt = e->rlecnt + count;
+  } else if (d4) {
+    txbufidx = d4_change(txbuf, txbufidx, e->rlecnt, value);
+    rlecnt = count - 1;
+  } else {
+    txbufidx = check_rle(txbuf, txbufidx, e->rlecnt);
+    txbufidx = tx_d_samp(txbuf, txbufidx, value, e->d_tx_bps);
+    rlecnt = count - 1;
+  }
+  // As in the slice encoders the maximal RLEs go out right away, so the pending run stays short
+  while (rlecnt >= max) {
+    txbuf[txbufidx++] = 127;
+    rlecnt -= max;
+    if (txbufidx >= TX_BUFFER_THRESHOLD) {
+      txbufidx = tx_flush(e, &txbuf, txbufidx);
+    }
+  }
+  if (txbufidx >= TX_BUFFER_THRESHOLD) {
+    txbufidx = tx_flush(e, &txbuf, txbufidx);
+  }
+  e->txbufidx = txbufidx;
+  e->lval = value;
+  e->rlecnt = rlecnt;
+}
+
+void sr_send_bytes(sr_encoder_t *e, const uint8_t *buf, uint32_t len) {
+  uint8_t *txbuf = tx_begin(e);
+  uint32_t txbufidx = e->txbufidx;
+  memcpy(&txbuf[txbufidx], buf, len);
+  txbufidx += len;
+  if (txbufidx >= TX_BUFFER_THRESHOLD) {
+    txbufidx = tx_flush(e, &txbuf, txbufidx);
+  }
+  e->txbufidx = txbufidx;
+}
+
+void sr_encoder_send_block(sr_encoder_t *e) {
+  if (e->txbuf) {
+    tx_end(e, e->txbuf, e->txbufidx);
+  }
+}
+
+void sr_send_slices(sr_encoder_t *e, const uint8_t *dbuf, const uint8_t *abuf) {
+  if (e->a_chan_cnt && e->a_delta) {
+    sr_send_slices_analog_delta(e, dbuf, abuf);
+  } else if (e->a_chan_cnt) {
+    sr_send_slices_analog(e, dbuf, abuf);
+  } else if (e->d_pack_bits) {
+    sr_send_slices_packed(e, dbuf);
+  } else if (e->d_dma_bps == 0) {
+    sr_send_slices_D4(e, dbuf);
+  } else if (e->d_dma_bps == 1) {
+    sr_send_slices_1B(e, dbuf);
+  } else if (e->d_dma_bps == 2) {
+    sr_send_slices_2B(e, dbuf);
+  } else {
+    sr_send_slices_4B(e, dbuf);
+  }
+}
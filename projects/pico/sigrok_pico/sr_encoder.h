@@ -0,0 +1,119 @@
+#ifndef _SR_ENCODER_H_
+#define _SR_ENCODER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// ------------------------------------
+// Sample encoders
+//
+// This module holds the run length encoders that turn the raw DMA sample
+// buffers into the serial stream understood by the sigrok host. It does not
+// depend on the pico-sdk so that it can also be built natively on the host
+// (see host/) to benchmark and test it.
+// ------------------------------------
+
+// The size of the output blocks the encoders write into. Each block is handed to
+// the transport as a single USB transfer, so larger blocks mean fewer round
+// trips through the USB stack.
+#define TX_BUFFER_SIZE 1024
+
+// This sets the point which we hand a block from the encoder to the transport.
+// For the 5-21 channel RLE, it must leave room for the maximal 1568 RLEs that a
+// steady input builds up between checks, plus the last RLE and a sample. A ring
+// segment of 1 or 2 byte samples holds at most ~28K of them, or 18 maximal RLEs.
+// Packed samples go down to 1 bit, so sr_send_slices_packed sends its maximal
+// RLEs with a check as they build up, like D4 does. The other formats add at
+// most 16 bytes between checks.
+#define TX_BUFFER_THRESHOLD (TX_BUFFER_SIZE - 96)
+
+// Output blocks are provided by the transport so that the encoders write the
+// stream in place rather than into a staging buffer that is then copied.
+// tx_get returns an unused block of TX_BUFFER_SIZE bytes, waiting for one to
+// become free, and tx_put hands over the first len bytes of the block last
+// returned by tx_get. On the device the blocks go to the USB, on the host they
+// are counted or decoded.
+typedef uint8_t *(*sr_tx_get_t)(void *ctx);
+typedef void (*sr_tx_put_t)(void *ctx, uint8_t *buf, uint32_t len);
+
+typedef struct sr_encoder {
+  // Capture configuration, must be set before calling sr_encoder_reset
+  uint32_t d_mask;           // Mask of enabled digital channels
+  uint32_t num_samples;      // Number of samples to send in fixed mode
+  uint32_t samples_per_seg; // Number of samples in each segment
+  bool continuous;           // Continuous mode flag
+  uint8_t a_chan_cnt;        // Count of enabled analog channels
+  uint8_t a_bps;             // Analog bytes stored per value by DMA, 1 for 8 bit or 2 for 12 bit values
+  bool a_delta;              // Send analog values as differences and runs of repeated slices
+  uint8_t d_dma_bps;         // Digital bytes stored per slice by DMA (0 for D4, 1, 2 or 4, 4 when packed)
+  uint8_t d_pack_bits;       // Bits per sample when the DMA words hold 32/d_pack_bits samples, else 0
+  uint8_t d_shift;           // Channel of bit 0 of the packed samples
+  uint8_t d_tx_bps;          // Digital transmit bytes per slice
+
+  // Progress of the current capture
+  uint32_t sent_cnt; // Number of samples sent
+  uint32_t ccnt;     // Number of bytes handed to the sink
+
+  // RLE state carried from one segment to the next so that runs spanning segments are sent once
+  bool have_last;  // lval holds the last sample of the capture
+  uint32_t lval;   // Last sample value (the last nibble in D4)
+  uint32_t rlecnt; // Repeats of lval not yet sent
+  uint16_t a_last[3]; // Last value of each analog channel, for the delta format
+
+  // Output
+  sr_tx_get_t tx_get; // Provides blocks to encode into
+  sr_tx_put_t tx_put; // Takes filled blocks
+  void *tx_ctx;       // Opaque argument passed to tx_get and tx_put
+  uint8_t *txbuf;     // Current block, NULL until one is needed
+  uint16_t txbufidx;  // Number of bytes used in txbuf
+} sr_encoder_t;
+
+// Clear the progress counters, RLE state and output buffer before starting a capture
+void sr_encoder_reset(sr_encoder_t *e);
+
+// Send the run still pending at the end of the capture. Must be called before
+// the byte count is reported, as the last run of a segment is not sent until the
+// next segment shows whether it continues.
+void sr_encoder_flush(sr_encoder_t *e);
+
+// Send a "#<next>+" gap marker in place of dropped samples of a continuous
+// capture, after the pending run. next is the sample that follows, counted from
+// the start of the capture, so the host can tell how many it missed however
+// much of the stream before the marker it got. The samples after it are sent as
+// at the start of a capture, with no previous value to repeat and analog deltas
+// from 0.
+void sr_send_gap(sr_encoder_t *e, uint64_t next);
+
+// The transport gave up on the host part way through a segment, and dropped the
+// last lost bytes handed to it along with the block being filled. Forget those
+// and the pending run, which may have started in them, before the gap marker.
+void sr_encoder_cut(sr_encoder_t *e, uint32_t lost);
+
+// Encode and send one segment, picking the encoder based on the capture
+// configuration. abuf is only used when analog channels are enabled.
+void sr_send_slices(sr_encoder_t *e, const uint8_t *dbuf, const uint8_t *abuf);
+
+// Individual encoders, see sr_encoder.c for the wire format of each one
+void sr_send_slices_D4(sr_encoder_t *e, const uint8_t *dbuf);
+void sr_send_slices_1B(sr_encoder_t *e, const uint8_t *dbuf);
+void sr_send_slices_2B(sr_encoder_t *e, const uint8_t *dbuf);
+void sr_send_slices_4B(sr_encoder_t *e, const uint8_t *dbuf);
+void sr_send_slices_packed(sr_encoder_t *e, const uint8_t *dbuf);
+void sr_send_slices_analog(sr_encoder_t *e, const uint8_t *dbuf, const uint8_t *abuf);
+void sr_send_slices_analog_delta(sr_encoder_t *e, const uint8_t *dbuf, const uint8_t *abuf);
+
+// Encode count samples of value, with the digital channels in their own bits.
+// Used instead of sr_send_slices when the samples come as runs, for 1-21
+// digital channels and no analog. Consecutive runs of the same value merge.
+void sr_send_run(sr_encoder_t *e, uint32_t value, uint32_t count);
+
+// Send len bytes that are already encoded, such as the frames of a protocol
+// capture, in place of samples. len must be at most 64.
+void sr_send_bytes(sr_encoder_t *e, const uint8_t *buf, uint32_t len);
+
+// Hand over the bytes sr_send_run has encoded so far, so that the host gets
+// them without waiting for a full block. The pending run is kept.
+void sr_encoder_send_block(sr_encoder_t *e);
+
+#endif // _SR_ENCODER_H_
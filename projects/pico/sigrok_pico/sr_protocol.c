@@ -0,0 +1,208 @@
+#include "sr_protocol.h"
+
+// Bits of an I2C byte before the first start
+#define I2C_IDLE 0xFF
+
+static const uint8_t frame_data_bytes[16] = SR_FRAME_DATA_BYTES;
+
+static inline uint32_t ch_bit(const sr_protocol_t *p, uint32_t value, uint32_t role) {
+  return (value >> p->ch[role]) & 1;
+}
+
+static uint32_t put_frame(uint8_t *out, uint32_t kind, uint32_t time, uint32_t data) {
+  uint32_t tlen = 0;
+  for (uint32_t t = time; t; t >>= 6) {
+    tlen++;
+  }
+  uint32_t len = 0;
+  out[len++] = 0xC0 | (kind << 2) | tlen;
+  for (uint32_t i = 0; i < tlen; i++) {
+    out[len++] = 0x80 | (time & 0x3F);
+    time >>= 6;
+  }
+  for (uint32_t i = 0; i < frame_data_bytes[kind]; i++) {
+    out[len++] = 0x80 | (data & 0x3F);
+    data >>= 6;
+  }
+  return len;
+}
+
+// Send a frame that started on sample, after a time frame if it is too far from the last one
+static uint32_t frame(sr_protocol_t *p, uint8_t *out, uint32_t kind, uint32_t sample, uint32_t data) {
+  uint32_t len = 0;
+  uint32_t delta = sample - p->ref;
+  if (delta >> 18) {
+    len = put_frame(out, SR_FRAME_TIME, delta >> 18, 0);
+  }
+  len += put_frame(out + len, kind, delta & 0x3FFFF, data);
+  p->ref = sample;
+  p->busy = false;
+  return len;
+}
+
+// The bits of a UART frame are read in their middle, from the start bit edge. The changes only tell
+// the level up to the new sample, so each bit is taken once a change or a repeated value comes after
+// its middle, and a frame ends on the first one after the middle of its stop bit.
+static uint32_t uart_edge(sr_protocol_t *p, uint8_t *out, uint32_t sample, uint32_t value) {
+  uint32_t len = 0;
+  uint32_t level = ch_bit(p, p->value, SR_PROTOCOL_UART_RX);
+  while (p->busy) {
+    uint32_t mid = p->start + (((2 * p->bits + 1) * p->bit_fp) >> 9);
+    if ((int32_t)(mid - sample) >= 0) {
+      break;
+    }
+    if (p->bits == 0) {
+      if (level) {
+        // A glitch rather than a start bit
+        p->busy = false;
+        break;
+      }
+    } else if (p->bits <= 8) {
+      p->data |= level << (p->bits - 1);
+    } else {
+      len = frame(p, out, SR_FRAME_UART, p->start, p->data | ((level ^ 1) << 8));
+      break;
+    }
+    p->bits++;
+  }
+  if (!p->busy && level && !ch_bit(p, value, SR_PROTOCOL_UART_RX)) {
+    p->busy = true;
+    p->start = sample;
+    p->bits = 0;
+    p->data = 0;
+  }
+  return len;
+}
+
+// SPI data is read on the sampling clock edge, which is the leading one in modes 0 and 2 and the
+// trailing one in modes 1 and 3. The data lines change on the other edge, so they are taken from the
+// value before the sampling edge. Raising CS drops a partial word, and without CS the words are
+// counted from the start of the capture.
+static uint32_t spi_edge(sr_protocol_t *p, uint8_t *out, uint32_t sample, uint32_t value) {
+  uint32_t len = 0;
+  if ((p->ch[SR_PROTOCOL_SPI_CS] != SR_PROTOCOL_NO_CH) && ch_bit(p, value, SR_PROTOCOL_SPI_CS)) {
+    p->busy = false;
+    p->bits = 0;
+    p->data = 0;
+    return 0;
+  }
+  uint32_t clk = ch_bit(p, value, SR_PROTOCOL_SPI_CLK);
+  uint32_t sample_clk = ((p->spi_mode >> 1) ^ p->spi_mode ^ 1) & 1;
+  if ((clk != ch_bit(p, p->value, SR_PROTOCOL_SPI_CLK)) && (clk == sample_clk)) {
+    if (p->bits == 0) {
+      p->busy = true;
+      p->start = sample;
+    }
+    uint32_t mosi = ((p->data & 0xFFF) << 1) | ch_bit(p, p->value, SR_PROTOCOL_SPI_MOSI);
+    uint32_t miso = (p->data >> 12) << 1;
+    if (p->ch[SR_PROTOCOL_SPI_MISO] != SR_PROTOCOL_NO_CH) {
+      miso |= ch_bit(p, p->value, SR_PROTOCOL_SPI_MISO);
+    }
+    p->data = mosi | (miso << 12);
+    if (++p->bits == 8) {
+      len = frame(p, out, SR_FRAME_SPI, p->start, p->data);
+      p->bits = 0;
+      p->data = 0;
+    }
+  }
+  return len;
+}
+
+// I2C starts and stops are SDA changes while SCL is high, and any other SDA change is taken to be
+// for the next bit. Bits are read as SCL rises, 8 for the byte and a ninth for the ACK.
+static uint32_t i2c_edge(sr_protocol_t *p, uint8_t *out, uint32_t sample, uint32_t value) {
+  uint32_t len = 0;
+  uint32_t scl = ch_bit(p, value, SR_PROTOCOL_I2C_SCL);
+  uint32_t sda = ch_bit(p, value, SR_PROTOCOL_I2C_SDA);
+  uint32_t last_scl = ch_bit(p, p->value, SR_PROTOCOL_I2C_SCL);
+  if (last_scl && scl && (sda != ch_bit(p, p->value, SR_PROTOCOL_I2C_SDA))) {
+    len = frame(p, out, sda ? SR_FRAME_I2C_STOP : SR_FRAME_I2C_START, sample, 0);
+    p->bits = sda ? I2C_IDLE : 0;
+    p->data = 0;
+  } else if (!last_scl && scl && (p->bits != I2C_IDLE)) {
+    if (p->bits == 0) {
+      p->busy = true;
+      p->start = sample;
+    }
+    if (p->bits < 8) {
+      p->data = (p->data << 1) | sda;
+      p->bits++;
+    } else {
+      len = frame(p, out, SR_FRAME_I2C_BYTE, p->start, p->data | (sda << 8));
+      p->bits = 0;
+      p->data = 0;
+    }
+  }
+  return len;
+}
+
+bool sr_protocol_reset(sr_protocol_t *p, uint32_t sample_rate) {
+  p->started = false;
+  p->busy = false;
+  p->value = 0;
+  p->ref = 0;
+  p->start = 0;
+  p->bits = (p->kind == SR_PROTOCOL_I2C) ? I2C_IDLE : 0;
+  p->data = 0;
+  p->bit_fp = 0;
+  uint32_t roles = (p->kind == SR_PROTOCOL_UART) ? 1 : 2;
+  if (p->kind == SR_PROTOCOL_NONE) {
+    return false;
+  }
+  for (uint32_t i = 0; i < 4; i++) {
+    if ((p->ch[i] >= 32) && ((i < roles) || ((p->kind == SR_PROTOCOL_SPI) && (p->ch[i] != SR_PROTOCOL_NO_CH)))) {
+      return false;
+    }
+  }
+  if (p->kind == SR_PROTOCOL_UART) {
+    // The middle of the stop bit must fit 32 bits, see uart_edge
+    uint64_t bit_fp = p->baud ? ((uint64_t)sample_rate << 8) / p->baud : 0;
+    if ((bit_fp < (4 << 8)) || (bit_fp >= (1 << 27))) {
+      return false;
+    }
+    p->bit_fp = bit_fp;
+  }
+  return true;
+}
+
+uint32_t sr_protocol_mask(const sr_protocol_t *p) {
+  uint32_t roles = (p->kind == SR_PROTOCOL_SPI) ? 4 : (p->kind == SR_PROTOCOL_I2C) ? 2 : (p->kind == SR_PROTOCOL_UART) ? 1 : 0;
+  uint32_t mask = 0;
+  for (uint32_t i = 0; i < roles; i++) {
+    if (p->ch[i] < 32) {
+      mask |= 1u << p->ch[i];
+    }
+  }
+  return mask;
+}
+
+uint32_t sr_protocol_edge(sr_protocol_t *p, uint8_t *out, uint32_t sample, uint32_t value) {
+  uint32_t len = 0;
+  if (!p->started) {
+    p->started = true;
+    p->value = value;
+    return 0;
+  }
+  // Keep the time from the last frame to 30 bits, so that it can't wrap on a quiet bus
+  uint32_t base = p->busy ? p->start : sample;
+  if ((base - p->ref) >> 30) {
+    uint32_t units = (base - p->ref) >> 18;
+    len = put_frame(out, SR_FRAME_TIME, units, 0);
+    p->ref += units << 18;
+  }
+  switch (p->kind) {
+  case SR_PROTOCOL_UART:
+    len += uart_edge(p, out + len, sample, value);
+    break;
+  case SR_PROTOCOL_SPI:
+    len += spi_edge(p, out + len, sample, value);
+    break;
+  case SR_PROTOCOL_I2C:
+    len += i2c_edge(p, out + len, sample, value);
+    break;
+  default:
+    break;
+  }
+  p->value = value;
+  return len;
+}
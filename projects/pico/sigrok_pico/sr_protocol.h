@@ -0,0 +1,92 @@
+#ifndef _SR_PROTOCOL_H_
+#define _SR_PROTOCOL_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// ------------------------------------
+// Serial protocol decoders
+//
+// Rather than samples, a protocol capture sends the host the frames of one
+// UART, SPI or I2C bus decoded on the device. The decoders take the changes
+// of the digital channels as the transition capture gives them (see
+// sr_transition.h), so they only do work per edge and the bus can be clocked
+// as fast as the PIO can follow it, far beyond what the raw stream could
+// carry. Like the encoders they don't depend on the pico-sdk, so they are
+// tested on the host.
+//
+// Every byte of a frame has bit 7 set, so they never clash with the "$" byte
+// count or the "!!!" abort. The first byte of a frame is 0xC0-0xFF and holds
+// the frame kind in bits 5:2 and the count of time bytes in bits 1:0. The
+// rest are 0x80-0xBF and hold 6 bits each, least significant first:
+//   - 0 to 3 time bytes, the samples from the previous frame to this one
+//   - the data bytes of the kind, see SR_FRAME_*
+// A frame is timed at its first sample, a start bit, the first clock of an
+// SPI word or of an I2C byte, or the bus condition itself. Gaps longer than
+// 18 bits take an SR_FRAME_TIME first.
+// ------------------------------------
+
+// Frame kinds and their data bytes
+#define SR_FRAME_UART 0      // 2 bytes, the 8 data bits and bit 8 set if the stop bit was low
+#define SR_FRAME_SPI 1       // 4 bytes, 12 bits of MOSI and then 12 of MISO, 8 bits used in each
+#define SR_FRAME_I2C_START 2 // No data, a start or a repeated start
+#define SR_FRAME_I2C_STOP 3  // No data
+#define SR_FRAME_I2C_BYTE 4  // 2 bytes, the 8 bits of an address or data byte and bit 8 set on a NACK
+#define SR_FRAME_TIME 15     // No data, the time bytes count 2^18 samples each
+
+// Data bytes of each frame kind, indexed by kind
+#define SR_FRAME_DATA_BYTES {2, 4, 0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}
+
+// Most bytes sr_protocol_edge writes in one call, a time frame and one other
+#define SR_PROTOCOL_MAX_OUT 16
+
+typedef enum sr_protocol_kind {
+  SR_PROTOCOL_NONE = 0,
+  SR_PROTOCOL_UART, // 8N1, idle high
+  SR_PROTOCOL_SPI,  // 8 bit words, most significant bit first
+  SR_PROTOCOL_I2C,
+} sr_protocol_kind_t;
+
+// Channel roles, indexes into ch
+#define SR_PROTOCOL_UART_RX 0
+#define SR_PROTOCOL_SPI_CLK 0
+#define SR_PROTOCOL_SPI_MOSI 1
+#define SR_PROTOCOL_SPI_MISO 2
+#define SR_PROTOCOL_SPI_CS 3
+#define SR_PROTOCOL_I2C_SCL 0
+#define SR_PROTOCOL_I2C_SDA 1
+#define SR_PROTOCOL_NO_CH 0xFF // An optional channel that isn't used, MISO or CS
+
+typedef struct sr_protocol {
+  // Bus configuration, must be set before calling sr_protocol_reset
+  sr_protocol_kind_t kind;
+  uint8_t ch[4];     // Digital channel of each role, see SR_PROTOCOL_*
+  uint8_t spi_mode;  // SPI clock polarity in bit 1 and phase in bit 0
+  uint32_t baud;     // UART bit rate
+
+  // Decoding state
+  bool started;      // The first value is known
+  bool busy;         // A frame has started and not yet been sent
+  uint32_t value;    // Digital channels since the last change
+  uint32_t ref;      // Sample of the last frame sent, the time bytes count from it
+  uint32_t start;    // First sample of the frame being decoded
+  uint32_t bit_fp;   // UART bit length in 1/256 samples
+  uint8_t bits;      // Bits of the frame decoded so far
+  uint32_t data;     // And their values, MOSI in bits 11:0 and MISO in bits 23:12 for SPI
+} sr_protocol_t;
+
+// Clear the decoding state before a capture. Returns false if the
+// configuration can't be decoded at sample_rate, a channel is missing or a
+// UART bit is shorter than 4 samples or longer than 2^19.
+bool sr_protocol_reset(sr_protocol_t *p, uint32_t sample_rate);
+
+// Mask of the channels the bus uses
+uint32_t sr_protocol_mask(const sr_protocol_t *p);
+
+// Take the value of the digital channels, with each channel in its own bit,
+// from sample on. Samples must not go back, and a value may repeat the last
+// one to let the decoders follow the time. Writes the frames that completed
+// before sample to out and returns their length, at most SR_PROTOCOL_MAX_OUT.
+uint32_t sr_protocol_edge(sr_protocol_t *p, uint8_t *out, uint32_t sample, uint32_t value);
+
+#endif // _SR_PROTOCOL_H_
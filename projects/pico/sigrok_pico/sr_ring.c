@@ -0,0 +1,94 @@
+#include "sr_ring.h"
+
+#include "hardware/irq.h"
+#include "hardware/timer.h"
+
+// Source of the zero channel
+static const uint32_t null_token = 0;
+
+// Rings served by the IRQ handler
+static sr_ring_t *rings[2];
+static uint num_rings;
+
+static void __not_in_flash_func(ring_irq_handler)(void) {
+  uint32_t now = time_us_32();
+  for (uint i = 0; i < num_rings; i++) {
+    sr_ring_t *r = rings[i];
+    if (dma_irqn_get_channel_status(SR_RING_IRQ - DMA_IRQ_0, r->data_chan)) {
+      dma_irqn_acknowledge_channel(SR_RING_IRQ - DMA_IRQ_0, r->data_chan);
+      r->done_us[r->done & (SR_RING_SEGMENTS - 1)] = now;
+      r->done++;
+    }
+  }
+}
+
+void sr_ring_claim(sr_ring_t *r) {
+  hard_assert(num_rings < count_of(rings));
+  r->data_chan = dma_claim_unused_channel(true);
+  r->load_chan = dma_claim_unused_channel(true);
+  r->zero_chan = dma_claim_unused_channel(true);
+  r->write_addr = &dma_hw->ch[r->data_chan].write_addr;
+  rings[num_rings++] = r;
+  dma_irqn_set_channel_enabled(SR_RING_IRQ - DMA_IRQ_0, r->data_chan, true);
+}
+
+void sr_ring_irq_init(void) {
+  irq_set_exclusive_handler(SR_RING_IRQ, ring_irq_handler);
+  irq_set_enabled(SR_RING_IRQ, true);
+}
+
+void sr_ring_start(sr_ring_t *r, uint8_t *buf, uint32_t seg_bytes, volatile void *src, uint dreq, enum dma_channel_transfer_size size, bool free_run) {
+  dma_channel_config dcfg, lcfg, zcfg;
+  // log2 of the token table size for the ring addressing
+  uint ring_bits = __builtin_ctz(sizeof(r->tokens));
+
+  r->buf = buf;
+  r->seg_bytes = seg_bytes;
+  r->done = 0;
+  // Segment 0 is taken by the initial start of the data channel, load and zero begin at segment 1.
+  // A free running ring never clears its tokens.
+  for (uint32_t s = 0; s < SR_RING_SEGMENTS; s++) {
+    sr_ring_release(r, s);
+  }
+  if (!free_run) {
+    r->tokens[0] = 0;
+  }
+
+  dcfg = dma_channel_get_default_config(r->data_chan);
+  channel_config_set_transfer_data_size(&dcfg, size);
+  channel_config_set_read_increment(&dcfg, false);
+  channel_config_set_write_increment(&dcfg, true);
+  channel_config_set_dreq(&dcfg, dreq);
+  channel_config_set_chain_to(&dcfg, r->load_chan);
+
+  lcfg = dma_channel_get_default_config(r->load_chan);
+  channel_config_set_transfer_data_size(&lcfg, DMA_SIZE_32);
+  channel_config_set_read_increment(&lcfg, true);
+  channel_config_set_write_increment(&lcfg, false);
+  channel_config_set_ring(&lcfg, false, ring_bits);
+  // Chaining a channel to itself disables chaining
+  channel_config_set_chain_to(&lcfg, free_run ? r->load_chan : r->zero_chan);
+
+  zcfg = dma_channel_get_default_config(r->zero_chan);
+  channel_config_set_transfer_data_size(&zcfg, DMA_SIZE_32);
+  channel_config_set_read_increment(&zcfg, false);
+  channel_config_set_write_increment(&zcfg, true);
+  channel_config_set_ring(&zcfg, true, ring_bits);
+
+  //                     channel       config  write_addr                                     read_addr     count  trigger
+  dma_channel_configure(r->zero_chan, &zcfg, &r->tokens[1], &null_token, 1, false);
+  dma_channel_configure(r->load_chan, &lcfg, &dma_hw->ch[r->data_chan].al2_write_addr_trig, &r->tokens[1], 1, false);
+  // The data channel reloads this count every time load restarts it
+  dma_channel_configure(r->data_chan, &dcfg, buf, src, seg_bytes >> size, true);
+}
+
+void sr_ring_abort(sr_ring_t *r) {
+  // Stop the data channel from chaining while it's aborted, as an abort can
+  // still trigger the channel it is chained to
+  hw_clear_bits(&dma_hw->ch[r->data_chan].al1_ctrl, DMA_CH0_CTRL_TRIG_EN_BITS);
+  dma_channel_abort(r->data_chan);
+  dma_channel_abort(r->load_chan);
+  dma_channel_abort(r->zero_chan);
+  // Don't count a completion raised by the abort in the next capture
+  dma_irqn_acknowledge_channel(SR_RING_IRQ - DMA_IRQ_0, r->data_chan);
+}
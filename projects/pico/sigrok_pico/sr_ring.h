@@ -0,0 +1,90 @@
+#ifndef _SR_RING_H_
+#define _SR_RING_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "hardware/dma.h"
+
+// ------------------------------------
+// DMA segment rings
+//
+// Each sample source (PIO or ADC) fills a ring of SR_RING_SEGMENTS equal
+// segments of capture_buf, using three DMA channels:
+// * data: copies one segment worth of samples from the FIFO, then chains to load
+// * load: reads the next segment address from the token table and writes it to
+//   the data channel's WRITE_ADDR_TRIG, which restarts it, then chains to zero
+// * zero: clears the token that load just read
+// The encoder writes a token back once it has sent that segment. If the
+// data channel comes back around to a segment that wasn't sent, load reads a
+// cleared token, and writing 0 to a trigger register is a null trigger that
+// leaves the data channel stopped instead of overwriting samples. The FIFO
+// then overflows, which the capture loop already detects as an abort.
+// So the encoder can fall up to SR_RING_SEGMENTS-1 segments behind instead
+// of one half buffer, and no channel registers need patching while capturing.
+//
+// A ring can also free run, overwriting the oldest samples until told to stop
+// with sr_ring_stop_at. The pre-trigger capture uses that to keep the last
+// samples before the trigger.
+//
+// Every segment the data channel completes raises SR_RING_IRQ, whose handler
+// counts and timestamps it. The core that enables the IRQ can then wait for
+// segments with __wfe, as taking the interrupt wakes it.
+// ------------------------------------
+
+// Number of segments, must be a power of two for the DMA ring addressing
+#define SR_RING_SEGMENTS 8
+
+// DMA_IRQ_0 is left to the pico-sdk and other users
+#define SR_RING_IRQ DMA_IRQ_1
+
+typedef struct sr_ring {
+  uint data_chan;      // Channel copying samples
+  uint load_chan;      // Channel restarting data with the next segment
+  uint zero_chan;      // Channel clearing the tokens taken by load
+  uint8_t *buf;        // Start of the first segment
+  uint32_t seg_bytes;  // Size of each segment in bytes
+  volatile uint32_t *write_addr; // WRITE_ADDR of the data channel
+  volatile uint32_t done;        // Segments completed since the start, counted by the IRQ
+  volatile uint32_t done_us[SR_RING_SEGMENTS]; // time_us_32 of the last completion of each segment
+  // Segment addresses read by the load channel, 0 while a segment is in use
+  uint32_t tokens[SR_RING_SEGMENTS] __attribute__((aligned(SR_RING_SEGMENTS * 4)));
+} sr_ring_t;
+
+// Claim the three DMA channels of a ring, once at startup. At most two rings
+// can be claimed.
+void sr_ring_claim(sr_ring_t *r);
+
+// Install the completion handler and enable SR_RING_IRQ on the calling core
+void sr_ring_irq_init(void);
+
+// Start filling the ring from segment 0. src is the FIFO to read, paced by dreq,
+// and seg_bytes must be a multiple of the transfer size. A free running ring
+// doesn't wait for segments to be released.
+void sr_ring_start(sr_ring_t *r, uint8_t *buf, uint32_t seg_bytes, volatile void *src, uint dreq, enum dma_channel_transfer_size size, bool free_run);
+
+// Stop all three channels
+void sr_ring_abort(sr_ring_t *r);
+
+// Start address of segment seg
+static inline uint8_t *sr_ring_seg(const sr_ring_t *r, uint32_t seg) {
+  return r->buf + seg * r->seg_bytes;
+}
+
+// True once the n-th segment since the start (counting from 0) is complete
+static inline bool sr_ring_seg_done(const sr_ring_t *r, uint32_t n) {
+  return (int32_t)(r->done - n) > 0;
+}
+
+// Hand segment seg back to the DMA once its samples are sent
+static inline void sr_ring_release(sr_ring_t *r, uint32_t seg) {
+  r->tokens[seg] = (uint32_t)sr_ring_seg(r, seg);
+}
+
+// Stop a free running ring when it comes back around to segment seg, which
+// must not be the next one it loads
+static inline void sr_ring_stop_at(sr_ring_t *r, uint32_t seg) {
+  r->tokens[seg] = 0;
+}
+
+#endif // _SR_RING_H_
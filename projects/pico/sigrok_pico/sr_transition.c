@@ -0,0 +1,39 @@
+#include "sr_transition.h"
+
+#include "hardware/pio_instructions.h"
+#include "sr_trigger.h"
+
+int sr_transition_program(uint16_t *instr, bool wait_trigger, uint32_t pins, uint32_t shift) {
+  int len = 0;
+
+  if (wait_trigger) {
+    instr[len++] = pio_encode_wait_irq(true, false, SR_TRIGGER_IRQ);
+  }
+  uint loop = len;
+  uint change = loop + 6;
+  uint keep = loop + 13;
+  instr[len++] = pio_encode_mov(pio_osr, pio_pins);
+  instr[len++] = pio_encode_out(pio_x, pins);
+  instr[len++] = pio_encode_jmp_x_ne_y(change);
+  instr[len++] = pio_encode_mov(pio_x, pio_isr);
+  instr[len++] = pio_encode_jmp_x_dec(keep);
+  instr[len++] = pio_encode_mov(pio_x, pio_y);
+  // change
+  instr[len++] = pio_encode_push(false, true);
+  instr[len++] = pio_encode_mov(pio_isr, pio_x);
+  instr[len++] = pio_encode_push(false, true);
+  instr[len++] = pio_encode_mov(pio_y, pio_x);
+  instr[len++] = pio_encode_mov_not(pio_isr, pio_null);
+  instr[len++] = pio_encode_in(pio_null, shift);
+  instr[len++] = pio_encode_jmp(loop);
+  // keep
+  instr[len++] = pio_encode_mov(pio_isr, pio_x);
+
+  return len;
+}
+
+void sr_transition_setup(uint16_t *instr, uint32_t shift) {
+  instr[0] = pio_encode_mov_not(pio_y, pio_null);
+  instr[1] = pio_encode_mov_not(pio_isr, pio_null);
+  instr[2] = pio_encode_in(pio_null, shift);
+}
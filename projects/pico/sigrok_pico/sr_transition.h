@@ -0,0 +1,94 @@
+#ifndef _SR_TRANSITION_H_
+#define _SR_TRANSITION_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// ------------------------------------
+// PIO transition capture
+//
+// Rather than pushing every sample, this capture program compares each sample
+// of the pins with the last one and only pushes when they differ, together
+// with how many samples the last value lasted. The DMA and the encoder then
+// only see work per edge, so a mostly idle bus can be sampled at up to a sixth
+// of the system clock without overrunning. The loop keeps the last value in y
+// and counts down the samples since the last push in the ISR:
+//
+//   loop:  mov osr, pins       ; take a sample
+//          out x, <pins>       ; keep the sampled channels
+//          jmp x!=y, change
+//          mov x, isr
+//          jmp x--, keep       ; one more sample of the same value
+//          mov x, y            ; the count ran out, push the same value again
+//   change: push               ; the count left
+//          mov isr, x
+//          push                ; and the new value
+//          mov y, x
+//          mov isr, ~null
+//          in null, <shift>    ; restart the count
+//          jmp loop
+//   keep:  mov isr, x          ; wraps to loop
+//
+// Each sample takes SR_TRANSITION_LOOP cycles, but the sample after a push
+// comes a few cycles later, see sr_transition_event. The count restarting
+// from a smaller value than 2^32-1 makes the program push the same value again
+// regularly on an idle bus. That lets the encoder follow the time and end a
+// fixed capture without waiting for an edge.
+// ------------------------------------
+
+// Longest program, the trigger program must fit in the rest of the instruction memory
+#define SR_TRANSITION_MAX_INSTR 15
+
+// Cycles from one sample to the next while nothing changes
+#define SR_TRANSITION_LOOP 6
+// Cycles from a sample that changed to the next sample
+#define SR_TRANSITION_CHANGE 10
+// Cycles from a sample whose count ran out to the next sample
+#define SR_TRANSITION_REPEAT 13
+
+// Build the program into instr. The capture waits for SR_TRIGGER_IRQ first if
+// wait_trigger is set, and samples pins channels. The count restarts from
+// 2^(32-shift)-1 samples, shift is 1 to 31. Returns its length. The program
+// wraps from its last instruction to the one after the trigger wait.
+int sr_transition_program(uint16_t *instr, bool wait_trigger, uint32_t pins, uint32_t shift);
+
+// First instructions to execute before enabling the state machine: y can't
+// match any sample so that the first one is pushed, and the count is full
+void sr_transition_setup(uint16_t *instr, uint32_t shift);
+#define SR_TRANSITION_SETUP_INSTR 3
+
+// Position of the pushed samples within the capture. The cycles are kept as
+// samples and a remainder, so that long captures don't need 64 bit divisions.
+typedef struct sr_transition {
+  uint32_t sample; // Whole samples from the first one to the next after the last push
+  uint32_t cycles; // And the cycles left over
+  uint32_t count;  // Count the program restarts from
+  uint32_t value;  // Last pushed value
+} sr_transition_t;
+
+static inline void sr_transition_reset(sr_transition_t *t, uint32_t shift) {
+  t->sample = 0;
+  t->cycles = 0;
+  t->count = 0xFFFFFFFFu >> shift;
+  t->value = 0xFFFFFFFFu;
+}
+
+// Take a pair the program pushed and return the sample the new value starts
+// on, at the rate of one sample every SR_TRANSITION_LOOP cycles and counting
+// from the first pushed sample. A push lands between two such samples when the
+// pushes before it made the loop late, and then the value starts on the next
+// one. The samples wrap at 2^32, which only matters to continuous captures.
+static inline uint32_t sr_transition_event(sr_transition_t *t, uint32_t count, uint32_t value) {
+  t->sample += t->count - count;
+  while (t->cycles >= SR_TRANSITION_LOOP) {
+    t->cycles -= SR_TRANSITION_LOOP;
+    t->sample++;
+  }
+  uint32_t sample = t->sample + (t->cycles != 0);
+  // The sample after the push is later than a loop
+  t->cycles += (value == t->value) ? SR_TRANSITION_REPEAT : SR_TRANSITION_CHANGE;
+  t->value = value;
+  return sample;
+}
+
+#endif // _SR_TRANSITION_H_
@@ -0,0 +1,84 @@
+#include "sr_trigger.h"
+
+#include "hardware/pio_instructions.h"
+
+// Append an instruction, tracking overflow in len
+static inline void emit(uint16_t *instr, int *len, uint16_t i) {
+  if (*len < SR_TRIGGER_MAX_INSTR) {
+    instr[*len] = i;
+  }
+  (*len)++;
+}
+
+// Take a sample into y and leave bit chan of it in x
+static void emit_sample_bit(uint16_t *instr, int *len, uint chan) {
+  emit(instr, len, pio_encode_mov(pio_y, pio_pins));
+  emit(instr, len, pio_encode_mov(pio_osr, pio_y));
+  if (chan) {
+    emit(instr, len, pio_encode_out(pio_null, chan));
+  }
+  emit(instr, len, pio_encode_out(pio_x, 1));
+}
+
+int sr_trigger_program(uint16_t *instr, uint32_t lvl0mask, uint32_t lvl1mask, uint32_t risemask, uint32_t fallmask, uint32_t chgmask) {
+  uint32_t lvlmask = lvl0mask | lvl1mask;
+  uint32_t edgemask = risemask | fallmask | chgmask;
+  int len = 0;
+  uint arm = 0;
+  uint pos;
+
+  if ((lvlmask | edgemask) == 0) {
+    return 0;
+  }
+  // Only one edge channel, and one condition for it
+  if ((edgemask & (edgemask - 1)) || (risemask && fallmask) || ((risemask | fallmask) && chgmask)) {
+    return -1;
+  }
+
+  if (edgemask) {
+    uint chan = __builtin_ctz(edgemask);
+    if (chgmask) {
+      // Each sample takes s instructions, then arm is followed by wait0, wait1 and match
+      uint s = chan ? 4 : 3;
+      uint wait0 = s + 1;
+      uint wait1 = wait0 + s + 2;
+      uint match = wait1 + s + 1;
+      // arm: wait for a high if the channel is low now, otherwise for a low
+      emit_sample_bit(instr, &len, chan);
+      emit(instr, &len, pio_encode_jmp_not_x(wait1));
+      emit_sample_bit(instr, &len, chan);
+      emit(instr, &len, pio_encode_jmp_x_dec(wait0));
+      emit(instr, &len, pio_encode_jmp(match));
+      emit_sample_bit(instr, &len, chan);
+      emit(instr, &len, pio_encode_jmp_not_x(wait1));
+    } else {
+      // Wait for the level before the edge, then for the edge itself
+      emit_sample_bit(instr, &len, chan);
+      emit(instr, &len, risemask ? pio_encode_jmp_x_dec(arm) : pio_encode_jmp_not_x(arm));
+      uint wait = len;
+      emit_sample_bit(instr, &len, chan);
+      emit(instr, &len, risemask ? pio_encode_jmp_not_x(wait) : pio_encode_jmp_x_dec(wait));
+    }
+  } else {
+    emit(instr, &len, pio_encode_mov(pio_y, pio_pins));
+  }
+
+  // match: test the levels of the sample in y, going back to arm on a mismatch
+  emit(instr, &len, pio_encode_mov(pio_osr, pio_y));
+  pos = 0;
+  while (lvlmask) {
+    uint chan = __builtin_ctz(lvlmask);
+    if (chan > pos) {
+      emit(instr, &len, pio_encode_out(pio_null, chan - pos));
+    }
+    emit(instr, &len, pio_encode_out(pio_x, 1));
+    emit(instr, &len, ((lvl1mask >> chan) & 1) ? pio_encode_jmp_not_x(arm) : pio_encode_jmp_x_dec(arm));
+    pos = chan + 1;
+    lvlmask &= lvlmask - 1;
+  }
+  emit(instr, &len, pio_encode_push(false, false));
+  emit(instr, &len, pio_encode_irq_set(false, SR_TRIGGER_IRQ));
+  emit(instr, &len, pio_encode_jmp(len));
+
+  return (len <= SR_TRIGGER_MAX_INSTR) ? len : -1;
+}
@@ -0,0 +1,59 @@
+#ifndef _SR_TRIGGER_H_
+#define _SR_TRIGGER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// ------------------------------------
+// PIO trigger program
+//
+// The trigger conditions are compiled into a program for a second PIO state
+// machine that reads the same pins as the capture state machine. When the
+// conditions match it sets PIO IRQ flag SR_TRIGGER_IRQ, and the capture state
+// machine waits on that flag before its first sample, so samples before the
+// trigger never reach the DMA and no CPU work is done per sample.
+//
+// The masks are in channel bits (bit 0 is GPIO2). Every level condition and
+// at most one edge condition must hold on the same sample. PIO can't AND
+// the pins with a mask, so the program shifts each sample out of the OSR and
+// tests one condition bit at a time:
+//
+//   arm:   mov y, pins        ; take a sample (edge conditions only)
+//          mov osr, y
+//          out null, <gap>    ; skip to the edge channel
+//          out x, 1
+//          jmp x--, arm       ; wait for the edge channel to be low (rising)
+//   wait:  mov y, pins
+//          ...                ; and for it to go high
+//   match: mov osr, y
+//          out null, <gap>    ; then for every level channel, lowest first
+//          out x, 1
+//          jmp !x, arm        ; or jmp x-- for a low level
+//          push               ; lets a DMA channel take a snapshot
+//          irq set SR_TRIGGER_IRQ
+//   end:   jmp end
+//
+// The loop takes a few system clocks per condition, so at the highest sample
+// rates the trigger lands some samples after the event and shorter pulses
+// can be missed.
+// ------------------------------------
+
+// PIO IRQ flag raised by the trigger, flags 0-3 can also interrupt the CPU
+#define SR_TRIGGER_IRQ 0
+
+// Longest program, the capture program uses the rest of the instruction memory
+#define SR_TRIGGER_MAX_INSTR 30
+
+// True if a sample and the previous one match the conditions, for finding the
+// exact trigger sample in a capture
+static inline bool sr_trigger_match(uint32_t cur, uint32_t prev, uint32_t lvl0mask, uint32_t lvl1mask, uint32_t risemask, uint32_t fallmask, uint32_t chgmask) {
+  return ((cur & lvl1mask) == lvl1mask) && ((cur & lvl0mask) == 0) && ((cur & ~prev & risemask) == risemask) &&
+         ((~cur & prev & fallmask) == fallmask) && (((cur ^ prev) & chgmask) == chgmask);
+}
+
+// Build the trigger program into instr for loading at offset 0. Returns its
+// length, 0 if there are no conditions, or -1 if there is more than one edge
+// channel or the program doesn't fit.
+int sr_trigger_program(uint16_t *instr, uint32_t lvl0mask, uint32_t lvl1mask, uint32_t risemask, uint32_t fallmask, uint32_t chgmask);
+
+#endif // _SR_TRIGGER_H_
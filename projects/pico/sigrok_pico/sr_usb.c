@@ -0,0 +1,255 @@
+#include "sr_usb.h"
+
+#include <string.h>
+
+#include "device/usbd_pvt.h"
+#include "hardware/sync.h"
+#include "pico/stdlib.h"
+#include "sr_encoder.h"
+#include "tusb.h"
+
+// The CDC data IN endpoint from the pico-sdk stdio_usb descriptors, which
+// usb_vendor/usb_descriptors.c keeps
+#define SR_USB_CDC_EP_IN 0x82
+// The vendor interface bulk IN endpoint from usb_vendor/usb_descriptors.c
+#define SR_USB_VENDOR_EP_IN 0x83
+
+static uint8_t tx_blocks[SR_USB_TX_BLOCKS * TX_BUFFER_SIZE] __attribute__((aligned(4)));
+static uint16_t block_len[SR_USB_TX_MAX_BLOCKS];
+
+// The blocks in use, either tx_blocks or a store from sr_usb_tx_set_store
+static uint8_t *blocks = tx_blocks;
+static uint32_t num_blocks = SR_USB_TX_BLOCKS;
+
+// The ring is a single producer single consumer queue. The encoding core only
+// writes head and the USB core only writes tail, both count blocks forever and
+// are used modulo num_blocks, so no locks are needed.
+static volatile uint32_t head; // Blocks filled, written by the producer
+static volatile uint32_t tail; // Blocks sent or dropped, written by the consumer
+static uint32_t peak;          // Most blocks queued since the last sr_usb_tx_set_store
+static uint32_t stalls;        // And the times the producer waited for a free block
+static uint32_t stall_us;      // The time it waited
+static uint32_t dropped;       // Blocks dropped rather than sent
+static bool holding;           // Blocks put are held back, see sr_usb_tx_hold
+static uint32_t held;          // And those put since the last commit, which follow head
+
+static inline uint8_t *block(uint32_t i) {
+  return &blocks[(i % num_blocks) * TX_BUFFER_SIZE];
+}
+
+// Blocks filled by the producer, including those it holds back
+static inline uint32_t filled(void) {
+  return head + held;
+}
+
+// Consumer state
+static bool in_flight;                   // Block tail has been handed to the endpoint
+static uint32_t skip_to;                 // Blocks before this one are dropped once it is retired
+static uint64_t last_progress;           // Time the ring last moved, for the stdout timeout
+static uint8_t ep_in = SR_USB_CDC_EP_IN; // Endpoint the blocks are sent on
+static bool vendor_tx;                   // Blocks go to the vendor interface
+
+// The CDC needs the host to have opened the port, the vendor interface only
+// that the device is configured.
+static bool tx_connected(void) {
+  return vendor_tx ? tud_mounted() : tud_cdc_connected();
+}
+
+// Blocks after tail that an earlier drop already gave up on
+static inline uint32_t skipped(void) {
+  return ((int32_t)(skip_to - (tail + 1)) > 0) ? skip_to - (tail + 1) : 0;
+}
+
+// Forget all queued blocks. The controller may still be reading the one in
+// flight, so tail stays on it and the blocks after it are skipped once it is
+// retired.
+static void drop_queued(void) {
+  dropped += head - tail - (in_flight ? 1 : 0) - skipped();
+  if (in_flight) {
+    skip_to = head;
+  } else {
+    tail = head;
+  }
+  __sev();
+}
+
+void sr_usb_tx_task(void) {
+  if (head == tail) {
+    return;
+  }
+  tud_task();
+  if (!tx_connected()) {
+    // Nobody is listening, so drop the data like my_stdio_usb_out_chars does.
+    // A bus reset also aborts any transfer in flight.
+    in_flight = false;
+    drop_queued();
+    return;
+  }
+  if (in_flight) {
+    // The class driver may follow our transfer with a zero length packet which
+    // also keeps the endpoint busy, that only delays the next block.
+    if (usbd_edpt_busy(0, ep_in)) {
+      // If the host stops reading give up on the blocks behind this one, so that the encoder gets
+      // them back as soon as the host takes it
+      if (time_us_64() > last_progress + PICO_STDIO_USB_STDOUT_TIMEOUT_US) {
+        drop_queued();
+      }
+      return;
+    }
+    in_flight = false;
+    tail = tail + 1 + skipped();
+    // Wake the producer if it waits for a free block
+    __sev();
+  }
+  if ((head != tail) && usbd_edpt_claim(0, ep_in)) {
+    if (usbd_edpt_xfer(0, ep_in, block(tail), block_len[tail % num_blocks])) {
+      in_flight = true;
+      last_progress = time_us_64();
+    } else {
+      usbd_edpt_release(0, ep_in);
+    }
+  }
+}
+
+uint8_t *sr_usb_tx_get_unless(bool (*give_up)(void)) {
+  if (filled() - tail == num_blocks) {
+    uint32_t start = time_us_32();
+    while (filled() - tail == num_blocks) {
+      if (give_up && give_up()) {
+        break;
+      }
+      __wfe();
+    }
+    stalls++;
+    stall_us += time_us_32() - start;
+    if (filled() - tail == num_blocks) {
+      return NULL;
+    }
+  }
+  return block(filled());
+}
+
+uint8_t *sr_usb_tx_get(void *ctx) {
+  return sr_usb_tx_get_unless(NULL);
+}
+
+bool sr_usb_tx_full(void) {
+  return filled() - tail == num_blocks;
+}
+
+void sr_usb_tx_put(void *ctx, uint8_t *buf, uint32_t len) {
+  block_len[filled() % num_blocks] = len;
+  if (holding) {
+    held++;
+  } else {
+    // The block contents must be visible to the other core before it sees the new head
+    __dmb();
+    head = head + 1;
+  }
+  if (filled() - tail > peak) {
+    peak = filled() - tail;
+  }
+}
+
+void sr_usb_tx_hold(bool hold) {
+  sr_usb_tx_commit();
+  holding = hold;
+}
+
+void sr_usb_tx_commit(void) {
+  __dmb();
+  head = head + held;
+  held = 0;
+}
+
+void sr_usb_tx_discard(void) {
+  held = 0;
+}
+
+void sr_usb_tx_drain(void) {
+  uint64_t start = time_us_64();
+  uint32_t last = tail;
+  while (head != tail) {
+    sr_usb_tx_task();
+    // A store can take longer than the timeout to send, so only give up when it stops moving
+    if (tail != last) {
+      last = tail;
+      start = time_us_64();
+    }
+    if (time_us_64() > start + PICO_STDIO_USB_STDOUT_TIMEOUT_US) {
+      drop_queued();
+      break;
+    }
+  }
+}
+
+void sr_usb_tx_write(const char *buf, uint32_t len) {
+  while (len) {
+    uint32_t n = (len < TX_BUFFER_SIZE) ? len : TX_BUFFER_SIZE;
+    // This runs on the USB core, which is also the consumer, so waiting in sr_usb_tx_get for a free block
+    // would never end. Move the ring here instead, which also drops the blocks if the host has gone. A
+    // block in flight to a host that stopped reading is never retired, so then these bytes go too.
+    uint64_t start = time_us_64();
+    while (head - tail == num_blocks) {
+      sr_usb_tx_task();
+      if (time_us_64() > start + PICO_STDIO_USB_STDOUT_TIMEOUT_US) {
+        dropped++;
+        return;
+      }
+    }
+    uint8_t *block = sr_usb_tx_get(NULL);
+    memcpy(block, buf, n);
+    sr_usb_tx_put(NULL, block, n);
+    buf += n;
+    len -= n;
+  }
+}
+
+bool sr_usb_tx_set_store(uint8_t *mem, uint32_t len) {
+  // The blocks the last capture left are in the blocks in use, so send them or give up on them first.
+  // The controller may still be reading one the host stopped taking, and until it is retired neither
+  // the blocks nor the endpoint can change.
+  sr_usb_tx_drain();
+  if (head != tail) {
+    return false;
+  }
+  uint32_t n = len / TX_BUFFER_SIZE;
+  if (n > SR_USB_TX_MAX_BLOCKS) {
+    n = SR_USB_TX_MAX_BLOCKS;
+  }
+  if ((mem == NULL) || (n < SR_USB_TX_BLOCKS)) {
+    mem = tx_blocks;
+    n = SR_USB_TX_BLOCKS;
+  }
+  // Nothing is queued, so skip_to is behind tail and stays there
+  peak = 0;
+  stalls = 0;
+  stall_us = 0;
+  dropped = 0;
+  holding = false;
+  held = 0;
+  blocks = mem;
+  num_blocks = n;
+  return true;
+}
+
+uint32_t sr_usb_tx_peak(void) {
+  return peak;
+}
+
+void sr_usb_tx_stalls(uint32_t *s, uint32_t *us, uint32_t *d) {
+  *s = stalls;
+  *us = stall_us;
+  *d = dropped;
+}
+
+#ifdef SR_USB_VENDOR
+void sr_usb_tx_select_vendor(bool vendor) {
+  vendor_tx = vendor;
+  ep_in = vendor ? SR_USB_VENDOR_EP_IN : SR_USB_CDC_EP_IN;
+}
+
+bool sr_usb_tx_vendor(void) {
+  return vendor_tx;
+}
+#endif
@@ -0,0 +1,97 @@
+#ifndef _SR_USB_H_
+#define _SR_USB_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// ------------------------------------
+// Zero copy USB output of the encoded stream
+//
+// The encoders write straight into a ring of blocks, and each filled block is
+// handed to the CDC data IN endpoint as one transfer. This replaces copying
+// txbuf into the 256B TinyUSB CDC fifo and running tud_task/flush every few
+// dozen bytes. The CDC driver still owns the endpoint for text responses, and
+// usbd_edpt_claim keeps the two from transmitting at the same time. Text written
+// through the CDC fifo must not overtake queued blocks, so sr_usb_tx_drain
+// must be called before it while a capture may have left blocks behind.
+//
+// The ring is lock free between two cores: the encoding core produces blocks
+// with sr_usb_tx_get/put/write and the USB core consumes them with
+// sr_usb_tx_task/drain. Only one core may be the producer at a time.
+//
+// When built with SIGROK_PICO_USB_VENDOR the blocks can go to the bulk IN
+// endpoint of a vendor interface instead, leaving the CDC serial for commands.
+// ------------------------------------
+
+// Number of TX_BUFFER_SIZE blocks in the ring
+#define SR_USB_TX_BLOCKS 4
+
+// Most blocks a store from sr_usb_tx_set_store can hold
+#define SR_USB_TX_MAX_BLOCKS 256
+
+// Encoder tx_get: returns the next free block, waiting for the consumer to
+// free one if all are queued
+uint8_t *sr_usb_tx_get(void *ctx);
+
+// Like sr_usb_tx_get, but returns NULL rather than keep waiting once give_up
+// returns true. It is checked whenever the wait wakes, so the event it looks
+// for must come with an IRQ or SEV on the producer core.
+uint8_t *sr_usb_tx_get_unless(bool (*give_up)(void));
+
+// The producer would have to wait for a free block
+bool sr_usb_tx_full(void);
+
+// Hold the blocks put from now on back from the consumer until they are
+// committed, so that they can still be discarded. hold false commits those
+// held and goes back to queueing each block as it is put.
+void sr_usb_tx_hold(bool hold);
+
+// Queue the blocks held back
+void sr_usb_tx_commit(void);
+
+// Forget the blocks held back, as if they had never been put
+void sr_usb_tx_discard(void);
+
+// Encoder tx_put: queues the first len bytes of the block from sr_usb_tx_get
+void sr_usb_tx_put(void *ctx, uint8_t *buf, uint32_t len);
+
+// Retire the block in flight once sent and start the next one. Called from
+// the USB core main loop, which also drops blocks if the host is gone.
+void sr_usb_tx_task(void);
+
+// Wait on the USB core until all queued blocks are sent
+void sr_usb_tx_drain(void);
+
+// Queue bytes that don't come from the encoder, like the end of capture
+// markers, so that they reach the host in order with the samples. Called on
+// the USB core once the encoder is done, it sends queued blocks to make room.
+void sr_usb_tx_write(const char *buf, uint32_t len);
+
+// Use len bytes of mem, which must be word aligned, for the blocks instead of the
+// built in SR_USB_TX_BLOCKS. A large store lets the encoder run ahead of the
+// USB, and as the blocks hold encoded samples a slow signal needs much less
+// of it than the raw DMA buffer. NULL, or a store smaller than the built in
+// blocks, goes back to them. Called on the USB core, it first sends or drops
+// the queued blocks, and returns false without changing anything if a block
+// the host stopped reading is still in flight.
+bool sr_usb_tx_set_store(uint8_t *mem, uint32_t len);
+
+// Most blocks that were queued at once since the last sr_usb_tx_set_store
+uint32_t sr_usb_tx_peak(void);
+
+// How often the producer had to wait for the host since the last
+// sr_usb_tx_set_store: the times sr_usb_tx_get found no free block and the
+// us it waited in total, and the blocks dropped as the host stopped reading
+void sr_usb_tx_stalls(uint32_t *stalls, uint32_t *stall_us, uint32_t *dropped);
+
+#ifdef SR_USB_VENDOR
+// Send the blocks to the vendor interface rather than the CDC serial. Must
+// only be changed while no blocks are queued, such as after
+// sr_usb_tx_set_store succeeded.
+void sr_usb_tx_select_vendor(bool vendor);
+
+// The blocks go to the vendor interface, so CDC text can't overtake them
+bool sr_usb_tx_vendor(void);
+#endif
+
+#endif // _SR_USB_H_
@@ -0,0 +1,57 @@
+#ifndef _TUSB_CONFIG_H_
+#define _TUSB_CONFIG_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//-------------------------------------
+// COMMON CONFIGURATION
+//-------------------------------------
+
+// Set TinyUSB OS to pico-sdk
+#define CFG_TUSB_OS OPT_OS_PICO
+
+// Memory alignment macros
+#define CFG_TUSB_MEM_SECTION
+#define CFG_TUSB_MEM_ALIGN __attribute__((aligned(4)))
+
+//-------------------------------------
+// DEVICE CONFIGURATION
+//-------------------------------------
+
+// Enable device stack
+#define CFG_TUD_ENABLED 1
+
+// Set device roothub port
+#ifndef BOARD_TUD_RHPORT
+#define BOARD_TUD_RHPORT 0
+#endif
+
+// Set endpoint size
+#ifndef CFG_TUD_ENDPOINT0_SIZE
+#define CFG_TUD_ENDPOINT0_SIZE 64
+#endif
+
+// Device classes: CDC serial for commands and responses, and a vendor
+// interface whose bulk IN endpoint can carry the capture data
+#define CFG_TUD_CDC 1
+#define CFG_TUD_VENDOR 1
+
+//-------------------------------------
+// Class-specific configuration
+
+// Same CDC buffers as the pico-sdk stdio_usb configuration
+#define CFG_TUD_CDC_RX_BUFSIZE 256
+#define CFG_TUD_CDC_TX_BUFSIZE 256
+
+// Capture data goes from the sr_usb blocks straight to the endpoint, so the
+// vendor fifos are not used
+#define CFG_TUD_VENDOR_RX_BUFSIZE 64
+#define CFG_TUD_VENDOR_TX_BUFSIZE 64
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _TUSB_CONFIG_H_